@@ -0,0 +1,350 @@
+#include "accuracy.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "detector.hpp"
+#include "parallel.hpp"
+#include "pic.hpp"
+#include "scoring.hpp"
+#include "synthetic.hpp"
+
+namespace
+{
+enum class equalizer
+{
+    none,
+    sliding,
+    tiled
+};
+
+enum class threshold
+{
+    table,
+    packed,
+    exact,
+    fused
+};
+
+struct Pipeline
+{
+    std::string name;
+    equalizer equalize;
+    rrec::blur_engine background;
+    threshold significance;
+    rrec::cluster_engine engine;
+};
+
+// the numbers every pipeline shares
+struct Settings
+{
+    int length = 51; // equalization window (or tile)
+    int L = 51;
+    int d = 5;
+    double sigma = 2.0;
+    int window = 0; // exact significance only, < 1 uses L
+    int eps = 9;    // grid engine only
+    int minPts = 40;
+    int threads = 0;
+};
+
+// parses "sliding/opencv/table/union_find", returns false if any part
+// isn't recognised
+bool parse_pipeline(const std::string &spec, Pipeline &p)
+{
+    std::vector<std::string> parts;
+    std::stringstream in(spec);
+    std::string part;
+    while (std::getline(in, part, '/'))
+        parts.push_back(part);
+    if (parts.size() != 4)
+        return false;
+
+    p.name = spec;
+
+    if (parts[0] == "none")
+        p.equalize = equalizer::none;
+    else if (parts[0] == "sliding")
+        p.equalize = equalizer::sliding;
+    else if (parts[0] == "tiled")
+        p.equalize = equalizer::tiled;
+    else
+        return false;
+
+    if (parts[1] == "opencv")
+        p.background = rrec::blur_engine::opencv;
+    else if (parts[1] == "recursive")
+        p.background = rrec::blur_engine::recursive;
+    else
+        return false;
+
+    if (parts[2] == "table")
+        p.significance = threshold::table;
+    else if (parts[2] == "packed")
+        p.significance = threshold::packed;
+    else if (parts[2] == "exact")
+        p.significance = threshold::exact;
+    else if (parts[2] == "fused")
+        p.significance = threshold::fused;
+    else
+        return false;
+
+    if (parts[3] == "dbscan")
+        p.engine = rrec::cluster_engine::dbscan;
+    else if (parts[3] == "union_find")
+        p.engine = rrec::cluster_engine::union_find;
+    else if (parts[3] == "grid")
+        p.engine = rrec::cluster_engine::grid;
+    else
+        return false;
+
+    return true;
+}
+
+// the original pipeline first, then each fast path on its own, then all of
+// them at once
+const char *default_pipelines[] = {
+    "sliding/opencv/table/dbscan",     "sliding/opencv/table/union_find",
+    "none/opencv/table/union_find",    "tiled/opencv/table/union_find",
+    "sliding/recursive/table/union_find", "sliding/opencv/packed/union_find",
+    "sliding/opencv/exact/union_find", "sliding/opencv/fused/union_find",
+    "sliding/opencv/table/grid",       "tiled/recursive/packed/union_find",
+};
+
+void run_pipeline(rrec::Detector &detector, const Pipeline &p,
+                  const Settings &s, cv::Mat frame)
+{
+    detector.use_image_main(frame);
+
+    if (p.equalize == equalizer::sliding)
+        detector.adaptive_hist_eq(s.length);
+    else if (p.equalize == equalizer::tiled)
+        detector.adaptive_hist_eq_tiled(s.length, s.threads);
+
+    if (p.significance == threshold::fused)
+    {
+        detector.detect_significance(s.L, s.d, s.sigma, false, s.threads);
+    }
+    else
+    {
+        detector.calculate_background(s.L, p.background);
+        detector.calculate_signal(s.d);
+        if (p.significance == threshold::table)
+            detector.calculate_significance(s.sigma);
+        else if (p.significance == threshold::packed)
+            detector.calculate_significance_packed(s.sigma);
+        else
+            detector.calculate_significance_exact(s.sigma, s.window);
+    }
+
+    if (p.engine == rrec::cluster_engine::grid)
+        detector.cluster_grid(s.eps, s.minPts, s.threads);
+    else
+        detector.cluster(p.engine, s.threads);
+}
+
+struct Outcome
+{
+    std::string pipeline;
+    rrec::DetectionScore score;
+    double ms_per_frame;
+};
+} // namespace
+
+int run_accuracy(int argc, char **argv)
+{
+    rrec::SyntheticParams params;
+    Settings settings;
+    std::vector<Pipeline> pipelines;
+    int frames = 4;
+    int reps = 3;
+    double tolerance = -1; // defaults to the radius, once that's known
+    int min_area = 0;
+    const char *write_prefix = nullptr;
+    const char *json_path = nullptr;
+
+    for (int a = 1; a + 1 < argc; a += 2)
+    {
+        std::string option = argv[a];
+        const char *value = argv[a + 1];
+        if (option == "--frames")
+            frames = std::max(1, std::atoi(value));
+        else if (option == "--reps")
+            reps = std::max(1, std::atoi(value));
+        else if (option == "--rows")
+            params.rows = std::atoi(value);
+        else if (option == "--cols")
+            params.cols = std::atoi(value);
+        else if (option == "--spacing")
+            params.spacing = std::atof(value);
+        else if (option == "--density")
+            params.density = std::atof(value);
+        else if (option == "--radius")
+            params.radius = std::atof(value);
+        else if (option == "--contrast")
+            params.contrast = std::atof(value);
+        else if (option == "--noise")
+            params.noise = std::atof(value);
+        else if (option == "--gradient")
+            params.gradient_row = params.gradient_col = std::atof(value);
+        else if (option == "--vignette")
+            params.vignette = std::atof(value);
+        else if (option == "--fill")
+            params.fill = std::atof(value);
+        else if (option == "--seed")
+            params.seed = std::strtoul(value, nullptr, 10);
+        else if (option == "--length")
+            settings.length = std::atoi(value);
+        else if (option == "--L")
+            settings.L = std::atoi(value);
+        else if (option == "--d")
+            settings.d = std::atoi(value);
+        else if (option == "--sigma")
+            settings.sigma = std::atof(value);
+        else if (option == "--window")
+            settings.window = std::atoi(value);
+        else if (option == "--eps")
+            settings.eps = std::atoi(value);
+        else if (option == "--min-pts")
+            settings.minPts = std::atoi(value);
+        else if (option == "--threads")
+            settings.threads = std::atoi(value);
+        else if (option == "--tolerance")
+            tolerance = std::atof(value);
+        else if (option == "--min-area")
+            min_area = std::atoi(value);
+        else if (option == "--write")
+            write_prefix = value;
+        else if (option == "--json")
+            json_path = value;
+        else if (option == "--pipeline")
+        {
+            Pipeline p;
+            if (!parse_pipeline(value, p))
+            {
+                std::fprintf(stderr, "bad pipeline %s, see bench/accuracy.hpp\n", value);
+                return 1;
+            }
+            pipelines.push_back(p);
+        }
+        else
+        {
+            std::fprintf(stderr, "unknown option %s, see bench/accuracy.hpp\n",
+                         option.c_str());
+            return 1;
+        }
+    }
+    if (pipelines.empty())
+    {
+        for (const char *spec : default_pipelines)
+        {
+            Pipeline p;
+            parse_pipeline(spec, p);
+            pipelines.push_back(p);
+        }
+    }
+    if (tolerance < 0)
+        tolerance = params.radius;
+    settings.threads = rrec::resolve_threads(settings.threads);
+
+    // every frame is made up front, with the seed going up by one per frame
+    std::vector<cv::Mat> images(frames);
+    std::vector<std::vector<rrec::TruthPoint>> truths(frames);
+    for (int f = 0; f < frames; ++f)
+    {
+        rrec::SyntheticParams frame_params = params;
+        frame_params.seed = params.seed + f;
+
+        truths[f] = rrec::synthetic_frame(frame_params, images[f]);
+
+        if (write_prefix)
+        {
+            // the same frame again, as the floats a .pic holds
+            std::vector<float> pixels;
+            rrec::synthetic_pic(frame_params, pixels);
+            std::string base = std::string(write_prefix) + "_" + std::to_string(f);
+            if (!rrec::write_pic(base + ".pic", pixels.data(), params.rows, params.cols) ||
+                !rrec::write_truth(base + ".csv", truths[f]))
+            {
+                std::fprintf(stderr, "couldn't write %s.pic/.csv\n", base.c_str());
+                return 1;
+            }
+        }
+    }
+
+    std::printf("%d frames of %d x %d, %zu skyrmions in the first, matched within %.1f px\n",
+                frames, params.rows, params.cols, truths[0].size(), tolerance);
+    std::printf("%-36s %9s %9s %7s %9s %10s\n", "pipeline", "precision",
+                "recall", "f1", "error/px", "ms/frame");
+
+    std::vector<Outcome> outcomes;
+    rrec::Detector detector;
+    for (const Pipeline &p : pipelines)
+    {
+        Outcome outcome{p.name, {}, 0};
+        for (int f = 0; f < frames; ++f)
+        {
+            // equalization writes into the frame, so every run gets a copy.
+            // The best of reps is the time kept
+            double best = 1e300;
+            for (int r = 0; r < reps; ++r)
+            {
+                cv::Mat frame = images[f].clone();
+                auto start = std::chrono::steady_clock::now();
+                run_pipeline(detector, p, settings, frame);
+                auto stop = std::chrono::steady_clock::now();
+                best = std::min(best, std::chrono::duration<double, std::milli>(stop - start).count());
+            }
+            outcome.ms_per_frame += best / frames;
+            outcome.score += rrec::score_detections(detector.get_clusters(),
+                                                    truths[f], tolerance, min_area);
+        }
+
+        const rrec::DetectionScore &s = outcome.score;
+        std::printf("%-36s %9.4f %9.4f %7.4f %9.3f %10.3f\n", p.name.c_str(),
+                    s.precision(), s.recall(), s.f1(), s.mean_error,
+                    outcome.ms_per_frame);
+        std::fflush(stdout);
+        outcomes.push_back(outcome);
+    }
+
+    if (json_path)
+    {
+        FILE *file = std::fopen(json_path, "w");
+        if (!file)
+        {
+            std::fprintf(stderr, "couldn't write %s\n", json_path);
+            return 1;
+        }
+        std::fprintf(file,
+                     "{\n  \"frames\": %d, \"rows\": %d, \"cols\": %d, \"spacing\": %g, "
+                     "\"radius\": %g, \"contrast\": %g, \"noise\": %g, \"seed\": %u,\n"
+                     "  \"tolerance\": %g, \"min_area\": %d, \"threads\": %d,\n"
+                     "  \"results\": [\n",
+                     frames, params.rows, params.cols, params.spacing, params.radius,
+                     params.contrast, params.noise, params.seed, tolerance, min_area,
+                     settings.threads);
+        for (std::size_t k = 0; k < outcomes.size(); ++k)
+        {
+            const rrec::DetectionScore &s = outcomes[k].score;
+            std::fprintf(file,
+                         "    {\"pipeline\": \"%s\", \"true_positives\": %d, "
+                         "\"false_positives\": %d, \"false_negatives\": %d, "
+                         "\"precision\": %g, \"recall\": %g, \"f1\": %g, "
+                         "\"mean_error\": %g, \"ms_per_frame\": %g}%s\n",
+                         outcomes[k].pipeline.c_str(), s.true_positives,
+                         s.false_positives, s.false_negatives, s.precision(),
+                         s.recall(), s.f1(), s.mean_error, outcomes[k].ms_per_frame,
+                         k + 1 < outcomes.size() ? "," : "");
+        }
+        std::fprintf(file, "  ]\n}\n");
+        std::fclose(file);
+    }
+    return 0;
+}
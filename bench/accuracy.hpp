@@ -0,0 +1,21 @@
+#pragma once
+
+// Speed against accuracy: synthetic frames with known skyrmion positions (see
+// synthetic.hpp) go through one or more pipeline configurations, and each
+// gets its precision, recall, F1, mean centroid error and time per frame:
+//
+//     rrec_bench accuracy [--frames N] [--reps N] [--rows N] [--cols N]
+//         [--spacing PX | --density X] [--radius PX] [--contrast X] [--noise X]
+//         [--gradient X] [--vignette X] [--fill X] [--seed N]
+//         [--pipeline EQUALIZE/BACKGROUND/SIGNIFICANCE/ENGINE]...
+//         [--length N] [--L N] [--d N] [--sigma X] [--window N]
+//         [--eps N] [--min-pts N] [--threads N]
+//         [--tolerance PX] [--min-area N] [--write PREFIX] [--json PATH]
+//
+// where EQUALIZE is none, sliding or tiled, BACKGROUND is opencv or
+// recursive, SIGNIFICANCE is table, packed, exact or fused (which does its
+// own blurs, so BACKGROUND doesn't matter) and ENGINE is dbscan, union_find
+// or grid. Without --pipeline a set covering every fast path is run.
+// --write also saves each frame as PREFIX_<n>.pic with its truth in
+// PREFIX_<n>.csv
+int run_accuracy(int argc, char **argv);
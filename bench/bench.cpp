@@ -0,0 +1,323 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+
+#include "dbscan.hpp"
+#include "equalizer.hpp"
+#include "gaussian.hpp"
+#include "significance.hpp"
+#include "parallel.hpp"
+#include "pipeline.hpp"
+#include "synthetic.hpp"
+#include "suite.hpp"
+#include "accuracy.hpp"
+#include "equivalence.hpp"
+#include "load.hpp"
+
+// times fn, returning the best of reps runs in milliseconds
+template <typename F>
+double time_ms(F fn, int reps)
+{
+    double best = 1e300;
+    for (int r = 0; r < reps; ++r)
+    {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        auto stop = std::chrono::steady_clock::now();
+        double ms = std::chrono::duration<double, std::milli>(stop - start).count();
+        if (ms < best)
+            best = ms;
+    }
+    return best;
+}
+
+// each fast kernel against the one it replaced (or its approximation against
+// the exact version), at one frame size
+int compare(int argc, char **argv)
+{
+    // defaults to the size of the frames our camera produces
+    int rows = argc > 1 ? std::atoi(argv[1]) : 1296;
+    int cols = argc > 2 ? std::atoi(argv[2]) : 1728;
+    int reps = argc > 3 ? std::atoi(argv[3]) : 3;
+
+    // deterministic noise so runs are comparable between commits
+    cv::Mat frame(rows, cols, CV_8UC1);
+    std::mt19937 rng(12345);
+    for (int i = 0; i < rows; ++i)
+    {
+        unsigned char *p = frame.ptr<unsigned char>(i);
+        for (int j = 0; j < cols; ++j)
+            p[j] = rng() & 255;
+    }
+
+    std::printf("adaptive histogram equalization, %d x %d, best of %d\n",
+                rows, cols, reps);
+    std::printf("%8s %14s %14s %9s %6s\n", "length", "reference/ms",
+                "sliding/ms", "speedup", "same");
+
+    for (int length : {15, 51, 151})
+    {
+        cv::Mat ref, fast;
+        double t_ref = time_ms([&] { rrec::reference_hist_eq(frame, ref, length); },
+                               reps);
+        double t_fast = time_ms([&] { rrec::sliding_hist_eq(frame, fast, length); },
+                                reps);
+
+        bool same = true;
+        for (int i = 0; i < rows && same; ++i)
+            same = std::memcmp(ref.ptr<unsigned char>(i),
+                               fast.ptr<unsigned char>(i), cols) == 0;
+
+        std::printf("%8d %14.2f %14.2f %8.2fx %6s\n", length, t_ref, t_fast,
+                    t_ref / t_fast, same ? "yes" : "NO");
+    }
+
+    // the tiled approximation, against the exact output at the same size
+    std::printf("\n%8s %8s %14s %14s\n", "tile", "threads", "tiled/ms",
+                "mean |error|");
+    for (int tile : {51, 151})
+    {
+        cv::Mat exact;
+        rrec::sliding_hist_eq(frame, exact, tile);
+
+        for (int threads : {1, 0})
+        {
+            cv::Mat tiled;
+            double t = time_ms([&] { rrec::tiled_hist_eq(frame, tiled, tile, threads); },
+                               reps);
+
+            double error = 0;
+            for (int i = 0; i < rows; ++i)
+                for (int j = 0; j < cols; ++j)
+                    error += std::abs(tiled.ptr<unsigned char>(i)[j] -
+                                      exact.ptr<unsigned char>(i)[j]);
+            error /= static_cast<double>(rows) * cols;
+
+            std::printf("%8d %8d %14.2f %14.2f\n", tile,
+                        rrec::resolve_threads(threads), t, error);
+        }
+    }
+
+    // background blurs: recursive approximation against cv::GaussianBlur
+    std::printf("\n%8s %14s %14s %10s %10s\n", "L", "opencv/ms",
+                "recursive/ms", "max err", "mean err");
+    for (int L : {15, 51, 151, 301})
+    {
+        cv::Mat exact, approx;
+        double t_cv = time_ms([&] { cv::GaussianBlur(frame, exact, cv::Size(L, L), 0); },
+                              reps);
+        double t_iir = time_ms([&] {
+            rrec::recursive_gaussian_blur(frame, approx, rrec::gaussian_sigma(L), 0);
+        },
+                               reps);
+
+        int max_error = 0;
+        double error = 0;
+        for (int i = 0; i < rows; ++i)
+            for (int j = 0; j < cols; ++j)
+            {
+                int e = std::abs(approx.ptr<unsigned char>(i)[j] -
+                                 exact.ptr<unsigned char>(i)[j]);
+                max_error = std::max(max_error, e);
+                error += e;
+            }
+        error /= static_cast<double>(rows) * cols;
+
+        std::printf("%8d %14.2f %14.2f %10d %10.3f\n", L, t_cv, t_iir,
+                    max_error, error);
+    }
+
+    // significance: the per-pixel floating point reference against the 256
+    // entry table (looked up with pshufb where the CPU has SSSE3 or AVX2)
+    cv::Mat background;
+    cv::GaussianBlur(frame, background, cv::Size(51, 51), 0);
+    std::printf("\n%8s %14s %14s %9s %6s\n", "sigma", "reference/ms",
+                "table/ms", "speedup", "same");
+    for (double sigma : {0.5, 1.0, 2.0})
+    {
+        cv::Mat ref, fast;
+        double t_ref = time_ms([&] {
+            rrec::reference_significance(frame, background, ref, sigma);
+        },
+                               reps);
+        double t_fast = time_ms([&] {
+            rrec::table_significance(frame, background, fast, sigma);
+        },
+                                reps);
+
+        bool same = true;
+        for (int i = 0; i < rows && same; ++i)
+            same = std::memcmp(ref.ptr<unsigned char>(i),
+                               fast.ptr<unsigned char>(i), cols) == 0;
+
+        std::printf("%8.2f %14.2f %14.2f %8.2fx %6s\n", sigma, t_ref, t_fast,
+                    t_ref / t_fast, same ? "yes" : "NO");
+    }
+
+    // exact local statistics, relative to the table version above
+    for (int window : {51, 151})
+    {
+        cv::Mat fast, exact;
+        double t_fast = time_ms([&] {
+            rrec::table_significance(frame, background, fast, 1.0);
+        },
+                                reps);
+        double t_exact = time_ms([&] {
+            rrec::exact_significance(frame, frame, background, exact, window,
+                                     1.0, 1);
+        },
+                                 reps);
+        std::printf("exact stddev, window %d: %.2f ms (%.2fx the table version)\n",
+                    window, t_exact, t_exact / t_fast);
+    }
+
+    // clustering: blobs from thresholding the blurred noise, DBSCAN against
+    // the union find engine on 1..all threads
+    rrec::PackedMask blobs;
+    {
+        cv::Mat thresh(rows, cols, CV_8UC1);
+        for (int i = 0; i < rows; ++i)
+            for (int j = 0; j < cols; ++j)
+                thresh.ptr<unsigned char>(i)[j] =
+                    background.ptr<unsigned char>(i)[j] > 128 ? 255 : 0;
+        blobs.from_mat(thresh);
+    }
+    std::printf("\n%8s %12s %12s %6s\n", "engine", "threads", "time/ms",
+                "same");
+
+    cv::Mat drawn(rows, cols, CV_8UC1);
+    std::vector<rrec::Cluster> reference;
+    double t_dbscan = time_ms([&] {
+        rrec::DBSCAN scanner{rows * cols};
+        reference = scanner.getClusters(blobs, drawn,
+                                        rrec::cluster_engine::dbscan);
+    },
+                              reps);
+    std::printf("%8s %12d %12.2f %6s\n", "dbscan", 1, t_dbscan, "-");
+
+    // the engines below share one workspace, like the Detector's
+    rrec::ClusterWorkspace workspace;
+    for (int threads : {1, 2, 4, 0})
+    {
+        std::vector<rrec::Cluster> clusters;
+        double t = time_ms([&] {
+            rrec::DBSCAN scanner{workspace};
+            scanner.setThreads(threads);
+            clusters = scanner.getClusters(blobs, drawn,
+                                           rrec::cluster_engine::union_find);
+        },
+                           reps);
+
+        // a quick check on this one mask, rrec_bench clusters checks the
+        // points themselves on thousands of them
+        bool same = clusters.size() == reference.size();
+        for (size_t k = 0; k < clusters.size() && same; ++k)
+            same = clusters[k].numCorePoints() == reference[k].numCorePoints() &&
+                   clusters[k].numOuterPoints() == reference[k].numOuterPoints();
+
+        std::printf("%8s %12d %12.2f %6s\n", "unionfind",
+                    rrec::resolve_threads(threads), t, same ? "yes" : "NO");
+    }
+
+    // general DBSCAN: the cost shouldn't grow with eps
+    std::printf("\n%8s %8s %12s %12s %10s\n", "eps", "minPts", "threads",
+                "time/ms", "clusters");
+    for (int eps : {3, 9, 25})
+    {
+        for (int threads : {1, 0})
+        {
+            std::vector<rrec::Cluster> clusters;
+            int minPts = eps * eps / 2;
+            double t = time_ms([&] {
+                rrec::DBSCAN scanner{workspace};
+                scanner.setThreads(threads);
+                scanner.setParameters(eps, minPts);
+                clusters = scanner.getClusters(blobs, drawn,
+                                               rrec::cluster_engine::grid);
+            },
+                               reps);
+            std::printf("%8d %8d %12d %12.2f %10zu\n", eps, minPts,
+                        rrec::resolve_threads(threads), t, clusters.size());
+        }
+    }
+    std::printf("clustering workspace peak: %.1f MB (%.1f bytes/pixel)\n",
+                workspace.peak_bytes() / 1e6,
+                workspace.peak_bytes() / (static_cast<double>(rows) * cols));
+
+    // whole frames, one after another through run_algorithm against the
+    // pipelined engine (with one thread per stage, so neither gets more
+    // threads per kernel than the other)
+    const int num_frames = 16;
+    std::vector<cv::Mat> frames(num_frames);
+    for (int f = 0; f < num_frames; ++f)
+    {
+        rrec::SyntheticParams params;
+        params.rows = rows;
+        params.cols = cols;
+        params.seed = f + 1;
+        rrec::synthetic_frame(params, frames[f]);
+    }
+    rrec::AlgorithmParams params{51, 51, 5, 2.0, rrec::cluster_engine::union_find,
+                                 1, 9, 40};
+
+    std::vector<std::vector<unsigned char>> sequential(num_frames);
+    double t_sequential = time_ms([&] {
+        rrec::Detector detector;
+        for (int f = 0; f < num_frames; ++f)
+        {
+            detector.set_image_main(frames[f]);
+            detector.is_open = true;
+            detector.run_algorithm(params);
+            sequential[f] = detector.serialized_clusters();
+        }
+    },
+                                  reps);
+
+    bool same = true;
+    double t_pipelined = time_ms([&] {
+        rrec::FramePipeline pipeline{params, rrec::cluster_format::points, 4};
+        int submitted = 0;
+        while (pipeline.pending() > 0 || submitted < num_frames)
+        {
+            // keep it full, taking a result whenever it can't take more
+            if (submitted < num_frames &&
+                pipeline.try_submit(frames[submitted].data, rows, cols))
+            {
+                ++submitted;
+                continue;
+            }
+            const rrec::PipelineFrame *frame = pipeline.next();
+            same = same && frame->results == sequential[frame->sequence];
+            pipeline.release(frame);
+        }
+    },
+                                 reps);
+
+    std::printf("\n%d frames: run_algorithm %.2f frames/s, pipelined %.2f "
+                "frames/s (%.2fx) %s\n",
+                num_frames, num_frames * 1000 / t_sequential,
+                num_frames * 1000 / t_pipelined, t_sequential / t_pipelined,
+                same ? "same results" : "DIFFERENT RESULTS");
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    // rrec_bench compare [rows cols reps] for the side by side comparisons,
+    // rrec_bench clusters ... to check the clustering engines against each
+    // other (see equivalence.hpp), rrec_bench accuracy ... for accuracy on
+    // synthetic frames (see accuracy.hpp), rrec_bench load ... to load test
+    // the server (see load.hpp), anything else runs the suite (see suite.hpp)
+    if (argc > 1 && std::strcmp(argv[1], "compare") == 0)
+        return compare(argc - 1, argv + 1);
+    if (argc > 1 && std::strcmp(argv[1], "clusters") == 0)
+        return run_equivalence(argc - 1, argv + 1);
+    if (argc > 1 && std::strcmp(argv[1], "accuracy") == 0)
+        return run_accuracy(argc - 1, argv + 1);
+    if (argc > 1 && std::strcmp(argv[1], "load") == 0)
+        return run_load(argc - 1, argv + 1);
+    return run_suite(argc, argv);
+}
@@ -0,0 +1,311 @@
+#include "equivalence.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "dbscan.hpp"
+#include "parallel.hpp"
+
+namespace
+{
+using Point = std::array<int, 2>;
+
+// a random 0/255 mask: uniform noise, or disks on sparse noise
+cv::Mat random_mask(std::mt19937 &rng, int rows, int cols)
+{
+    cv::Mat mask(rows, cols, CV_8UC1);
+    std::uniform_real_distribution<double> unit(0, 1);
+
+    bool disks = rng() % 2 == 0;
+    double density = disks ? 0.05 * unit(rng) : 0.05 + 0.75 * unit(rng);
+    for (int i = 0; i < rows; ++i)
+        for (int j = 0; j < cols; ++j)
+            mask.ptr<unsigned char>(i)[j] = unit(rng) < density ? 255 : 0;
+
+    if (disks)
+    {
+        int num_disks = 1 + rng() % (1 + rows * cols / 100);
+        for (int k = 0; k < num_disks; ++k)
+        {
+            int ci = rng() % rows, cj = rng() % cols;
+            int radius = 1 + rng() % 6;
+            for (int i = std::max(ci - radius, 0); i <= std::min(ci + radius, rows - 1); ++i)
+                for (int j = std::max(cj - radius, 0); j <= std::min(cj + radius, cols - 1); ++j)
+                    if ((i - ci) * (i - ci) + (j - cj) * (j - cj) <= radius * radius)
+                        mask.ptr<unsigned char>(i)[j] = 255;
+        }
+    }
+    return mask;
+}
+
+std::vector<Point> sorted(const rrec::PointRange &points)
+{
+    std::vector<Point> out(points.begin(), points.end());
+    std::sort(out.begin(), out.end());
+    return out;
+}
+
+// the first difference between two lists of clusters, empty if they match
+std::string compare_clusters(const std::vector<rrec::Cluster> &expected,
+                             const std::vector<rrec::Cluster> &got)
+{
+    if (expected.size() != got.size())
+        return std::to_string(expected.size()) + " clusters expected, got " +
+               std::to_string(got.size());
+
+    for (size_t k = 0; k < expected.size(); ++k)
+    {
+        if (sorted(expected[k].corePoints()) != sorted(got[k].corePoints()))
+            return "cluster " + std::to_string(k) + " has different core points";
+        if (sorted(expected[k].outerPoints()) != sorted(got[k].outerPoints()))
+            return "cluster " + std::to_string(k) + " has different outer points";
+    }
+    return "";
+}
+
+bool same_image(const cv::Mat &a, const cv::Mat &b)
+{
+    if (a.rows != b.rows || a.cols != b.cols)
+        return false;
+    for (int i = 0; i < a.rows; ++i)
+        if (std::memcmp(a.ptr<unsigned char>(i), b.ptr<unsigned char>(i), a.cols) != 0)
+            return false;
+    return true;
+}
+
+// DBSCAN straight from the definition do_grid documents: a significant
+// point is core if its eps x eps square (clipped to the image) holds at
+// least minPts significant points, core points in each other's squares are
+// in the same cluster, clusters are numbered in the raster order of their
+// first core point, and any other significant point with a core point in
+// its square goes to the lowest numbered of their clusters
+std::vector<rrec::Cluster> brute_force_grid(const cv::Mat &mask, int eps, int minPts)
+{
+    int rows = mask.rows, cols = mask.cols, r = eps / 2;
+    auto significant = [&](int i, int j) { return mask.ptr<unsigned char>(i)[j] != 0; };
+
+    std::vector<char> core(static_cast<size_t>(rows) * cols, 0);
+    for (int i = 0; i < rows; ++i)
+        for (int j = 0; j < cols; ++j)
+        {
+            if (!significant(i, j))
+                continue;
+            int count = 0;
+            for (int y = std::max(i - r, 0); y <= std::min(i + r, rows - 1); ++y)
+                for (int x = std::max(j - r, 0); x <= std::min(j + r, cols - 1); ++x)
+                    count += significant(y, x);
+            core[i * cols + j] = count >= minPts;
+        }
+
+    std::vector<int> label(static_cast<size_t>(rows) * cols, -1);
+    std::vector<rrec::Cluster> clusters;
+    std::vector<Point> stack;
+    for (int i = 0; i < rows; ++i)
+        for (int j = 0; j < cols; ++j)
+        {
+            if (!core[i * cols + j] || label[i * cols + j] >= 0)
+                continue;
+
+            int n = static_cast<int>(clusters.size());
+            clusters.push_back(rrec::Cluster(2 * n));
+            label[i * cols + j] = n;
+            stack.assign(1, Point{i, j});
+            while (!stack.empty())
+            {
+                Point p = stack.back();
+                stack.pop_back();
+                for (int y = std::max(p[0] - r, 0); y <= std::min(p[0] + r, rows - 1); ++y)
+                    for (int x = std::max(p[1] - r, 0); x <= std::min(p[1] + r, cols - 1); ++x)
+                        if (core[y * cols + x] && label[y * cols + x] < 0)
+                        {
+                            label[y * cols + x] = n;
+                            stack.push_back(Point{y, x});
+                        }
+            }
+        }
+
+    for (int i = 0; i < rows; ++i)
+        for (int j = 0; j < cols; ++j)
+        {
+            if (core[i * cols + j])
+            {
+                clusters[label[i * cols + j]].addCore(i, j);
+                continue;
+            }
+            if (!significant(i, j))
+                continue;
+
+            int owner = -1;
+            for (int y = std::max(i - r, 0); y <= std::min(i + r, rows - 1); ++y)
+                for (int x = std::max(j - r, 0); x <= std::min(j + r, cols - 1); ++x)
+                    if (core[y * cols + x] && (owner < 0 || label[y * cols + x] < owner))
+                        owner = label[y * cols + x];
+            if (owner >= 0)
+                clusters[owner].addOuter(i, j);
+        }
+    return clusters;
+}
+
+// what getClusters draws for clusters: core points 128, outer points 255,
+// everything else 0, less the clusters its pruning throws out
+cv::Mat draw(const std::vector<rrec::Cluster> &clusters, int rows, int cols)
+{
+    cv::Mat image(rows, cols, CV_8UC1);
+    for (int i = 0; i < rows; ++i)
+        std::memset(image.ptr<unsigned char>(i), 0, cols);
+    if (clusters.empty())
+        return image;
+
+    double mean = 0, stddev = 0;
+    for (const rrec::Cluster &cluster : clusters)
+        mean += cluster.statistics().area;
+    mean /= clusters.size();
+    for (const rrec::Cluster &cluster : clusters)
+    {
+        double area = cluster.statistics().area;
+        stddev += (area - mean) * (area - mean);
+    }
+    stddev = std::sqrt(stddev / clusters.size());
+    int upperBound = mean + stddev;
+
+    for (const rrec::Cluster &cluster : clusters)
+    {
+        long long area = cluster.statistics().area;
+        bool keep_core = area <= upperBound && area >= 4;
+        bool keep_outer = keep_core || area <= 2 * stddev + mean;
+        for (Point p : cluster.corePoints())
+            image.ptr<unsigned char>(p[0])[p[1]] = keep_core ? 128 : 0;
+        for (Point p : cluster.outerPoints())
+            image.ptr<unsigned char>(p[0])[p[1]] = keep_outer ? 255 : 0;
+    }
+    return image;
+}
+
+struct Checker
+{
+    int mismatches = 0;
+    int checks = 0;
+    bool verbose = false;
+
+    void check(bool ok, const std::string &what, const std::string &why, int mask,
+               int rows, int cols)
+    {
+        ++checks;
+        if (ok)
+            return;
+        if (++mismatches <= 10 || verbose)
+            std::printf("mask %d (%d x %d), %s: %s\n", mask, rows, cols,
+                        what.c_str(), why.c_str());
+    }
+};
+} // namespace
+
+int run_equivalence(int argc, char **argv)
+{
+    int num_masks = 3000;
+    unsigned long seed = 1;
+    bool verbose = false;
+
+    for (int a = 1; a + 1 < argc; a += 2)
+    {
+        std::string option = argv[a];
+        const char *value = argv[a + 1];
+        if (option == "--masks")
+            num_masks = std::max(1, std::atoi(value));
+        else if (option == "--seed")
+            seed = std::strtoul(value, nullptr, 10);
+        else if (option == "--verbose")
+            verbose = std::atoi(value) != 0;
+        else
+        {
+            std::fprintf(stderr, "unknown option %s, see bench/equivalence.hpp\n",
+                         option.c_str());
+            return 1;
+        }
+    }
+
+    const int thread_counts[] = {1, 2, 3, 4, 0};
+    const int grid_params[][2] = {{3, 4}, {1, 1}, {5, 6}, {9, 20}};
+
+    std::mt19937 rng(seed);
+    Checker checker;
+    checker.verbose = verbose;
+
+    // one workspace for everything, like the Detector's, so reusing it
+    // between masks of different sizes gets checked too
+    rrec::ClusterWorkspace workspace;
+    for (int m = 0; m < num_masks; ++m)
+    {
+        // mostly small masks, so most of the work is on edges and word
+        // boundaries, with the odd bigger one
+        int rows = m % 50 == 49 ? 200 + rng() % 200 : 1 + rng() % 80;
+        int cols = m % 50 == 49 ? 200 + rng() % 400 : 1 + rng() % 150;
+        cv::Mat mask = random_mask(rng, rows, cols);
+        rrec::PackedMask packed;
+        packed.from_mat(mask);
+
+        cv::Mat reference_image(rows, cols, CV_8UC1);
+        std::vector<rrec::Cluster> reference;
+        {
+            rrec::DBSCAN scanner{workspace};
+            reference = scanner.getClusters(packed, reference_image,
+                                            rrec::cluster_engine::dbscan);
+        }
+        checker.check(same_image(draw(reference, rows, cols), reference_image),
+                      "dbscan", "drawn image isn't its clusters", m, rows, cols);
+
+        for (int threads : thread_counts)
+        {
+            cv::Mat image(rows, cols, CV_8UC1);
+            rrec::DBSCAN scanner{workspace};
+            scanner.setThreads(threads);
+            std::vector<rrec::Cluster> clusters =
+                scanner.getClusters(packed, image, rrec::cluster_engine::union_find);
+
+            std::string what = "union_find, " +
+                               std::to_string(rrec::resolve_threads(threads)) +
+                               " threads";
+            std::string why = compare_clusters(reference, clusters);
+            checker.check(why.empty(), what, why, m, rows, cols);
+            checker.check(same_image(reference_image, image), what,
+                          "drawn image differs from dbscan's", m, rows, cols);
+        }
+
+        for (const auto &p : grid_params)
+        {
+            std::vector<rrec::Cluster> expected = brute_force_grid(mask, p[0], p[1]);
+            cv::Mat expected_image = draw(expected, rows, cols);
+
+            for (int threads : thread_counts)
+            {
+                cv::Mat image(rows, cols, CV_8UC1);
+                rrec::DBSCAN scanner{workspace};
+                scanner.setThreads(threads);
+                scanner.setParameters(p[0], p[1]);
+                std::vector<rrec::Cluster> clusters =
+                    scanner.getClusters(packed, image, rrec::cluster_engine::grid);
+
+                std::string what = "grid eps " + std::to_string(p[0]) + " minPts " +
+                                   std::to_string(p[1]) + ", " +
+                                   std::to_string(rrec::resolve_threads(threads)) +
+                                   " threads";
+                std::string why = compare_clusters(expected, clusters);
+                checker.check(why.empty(), what, why, m, rows, cols);
+                checker.check(same_image(expected_image, image), what,
+                              "drawn image differs from the brute force one", m,
+                              rows, cols);
+            }
+        }
+    }
+
+    std::printf("%d masks (seed %lu), %d checks, %d mismatches\n", num_masks, seed,
+                checker.checks, checker.mismatches);
+    return checker.mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+// Checks the fast clustering engines give exactly the clusters they claim to,
+// on seeded random masks (uniform noise at a range of densities, and disks on
+// sparse noise, at sizes either side of the 64 bit words masks are packed in):
+//
+//     rrec_bench clusters [--masks N] [--seed N] [--verbose 1]
+//
+// union_find, on every thread count, has to match the dbscan engine: the
+// same clusters in the same order with the same core and outer points, and
+// the same drawn image. The grid engine, for a few eps/minPts and every
+// thread count, has to match a brute force DBSCAN over eps x eps squares,
+// with the image drawn from its clusters the way getClusters draws it.
+// Returns 1 if anything differed, after printing the first few differences
+int run_equivalence(int argc, char **argv);
@@ -0,0 +1,816 @@
+#include "load.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "protocol.hpp"
+#include "stats.hpp"
+#include "synthetic.hpp"
+
+namespace
+{
+using steady = std::chrono::steady_clock;
+
+// the instructions we send, numbered as in server.py
+enum opcode : uint32_t
+{
+    loadFromPython = 2,
+    runAlgorithm = 3,
+    equalize = 4,
+    equalizeTiled = 9,
+    detectSignificance = 10,
+    clusterParallel = 15,
+    setClusterFormat = 18,
+    useProtocol = 23,
+    stats = 24
+};
+
+const int32_t success = 0;
+
+template <typename T> void put(std::vector<unsigned char> &out, const T &value)
+{
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(&value);
+    out.insert(out.end(), p, p + sizeof(T));
+}
+
+bool write_all(int fd, const void *data, std::size_t bytes)
+{
+    const char *p = static_cast<const char *>(data);
+    while (bytes > 0)
+    {
+        ssize_t n = ::write(fd, p, bytes);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        bytes -= n;
+    }
+    return true;
+}
+
+bool read_all(int fd, void *data, std::size_t bytes)
+{
+    char *p = static_cast<char *>(data);
+    while (bytes > 0)
+    {
+        ssize_t n = ::read(fd, p, bytes);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        bytes -= n;
+    }
+    return true;
+}
+
+// One client's line to a server, in either protocol version. Requests may be
+// sent from one thread while replies are read on another
+class Connection
+{
+  private:
+    int to_server = -1;
+    int from_server = -1;
+    pid_t child = -1;
+    bool framed = false;
+
+    // appends up to and including the next '\n' to reply
+    bool read_line(std::vector<unsigned char> &reply)
+    {
+        unsigned char c = 0;
+        while (c != '\n')
+        {
+            if (!read_all(from_server, &c, 1))
+                return false;
+            reply.push_back(c);
+        }
+        return true;
+    }
+
+  public:
+    uint64_t bytes_sent = 0;     // only touched by the sending thread
+    uint64_t bytes_received = 0; // and this by the receiving one
+
+    Connection() = default;
+    ~Connection() { close(); }
+    Connection(const Connection &) = delete;
+    Connection &operator=(const Connection &) = delete;
+
+    // runs binary with its stdin and stdout piped to us, like detector.py
+    // does, and switches it to protocol 2 if asked
+    bool spawn(const std::string &binary, int protocol)
+    {
+        int in[2], out[2];
+        if (pipe2(in, O_CLOEXEC) != 0)
+            return false;
+        if (pipe2(out, O_CLOEXEC) != 0)
+        {
+            ::close(in[0]);
+            ::close(in[1]);
+            return false;
+        }
+
+        child = fork();
+        if (child == 0)
+        {
+            dup2(in[0], 0);
+            dup2(out[1], 1);
+            execl(binary.c_str(), binary.c_str(), static_cast<char *>(nullptr));
+            _exit(127);
+        }
+        ::close(in[0]);
+        ::close(out[1]);
+        to_server = in[1];
+        from_server = out[0];
+        if (child < 0)
+            return false;
+
+        if (protocol == 2)
+        {
+            std::vector<unsigned char> payload, reply;
+            put<int32_t>(payload, 2);
+            if (request(useProtocol, payload, reply) != success)
+                return false;
+            framed = true;
+        }
+        return true;
+    }
+
+    bool connect(const std::string &path)
+    {
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            return false;
+        to_server = from_server = fd;
+        framed = true;
+
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path))
+            return false;
+        std::strcpy(address.sun_path, path.c_str());
+        return ::connect(fd, reinterpret_cast<sockaddr *>(&address),
+                         sizeof(address)) == 0;
+    }
+
+    // closing stdin is what tells a spawned server to exit
+    void close()
+    {
+        if (to_server >= 0)
+            ::close(to_server);
+        if (from_server >= 0 && from_server != to_server)
+            ::close(from_server);
+        to_server = from_server = -1;
+        if (child > 0)
+            waitpid(child, nullptr, 0);
+        child = -1;
+    }
+
+    bool send(uint32_t opcode, uint32_t request_id,
+              const std::vector<unsigned char> &payload)
+    {
+        bool ok;
+        if (framed)
+        {
+            rrec::FrameHeader header{static_cast<uint32_t>(payload.size() + 8),
+                                     opcode, request_id};
+            ok = write_all(to_server, &header, sizeof(header));
+            bytes_sent += sizeof(header);
+        }
+        else
+        {
+            ok = write_all(to_server, &opcode, sizeof(opcode));
+            bytes_sent += sizeof(opcode);
+        }
+        bytes_sent += payload.size();
+        return ok && write_all(to_server, payload.data(), payload.size());
+    }
+
+    // reads the reply to the oldest request still unanswered, which was an
+    // opcode, into reply (status first). Returns the status, or -1 if the
+    // server has gone away
+    int receive(uint32_t opcode, std::vector<unsigned char> &reply)
+    {
+        int32_t status;
+        if (framed)
+        {
+            rrec::FrameHeader header;
+            if (!read_all(from_server, &header, sizeof(header)) ||
+                header.length < 12)
+                return -1;
+            reply.resize(header.length - 8);
+            if (!read_all(from_server, reply.data(), reply.size()))
+                return -1;
+            bytes_received += sizeof(header) + reply.size();
+            std::memcpy(&status, reply.data(), sizeof(status));
+            return status;
+        }
+
+        // version 1 replies don't say how long they are, so it depends on
+        // what was asked
+        reply.resize(sizeof(status));
+        if (!read_all(from_server, reply.data(), sizeof(status)))
+            return -1;
+        std::memcpy(&status, reply.data(), sizeof(status));
+
+        bool ok = true;
+        if (status != success || opcode == stats)
+        {
+            ok = read_line(reply); // the error message, or the JSON
+        }
+        else if (opcode == runAlgorithm || opcode == clusterParallel)
+        {
+            // the clusters: body length, cluster count, body
+            int32_t header[2];
+            ok = read_all(from_server, header, sizeof(header)) && header[0] >= 0;
+            if (ok)
+            {
+                std::size_t start = reply.size();
+                reply.resize(start + sizeof(header) + header[0]);
+                std::memcpy(&reply[start], header, sizeof(header));
+                ok = read_all(from_server, &reply[start + sizeof(header)], header[0]);
+            }
+        }
+        bytes_received += reply.size();
+        return ok ? status : -1;
+    }
+
+    int request(uint32_t opcode, const std::vector<unsigned char> &payload,
+                std::vector<unsigned char> &reply)
+    {
+        return send(opcode, 0, payload) ? receive(opcode, reply) : -1;
+    }
+};
+
+// everything the requests are made with
+struct Settings
+{
+    int threads = 1; // per request, the clients are where the parallelism is
+    int length = 51; // equalization window (or tile)
+    int L = 51;
+    int d = 5;
+    double sigma = 2.0;
+};
+
+struct Step
+{
+    std::string name;
+    uint32_t opcode;
+    std::vector<unsigned char> payload;
+};
+
+bool make_step(const std::string &name, const Settings &s, const cv::Mat &frame,
+               Step &step)
+{
+    const int32_t union_find = 1;
+    step.name = name;
+    step.payload.clear();
+    std::vector<unsigned char> &p = step.payload;
+
+    if (name == "load")
+    {
+        step.opcode = loadFromPython;
+        put<int32_t>(p, frame.rows);
+        put<int32_t>(p, frame.cols);
+        p.insert(p.end(), frame.data, frame.data + frame.total());
+    }
+    else if (name == "equalize")
+    {
+        step.opcode = equalize;
+    }
+    else if (name == "tiled")
+    {
+        step.opcode = equalizeTiled;
+        put<int32_t>(p, s.length);
+        put<int32_t>(p, s.threads);
+    }
+    else if (name == "detect")
+    {
+        step.opcode = detectSignificance;
+        put<int32_t>(p, s.L);
+        put<int32_t>(p, s.d);
+        put<double>(p, s.sigma);
+        put<int32_t>(p, 0);
+    }
+    else if (name == "cluster")
+    {
+        step.opcode = clusterParallel;
+        put<int32_t>(p, union_find);
+        put<int32_t>(p, s.threads);
+    }
+    else if (name == "run")
+    {
+        step.opcode = runAlgorithm;
+        put<int32_t>(p, s.length);
+        put<int32_t>(p, s.L);
+        put<int32_t>(p, s.d);
+        put<double>(p, s.sigma);
+        put<int32_t>(p, union_find);
+        put<int32_t>(p, s.threads);
+        put<int32_t>(p, 9);  // eps and minPts, which union_find ignores
+        put<int32_t>(p, 40);
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+// what the clients saw during one run, recorded as replies come in
+struct Measurements
+{
+    explicit Measurements(std::size_t num_steps)
+        : requests(num_steps), request_ns(num_steps)
+    {
+    }
+
+    rrec::Histogram frame;                      // first request sent to last reply
+    std::vector<rrec::Histogram> requests;      // per step of the mix
+    std::vector<std::atomic<uint64_t>> request_ns; // their total, for the mean
+    std::atomic<uint64_t> frames{0};
+    std::atomic<uint64_t> errors{0};
+};
+
+struct Client
+{
+    struct Pending
+    {
+        std::size_t step;
+        steady::time_point sent;
+        steady::time_point frame_start;
+    };
+
+    Connection connection;
+
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<Pending> pending; // sent, waiting for the reply
+    bool done = false;           // nothing more will be sent
+    bool failed = false;         // the server has gone
+};
+
+// sends frames until the deadline, keeping at most depth requests in flight
+void drive(Client &c, const std::vector<Step> &steps, std::size_t depth,
+           steady::time_point deadline)
+{
+    uint32_t request_id = 0;
+    bool failed = false;
+    while (!failed && steady::now() < deadline)
+    {
+        // a frame starts once its first request can go, not while it's
+        // still waiting for room behind the last frame
+        steady::time_point frame_start;
+        for (std::size_t k = 0; k < steps.size() && !failed; ++k)
+        {
+            {
+                std::unique_lock<std::mutex> hold{c.lock};
+                c.changed.wait(hold, [&] { return c.pending.size() < depth || c.failed; });
+                failed = c.failed;
+                if (failed)
+                    break;
+                steady::time_point now = steady::now();
+                if (k == 0)
+                    frame_start = now;
+                c.pending.push_back({k, now, frame_start});
+                c.changed.notify_all();
+            }
+            if (!c.connection.send(steps[k].opcode, request_id++, steps[k].payload))
+                failed = true;
+        }
+    }
+
+    std::lock_guard<std::mutex> hold{c.lock};
+    c.failed = c.failed || failed;
+    c.done = true;
+    c.changed.notify_all();
+}
+
+// reads replies in the order the requests went out, until drive is done
+void collect(Client &c, const std::vector<Step> &steps, Measurements &m)
+{
+    std::vector<unsigned char> reply;
+    while (true)
+    {
+        Client::Pending p;
+        {
+            std::unique_lock<std::mutex> hold{c.lock};
+            c.changed.wait(hold, [&] { return !c.pending.empty() || c.done; });
+            if (c.pending.empty() || c.failed)
+                return;
+            p = c.pending.front();
+        }
+
+        int status = c.connection.receive(steps[p.step].opcode, reply);
+        steady::time_point now = steady::now();
+        if (status < 0)
+        {
+            m.errors.fetch_add(1);
+            std::lock_guard<std::mutex> hold{c.lock};
+            c.failed = true;
+            c.pending.clear();
+            c.changed.notify_all();
+            return;
+        }
+        if (status != success)
+            m.errors.fetch_add(1);
+
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - p.sent).count();
+        m.requests[p.step].record(ns);
+        m.request_ns[p.step].fetch_add(ns);
+        if (p.step + 1 == steps.size())
+        {
+            m.frame.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               now - p.frame_start)
+                               .count());
+            m.frames.fetch_add(1);
+        }
+
+        std::lock_guard<std::mutex> hold{c.lock};
+        c.pending.pop_front();
+        c.changed.notify_all();
+    }
+}
+
+// a number out of the server's stats JSON: field of stage's counters, or
+// of the top level if stage is null
+double stats_field(const std::string &json, const char *stage, const char *field)
+{
+    std::size_t at = 0;
+    if (stage)
+    {
+        at = json.find(std::string("\"") + stage + "\": {");
+        if (at == std::string::npos)
+            return 0;
+    }
+    at = json.find(std::string("\"") + field + "\": ", at);
+    if (at == std::string::npos)
+        return 0;
+    return std::atof(json.c_str() + at + std::strlen(field) + 4);
+}
+
+// sends the stats instruction, returning the JSON ("" if it failed)
+std::string server_stats(Connection &connection, int reset, int enable)
+{
+    std::vector<unsigned char> payload, reply;
+    put<int32_t>(payload, reset);
+    put<int32_t>(payload, enable);
+    if (connection.request(stats, payload, reply) != success)
+        return "";
+    return std::string(reply.begin() + 4, reply.end());
+}
+
+std::vector<double> parse_list(const char *text)
+{
+    std::vector<double> values;
+    std::stringstream in(text);
+    std::string item;
+    while (std::getline(in, item, ','))
+        values.push_back(std::atof(item.c_str()));
+    return values;
+}
+
+std::vector<std::string> parse_names(const char *text)
+{
+    std::vector<std::string> names;
+    std::stringstream in(text);
+    std::string item;
+    while (std::getline(in, item, ','))
+        names.push_back(item);
+    return names;
+}
+
+struct Outcome
+{
+    double megapixels;
+    int clients;
+    double seconds;
+    uint64_t frames;
+    uint64_t requests;
+    uint64_t errors;
+    double mb_up;
+    double mb_down;
+    double frame_ms[4]; // p50, p90, p99, max
+    std::vector<std::vector<double>> step_ms; // per step: p50, p90, p99, max, mean
+    double server_ms;   // mean time in the handler, per request
+    double client_ms;   // mean latency seen by the client, per request
+};
+
+double ms(uint64_t ns) { return ns / 1e6; }
+} // namespace
+
+int run_load(int argc, char **argv)
+{
+    std::string binary = "bin/b.out";
+    std::string socket_path;
+    int protocol = 2;
+    int depth = 1;
+    std::vector<double> sizes = {1, 4};
+    std::vector<double> client_counts = {1, 2, 4};
+    double seconds = 5;
+    std::vector<std::string> mix = {"load", "run"};
+    int format = -1;
+    Settings settings;
+    const char *json_path = nullptr;
+
+    for (int a = 1; a + 1 < argc; a += 2)
+    {
+        std::string option = argv[a];
+        const char *value = argv[a + 1];
+        if (option == "--binary")
+            binary = value;
+        else if (option == "--socket")
+            socket_path = value;
+        else if (option == "--protocol")
+            protocol = std::atoi(value);
+        else if (option == "--depth")
+            depth = std::max(1, std::atoi(value));
+        else if (option == "--sizes")
+            sizes = parse_list(value);
+        else if (option == "--clients")
+            client_counts = parse_list(value);
+        else if (option == "--seconds")
+            seconds = std::atof(value);
+        else if (option == "--mix")
+            mix = parse_names(value);
+        else if (option == "--format")
+        {
+            const char *formats[] = {"points", "spans", "summary", "compact"};
+            for (int f = 0; f < 4; ++f)
+                if (std::strcmp(value, formats[f]) == 0)
+                    format = f;
+            if (format < 0)
+            {
+                std::fprintf(stderr, "unknown format %s\n", value);
+                return 1;
+            }
+        }
+        else if (option == "--threads")
+            settings.threads = std::atoi(value);
+        else if (option == "--length")
+            settings.length = std::atoi(value);
+        else if (option == "--L")
+            settings.L = std::atoi(value);
+        else if (option == "--d")
+            settings.d = std::atoi(value);
+        else if (option == "--sigma")
+            settings.sigma = std::atof(value);
+        else if (option == "--json")
+            json_path = value;
+        else
+        {
+            std::fprintf(stderr, "unknown option %s, see bench/load.hpp\n",
+                         option.c_str());
+            return 1;
+        }
+    }
+    if (!socket_path.empty())
+        protocol = 2;
+    if (protocol != 1 && protocol != 2)
+    {
+        std::fprintf(stderr, "protocol must be 1 or 2\n");
+        return 1;
+    }
+    if (protocol == 1 && depth > 1)
+    {
+        std::fprintf(stderr, "protocol 1 can't pipeline, using --depth 1\n");
+        depth = 1;
+    }
+
+    // a server going away shows up as a failed write, not a signal
+    signal(SIGPIPE, SIG_IGN);
+
+    std::printf("%s, protocol %d, depth %d, mix", socket_path.empty()
+                                                      ? ("spawning " + binary).c_str()
+                                                      : ("connecting to " + socket_path).c_str(),
+                protocol, depth);
+    for (const std::string &name : mix)
+        std::printf(" %s", name.c_str());
+    std::printf("\n%6s %7s %9s %9s %8s %9s %9s %9s %10s %11s %6s\n", "MP",
+                "clients", "frames/s", "req/s", "MB/s up", "MB/s down",
+                "p50/ms", "p99/ms", "server/ms", "overhead/ms", "errors");
+
+    std::vector<Outcome> outcomes;
+    for (double megapixels : sizes)
+    {
+        // 4:3 synthetic frames, like the camera's
+        rrec::SyntheticParams params;
+        params.cols = static_cast<int>(std::lround(std::sqrt(megapixels * 1048576 * 4 / 3) / 8) * 8);
+        params.rows = params.cols * 3 / 4;
+        cv::Mat frame;
+        rrec::synthetic_frame(params, frame);
+
+        std::vector<Step> steps(mix.size());
+        for (std::size_t k = 0; k < mix.size(); ++k)
+        {
+            if (!make_step(mix[k], settings, frame, steps[k]))
+            {
+                std::fprintf(stderr, "unknown request %s in --mix, see bench/load.hpp\n",
+                             mix[k].c_str());
+                return 1;
+            }
+        }
+
+        for (double count : client_counts)
+        {
+            const int num_clients = std::max(1, static_cast<int>(count));
+
+            // connect everyone and send one frame through each before the
+            // clock starts, so nobody is timed allocating their buffers
+            std::vector<std::unique_ptr<Client>> clients;
+            for (int c = 0; c < num_clients; ++c)
+            {
+                clients.emplace_back(new Client);
+                Connection &connection = clients.back()->connection;
+                bool opened = socket_path.empty() ? connection.spawn(binary, protocol)
+                                                  : connection.connect(socket_path);
+                if (!opened)
+                {
+                    std::fprintf(stderr, "couldn't start or reach the server\n");
+                    return 1;
+                }
+
+                std::vector<unsigned char> payload, reply;
+                if (format >= 0)
+                {
+                    put<int32_t>(payload, format);
+                    connection.request(setClusterFormat, payload, reply);
+                }
+                for (const Step &step : steps)
+                {
+                    if (connection.request(step.opcode, step.payload, reply) != success)
+                    {
+                        std::string message(reply.begin() + std::min<std::size_t>(4, reply.size()),
+                                            reply.end());
+                        std::fprintf(stderr, "%s failed: %s\n", step.name.c_str(),
+                                     message.c_str());
+                        return 1;
+                    }
+                }
+            }
+
+            // every spawned server keeps its own stats, a socket server has
+            // one set for all of its sessions. Recording is turned on before
+            // the counters are reset, so the reset call is always counted
+            // (once per server), and put back how it was afterwards
+            std::size_t num_servers = socket_path.empty() ? clients.size() : 1;
+            std::vector<bool> was_enabled(num_servers);
+            for (std::size_t s = 0; s < num_servers; ++s)
+            {
+                std::string before = server_stats(clients[s]->connection, 0, -1);
+                was_enabled[s] = before.find("\"enabled\": true") != std::string::npos;
+                server_stats(clients[s]->connection, 0, 1);
+                server_stats(clients[s]->connection, 1, -1);
+            }
+
+            uint64_t sent_before = 0, received_before = 0;
+            for (auto &c : clients)
+            {
+                sent_before += c->connection.bytes_sent;
+                received_before += c->connection.bytes_received;
+            }
+
+            Measurements m{steps.size()};
+            steady::time_point start = steady::now();
+            steady::time_point deadline =
+                start + std::chrono::duration_cast<steady::duration>(
+                            std::chrono::duration<double>(seconds));
+            std::vector<std::thread> threads;
+            for (auto &c : clients)
+            {
+                Client *client = c.get();
+                threads.emplace_back([&, client] { drive(*client, steps, depth, deadline); });
+                threads.emplace_back([&, client] { collect(*client, steps, m); });
+            }
+            for (std::thread &t : threads)
+                t.join();
+            double elapsed = std::chrono::duration<double>(steady::now() - start).count();
+
+            uint64_t sent = 0, received = 0;
+            for (auto &c : clients)
+            {
+                sent += c->connection.bytes_sent;
+                received += c->connection.bytes_received;
+            }
+
+            // less the reset calls
+            double server_calls = 0, server_ns = 0;
+            for (std::size_t s = 0; s < num_servers; ++s)
+            {
+                std::string after = server_stats(clients[s]->connection, 0,
+                                                 was_enabled[s] ? 1 : 0);
+                server_calls += stats_field(after, "request", "calls") - 1;
+                server_ns += stats_field(after, "request", "total_ns");
+            }
+            clients.clear(); // closes the connections and reaps the servers
+
+            Outcome o;
+            o.megapixels = static_cast<double>(params.rows) * params.cols / 1e6;
+            o.clients = num_clients;
+            o.seconds = elapsed;
+            o.frames = m.frames.load();
+            o.requests = 0;
+            o.errors = m.errors.load();
+            o.mb_up = (sent - sent_before) / 1e6 / elapsed;
+            o.mb_down = (received - received_before) / 1e6 / elapsed;
+            o.frame_ms[0] = ms(m.frame.percentile(0.5));
+            o.frame_ms[1] = ms(m.frame.percentile(0.9));
+            o.frame_ms[2] = ms(m.frame.percentile(0.99));
+            o.frame_ms[3] = ms(m.frame.percentile(1.0));
+            uint64_t client_ns = 0;
+            for (std::size_t k = 0; k < steps.size(); ++k)
+            {
+                uint64_t n = m.requests[k].count();
+                o.requests += n;
+                client_ns += m.request_ns[k].load();
+                o.step_ms.push_back({ms(m.requests[k].percentile(0.5)),
+                                     ms(m.requests[k].percentile(0.9)),
+                                     ms(m.requests[k].percentile(0.99)),
+                                     ms(m.requests[k].percentile(1.0)),
+                                     n ? ms(m.request_ns[k].load() / n) : 0});
+            }
+            o.client_ms = o.requests ? ms(client_ns / o.requests) : 0;
+            o.server_ms = server_calls > 0 ? server_ns / server_calls / 1e6 : 0;
+
+            std::printf("%6.1f %7d %9.2f %9.2f %8.1f %9.1f %9.3f %9.3f %10.3f %11.3f %6llu\n",
+                        o.megapixels, o.clients, o.frames / elapsed,
+                        o.requests / elapsed, o.mb_up, o.mb_down, o.frame_ms[0],
+                        o.frame_ms[2], o.server_ms, o.client_ms - o.server_ms,
+                        static_cast<unsigned long long>(o.errors));
+            for (std::size_t k = 0; k < steps.size(); ++k)
+                std::printf("    %-10s p50 %9.3f  p90 %9.3f  p99 %9.3f  max %9.3f  mean %9.3f ms\n",
+                            steps[k].name.c_str(), o.step_ms[k][0], o.step_ms[k][1],
+                            o.step_ms[k][2], o.step_ms[k][3], o.step_ms[k][4]);
+            std::fflush(stdout);
+            outcomes.push_back(o);
+        }
+    }
+
+    if (json_path)
+    {
+        FILE *file = std::fopen(json_path, "w");
+        if (!file)
+        {
+            std::fprintf(stderr, "couldn't write %s\n", json_path);
+            return 1;
+        }
+        std::fprintf(file, "{\n  \"server\": \"%s\", \"protocol\": %d, \"depth\": %d, \"mix\": [",
+                     socket_path.empty() ? binary.c_str() : socket_path.c_str(),
+                     protocol, depth);
+        for (std::size_t k = 0; k < mix.size(); ++k)
+            std::fprintf(file, "%s\"%s\"", k ? ", " : "", mix[k].c_str());
+        std::fprintf(file, "],\n  \"results\": [\n");
+        for (std::size_t r = 0; r < outcomes.size(); ++r)
+        {
+            const Outcome &o = outcomes[r];
+            std::fprintf(file,
+                         "    {\"megapixels\": %g, \"clients\": %d, \"seconds\": %g, "
+                         "\"frames\": %llu, \"requests\": %llu, \"errors\": %llu, "
+                         "\"frames_per_s\": %g, \"requests_per_s\": %g, "
+                         "\"mb_per_s_up\": %g, \"mb_per_s_down\": %g, "
+                         "\"frame_ms\": {\"p50\": %g, \"p90\": %g, \"p99\": %g, \"max\": %g}, "
+                         "\"client_ms_per_request\": %g, \"server_ms_per_request\": %g, "
+                         "\"requests_ms\": {",
+                         o.megapixels, o.clients, o.seconds,
+                         static_cast<unsigned long long>(o.frames),
+                         static_cast<unsigned long long>(o.requests),
+                         static_cast<unsigned long long>(o.errors),
+                         o.frames / o.seconds, o.requests / o.seconds, o.mb_up,
+                         o.mb_down, o.frame_ms[0], o.frame_ms[1], o.frame_ms[2],
+                         o.frame_ms[3], o.client_ms, o.server_ms);
+            for (std::size_t k = 0; k < mix.size(); ++k)
+                std::fprintf(file,
+                             "%s\"%s\": {\"p50\": %g, \"p90\": %g, \"p99\": %g, "
+                             "\"max\": %g, \"mean\": %g}",
+                             k ? ", " : "", mix[k].c_str(), o.step_ms[k][0],
+                             o.step_ms[k][1], o.step_ms[k][2], o.step_ms[k][3],
+                             o.step_ms[k][4]);
+            std::fprintf(file, "}}%s\n", r + 1 < outcomes.size() ? "," : "");
+        }
+        std::fprintf(file, "  ]\n}\n");
+        std::fclose(file);
+    }
+    return 0;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+// End to end throughput of the server, protocol and serialization included.
+// Each client gets its own server (a b.out it spawns and talks to over pipes,
+// as detector.py does) or its own connection to a running socket server, and
+// sends synthetic frames (see synthetic.hpp) through a mix of requests as
+// fast as the server takes them:
+//
+//     rrec_bench load [--binary PATH | --socket PATH] [--protocol 1|2]
+//         [--depth N] [--sizes 1,4] [--clients 1,2,4] [--seconds S]
+//         [--mix load,run] [--format points|spans|summary|compact]
+//         [--threads N] [--length N] [--L N] [--d N] [--sigma X]
+//         [--json PATH]
+//
+// Every frame is the requests in --mix, in order: load (loadFromPython),
+// equalize, tiled (equalizeTiled), detect (detectSignificance), cluster
+// (clusterParallel with union_find) and run (runAlgorithm). --depth is how
+// many requests a client may have in flight, which needs protocol 2 (the
+// socket server only speaks 2). For every frame size and client count it
+// reports frames/s, requests/s, MB/s each way and the latency percentiles
+// of whole frames and of each request, and, from the servers' own stats,
+// how much of a request's latency was spent outside the handler (waiting
+// behind the client's other requests included, with --depth above 1)
+int run_load(int argc, char **argv);
@@ -0,0 +1,310 @@
+#include "suite.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "dbscan.hpp"
+#include "equalizer.hpp"
+#include "gaussian.hpp"
+#include "parallel.hpp"
+#include "serialize.hpp"
+#include "significance.hpp"
+#include "synthetic.hpp"
+
+// every operator new in the process comes through here, so the suite can
+// count allocations. OpenCV allocates cv::Mat buffers with its own allocator,
+// so those aren't counted
+namespace
+{
+std::atomic<unsigned long long> num_allocs{0};
+std::atomic<unsigned long long> num_alloc_bytes{0};
+} // namespace
+
+void *operator new(std::size_t size)
+{
+    num_allocs.fetch_add(1, std::memory_order_relaxed);
+    num_alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+namespace
+{
+struct Result
+{
+    std::string stage;
+    int rows;
+    int cols;
+    double density;
+    int threads;
+    int reps;
+    double best_ns;
+    double median_ns;
+    double bytes; // read + written per call
+    double allocs;
+    double alloc_bytes;
+
+    double pixels() const { return static_cast<double>(rows) * cols; }
+    double ns_per_pixel() const { return best_ns / pixels(); }
+    double gb_per_s() const { return bytes / best_ns; }
+};
+
+// runs fn once to warm up (so buffers that are kept between calls have
+// grown), then times reps calls and counts what they allocate
+Result measure(const std::function<void()> &fn, int reps)
+{
+    fn();
+
+    std::vector<double> times;
+    unsigned long long allocs = num_allocs.load();
+    unsigned long long bytes = num_alloc_bytes.load();
+    for (int r = 0; r < reps; ++r)
+    {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        auto stop = std::chrono::steady_clock::now();
+        times.push_back(std::chrono::duration<double, std::nano>(stop - start).count());
+    }
+
+    Result result{};
+    result.reps = reps;
+    result.allocs = double(num_allocs.load() - allocs) / reps;
+    result.alloc_bytes = double(num_alloc_bytes.load() - bytes) / reps;
+    std::sort(times.begin(), times.end());
+    result.best_ns = times.front();
+    result.median_ns = times[times.size() / 2];
+    return result;
+}
+
+// a synthetic frame (see synthetic.hpp) with skyrmions covering about
+// density of it, seeded by its size and density so every run sees the same
+// pixels. mask gets the skyrmions' disks, as clustering would ideally see
+// them
+void synthetic_frame(int rows, int cols, double density, cv::Mat &frame,
+                     cv::Mat &mask)
+{
+    rrec::SyntheticParams params;
+    params.rows = rows;
+    params.cols = cols;
+    params.density = density;
+    params.seed = rows * 31 + cols + static_cast<unsigned>(density * 1e6);
+    std::vector<rrec::TruthPoint> truth = rrec::synthetic_frame(params, frame);
+
+    mask.create(rows, cols, CV_8UC1);
+    for (int i = 0; i < rows; ++i)
+        std::memset(mask.ptr<unsigned char>(i), 0, cols);
+
+    double r = params.radius;
+    for (const rrec::TruthPoint &s : truth)
+    {
+        int top = std::max(0, static_cast<int>(std::ceil(s.row - r)));
+        int bottom = std::min(rows - 1, static_cast<int>(std::floor(s.row + r)));
+        int left = std::max(0, static_cast<int>(std::ceil(s.col - r)));
+        int right = std::min(cols - 1, static_cast<int>(std::floor(s.col + r)));
+        for (int i = top; i <= bottom; ++i)
+            for (int j = left; j <= right; ++j)
+                if ((i - s.row) * (i - s.row) + (j - s.col) * (j - s.col) <= r * r)
+                    mask.ptr<unsigned char>(i)[j] = 255;
+    }
+}
+
+std::vector<double> parse_list(const char *text)
+{
+    std::vector<double> values;
+    std::stringstream in(text);
+    std::string item;
+    while (std::getline(in, item, ','))
+        values.push_back(std::atof(item.c_str()));
+    return values;
+}
+
+std::string json(const std::vector<Result> &results, int threads)
+{
+    std::ostringstream out;
+    out << "{\n  \"compiler\": \"" << __VERSION__ << "\",\n"
+        << "  \"hardware_threads\": " << std::thread::hardware_concurrency()
+        << ",\n  \"threads\": " << threads << ",\n  \"results\": [\n";
+    for (std::size_t k = 0; k < results.size(); ++k)
+    {
+        const Result &r = results[k];
+        out << "    {\"stage\": \"" << r.stage << "\", \"rows\": " << r.rows
+            << ", \"cols\": " << r.cols << ", \"megapixels\": " << r.pixels() / 1e6
+            << ", \"density\": " << r.density << ", \"threads\": " << r.threads
+            << ", \"reps\": " << r.reps << ", \"best_ns\": " << r.best_ns
+            << ", \"median_ns\": " << r.median_ns
+            << ", \"ns_per_pixel\": " << r.ns_per_pixel()
+            << ", \"gb_per_s\": " << r.gb_per_s()
+            << ", \"allocs_per_call\": " << r.allocs
+            << ", \"alloc_bytes_per_call\": " << r.alloc_bytes << "}"
+            << (k + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+    return out.str();
+}
+} // namespace
+
+int run_suite(int argc, char **argv)
+{
+    const char *json_path = nullptr;
+    int reps = 5;
+    int threads = 0;
+    std::vector<double> sizes = {1, 4, 16};
+    std::vector<double> densities = {0.01, 0.05, 0.2};
+    for (int a = 1; a + 1 < argc; a += 2)
+    {
+        if (std::strcmp(argv[a], "--json") == 0)
+            json_path = argv[a + 1];
+        else if (std::strcmp(argv[a], "--reps") == 0)
+            reps = std::max(1, std::atoi(argv[a + 1]));
+        else if (std::strcmp(argv[a], "--threads") == 0)
+            threads = std::atoi(argv[a + 1]);
+        else if (std::strcmp(argv[a], "--sizes") == 0)
+            sizes = parse_list(argv[a + 1]);
+        else if (std::strcmp(argv[a], "--densities") == 0)
+            densities = parse_list(argv[a + 1]);
+        else
+        {
+            std::fprintf(stderr, "unknown option %s, see bench/suite.hpp\n", argv[a]);
+            return 1;
+        }
+    }
+    threads = rrec::resolve_threads(threads);
+
+    std::vector<Result> results;
+    std::printf("%-22s %6s %8s %7s %11s %9s %8s %10s\n", "stage", "MP",
+                "density", "threads", "best/ms", "ns/pixel", "GB/s",
+                "allocs");
+
+    for (double megapixels : sizes)
+    {
+        // 4:3 frames, like the camera's
+        int cols = static_cast<int>(std::lround(std::sqrt(megapixels * 1048576 * 4 / 3) / 8) * 8);
+        int rows = cols * 3 / 4;
+        double px = static_cast<double>(rows) * cols;
+
+        // adds a result, bytes being what one call reads and writes
+        double density = 0;
+        auto run = [&](const char *stage, int stage_threads, double bytes,
+                       const std::function<void()> &fn) {
+            Result r = measure(fn, reps);
+            r.stage = stage;
+            r.rows = rows;
+            r.cols = cols;
+            r.density = density;
+            r.threads = stage_threads;
+            r.bytes = bytes;
+            results.push_back(r);
+            std::printf("%-22s %6.1f %8.2f %7d %11.3f %9.3f %8.2f %10.1f\n",
+                        stage, px / 1e6, density, stage_threads, r.best_ns / 1e6,
+                        r.ns_per_pixel(), r.gb_per_s(), r.allocs);
+            std::fflush(stdout);
+        };
+
+        // the image stages don't care how many blobs there are, so they only
+        // run on the middle density
+        cv::Mat frame, truth;
+        density = densities[densities.size() / 2];
+        synthetic_frame(rows, cols, density, frame, truth);
+
+        cv::Mat out, background, signal;
+        cv::GaussianBlur(frame, background, cv::Size(51, 51), 0);
+        cv::GaussianBlur(frame, signal, cv::Size(5, 5), 0);
+        rrec::PackedMask packed;
+
+        run("equalize_sliding", 1, 2 * px, [&] { rrec::sliding_hist_eq(frame, out, 51); });
+        run("equalize_tiled", threads, 2 * px,
+            [&] { rrec::tiled_hist_eq(frame, out, 51, threads); });
+        run("background_opencv", 1, 2 * px,
+            [&] { cv::GaussianBlur(frame, out, cv::Size(51, 51), 0); });
+        run("background_recursive", threads, 2 * px, [&] {
+            rrec::recursive_gaussian_blur(frame, out, rrec::gaussian_sigma(51), threads);
+        });
+        run("signal_opencv", 1, 2 * px,
+            [&] { cv::GaussianBlur(frame, out, cv::Size(5, 5), 0); });
+        run("significance_table", 1, 3 * px,
+            [&] { rrec::table_significance(signal, background, out, 2.0); });
+        run("significance_packed", 1, 2 * px + px / 8,
+            [&] { rrec::table_significance(signal, background, packed, 2.0); });
+        run("significance_exact", threads, 4 * px, [&] {
+            rrec::exact_significance(frame, signal, background, out, 51, 2.0, threads);
+        });
+        run("significance_fused", threads, 2 * px, [&] {
+            rrec::fused_significance(frame, out, 51, 5, 2.0, nullptr, nullptr, threads);
+        });
+        run("pack_mask", 1, px + px / 8, [&] { packed.from_mat(truth); });
+
+        // clustering and serialization, on the blobs themselves at every
+        // density
+        for (double d : densities)
+        {
+            density = d;
+            synthetic_frame(rows, cols, density, frame, truth);
+            packed.from_mat(truth);
+
+            cv::Mat drawn(rows, cols, CV_8UC1);
+            rrec::ClusterWorkspace workspace;
+            std::vector<rrec::Cluster> clusters;
+            auto cluster = [&](rrec::cluster_engine engine, int n) {
+                rrec::DBSCAN scanner{workspace};
+                scanner.setThreads(n);
+                scanner.setParameters(9, 40);
+                clusters = scanner.getClusters(packed, drawn, engine);
+            };
+
+            // the dbscan engine's stacks are sized to the frame, which gets
+            // silly past a few megapixels
+            if (megapixels <= 4)
+                run("cluster_dbscan", 1, px / 8 + px,
+                    [&] { cluster(rrec::cluster_engine::dbscan, 1); });
+            run("cluster_union_find", 1, px / 8 + px,
+                [&] { cluster(rrec::cluster_engine::union_find, 1); });
+            run("cluster_union_find", threads, px / 8 + px,
+                [&] { cluster(rrec::cluster_engine::union_find, threads); });
+            run("cluster_grid_eps9", threads, px / 8 + px,
+                [&] { cluster(rrec::cluster_engine::grid, threads); });
+
+            cluster(rrec::cluster_engine::union_find, threads);
+            std::vector<unsigned char> bytes;
+            for (auto format : {rrec::cluster_format::points, rrec::cluster_format::spans,
+                                rrec::cluster_format::compact})
+            {
+                rrec::serialize_clusters(clusters, format, bytes);
+                const char *name = format == rrec::cluster_format::points
+                                       ? "serialize_points"
+                                       : format == rrec::cluster_format::spans
+                                             ? "serialize_spans"
+                                             : "serialize_compact";
+                run(name, 1, static_cast<double>(bytes.size()),
+                    [&] { rrec::serialize_clusters(clusters, format, bytes); });
+            }
+        }
+    }
+
+    if (json_path)
+    {
+        FILE *file = std::fopen(json_path, "w");
+        if (!file)
+        {
+            std::fprintf(stderr, "couldn't write %s\n", json_path);
+            return 1;
+        }
+        std::string text = json(results, threads);
+        std::fwrite(text.data(), 1, text.size(), file);
+        std::fclose(file);
+    }
+    return 0;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+// The benchmark suite: every stage of the pipeline on its own, on synthetic
+// frames (see synthetic.hpp, seeded so every run sees the same pixels) of 1,
+// 4 and 16 megapixels with skyrmions covering 1%, 5% and 20% of the frame.
+// For each stage it reports the best and median time, ns per pixel, GB/s
+// (bytes read + written over the best time) and operator new allocations per
+// call, as a table and optionally as JSON for tracking regressions:
+//
+//     rrec_bench [--json PATH] [--reps N] [--threads N]
+//                [--sizes 1,4,16] [--densities 0.01,0.05,0.2]
+//
+// --threads is what the multithreaded stages get (default: one per core)
+int run_suite(int argc, char **argv);
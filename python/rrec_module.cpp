@@ -0,0 +1,342 @@
+// The rrec python extension: the Detector in-process, without b.out or any
+// pipes. Images go in and come out as numpy arrays sharing the detector's
+// memory, and clusters come back as numpy arrays of spans.
+//
+//     import rrec
+//     detector = rrec.Detector()
+//     detector.set_image_main(frame)    # uint8 2D array, not copied
+//     spans, counts = detector.run_algorithm(51, 31, 5, 3.0)
+//
+// detector.py's LocalDetector wraps this with the same interface as the
+// pipe based Detector.
+
+#include <boost/python.hpp>
+
+#define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
+#include <numpy/arrayobject.h>
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "detector.hpp"
+
+namespace py = boost::python;
+
+namespace rrec
+{
+namespace
+{
+void raise(PyObject *type, const char *message)
+{
+    PyErr_SetString(type, message);
+    py::throw_error_already_set();
+}
+
+// a numpy array over data which stays alive as long as owner does. owner is
+// heap allocated and handed over to the array, which deletes it when it goes
+template <typename Owner>
+py::object array_over(Owner *owner, void *data, int type, int ndim,
+                      npy_intp *dims, npy_intp *strides)
+{
+    PyObject *capsule = PyCapsule_New(owner, nullptr, [](PyObject *capsule) {
+        delete static_cast<Owner *>(PyCapsule_GetPointer(capsule, nullptr));
+    });
+    if (!capsule)
+    {
+        delete owner;
+        py::throw_error_already_set();
+    }
+
+    PyObject *array = PyArray_New(&PyArray_Type, ndim, dims, type, strides, data,
+                                  0, NPY_ARRAY_WRITEABLE, nullptr);
+    if (!array)
+    {
+        Py_DECREF(capsule);
+        py::throw_error_already_set();
+    }
+    PyArray_SetBaseObject(reinterpret_cast<PyArrayObject *>(array), capsule);
+    return py::object(py::handle<>(array));
+}
+
+// a view of image's pixels, which shares (and so keeps alive) the cv::Mat's
+// buffer. None if the image hasn't been made
+py::object image_view(const cv::Mat &image)
+{
+    if (image.empty())
+        return py::object();
+
+    int type;
+    switch (image.depth())
+    {
+    case CV_8U:
+        type = NPY_UINT8;
+        break;
+    case CV_32F:
+        type = NPY_FLOAT32;
+        break;
+    case CV_64F:
+        type = NPY_FLOAT64;
+        break;
+    default:
+        raise(PyExc_TypeError, "image has a depth numpy can't view.");
+        return py::object();
+    }
+
+    npy_intp dims[2] = {image.rows, image.cols};
+    npy_intp strides[2] = {static_cast<npy_intp>(image.step),
+                           static_cast<npy_intp>(image.elemSize())};
+    return array_over(new cv::Mat(image), image.data, type, 2, dims, strides);
+}
+
+// moves values into a new (rows, width) int32 array without copying them
+template <typename T>
+py::object int32_array(std::vector<T> &&values, npy_intp width)
+{
+    static_assert(sizeof(T) % sizeof(int32_t) == 0, "T must be made of int32s");
+    auto *owner = new std::vector<T>(std::move(values));
+    npy_intp dims[2] = {static_cast<npy_intp>(owner->size() * sizeof(T) /
+                                              sizeof(int32_t) / width),
+                        width};
+    return array_over(owner, owner->data(), NPY_INT32, 2, dims, nullptr);
+}
+
+class PyDetector
+{
+  private:
+    Detector detector;
+    py::object main_array; // the array image_main views, kept alive here
+
+    void check_open()
+    {
+        if (!detector.is_open)
+            raise(PyExc_RuntimeError, "no image loaded.");
+    }
+
+    static void check_odd(int value, const char *message)
+    {
+        if (value < 1 || value % 2 == 0)
+            raise(PyExc_ValueError, message);
+    }
+
+    static cluster_engine engine_from(int engine)
+    {
+        if (engine != static_cast<int>(cluster_engine::dbscan) &&
+            engine != static_cast<int>(cluster_engine::union_find) &&
+            engine != static_cast<int>(cluster_engine::grid))
+            raise(PyExc_ValueError, "unknown clustering engine.");
+        return static_cast<cluster_engine>(engine);
+    }
+
+  public:
+    // image_main becomes a view of array, which must be a writable 2D uint8
+    // array with contiguous rows. The array itself is never changed:
+    // equalizing puts its result in a new image, which image_main returns
+    // from then on
+    void set_image_main(py::object array)
+    {
+        PyObject *object = array.ptr();
+        if (!PyArray_Check(object))
+            raise(PyExc_TypeError, "image must be a numpy array.");
+
+        PyArrayObject *image = reinterpret_cast<PyArrayObject *>(object);
+        if (PyArray_NDIM(image) != 2 || PyArray_TYPE(image) != NPY_UINT8)
+            raise(PyExc_TypeError, "image must be a 2D uint8 array.");
+        if (PyArray_STRIDE(image, 1) != 1 || PyArray_STRIDE(image, 0) < PyArray_DIM(image, 1))
+            raise(PyExc_ValueError, "image rows must be contiguous.");
+        if (!PyArray_ISWRITEABLE(image))
+            raise(PyExc_ValueError, "image must be writeable.");
+
+        cv::Mat wrapped(static_cast<int>(PyArray_DIM(image, 0)),
+                        static_cast<int>(PyArray_DIM(image, 1)), CV_8UC1,
+                        PyArray_DATA(image), PyArray_STRIDE(image, 0));
+        detector.use_image_main(wrapped);
+        main_array = array;
+    }
+
+    void load_image(const std::string &path)
+    {
+        main_array = py::object();
+        detector.load_image(path);
+        if (!detector.is_open)
+            raise(PyExc_IOError, "couldn't open image.");
+    }
+
+    void load_pic(const std::string &path, int rows, int cols)
+    {
+        main_array = py::object();
+        detector.load_pic(path, rows, cols);
+        if (!detector.is_open)
+            raise(PyExc_IOError, "couldn't open .pic file.");
+    }
+
+    py::object image_main()
+    {
+        // while image_main is still the array it was given, hand that back
+        cv::Mat image = detector.get_image_main();
+        if (!main_array.is_none() &&
+            image.data == PyArray_DATA(reinterpret_cast<PyArrayObject *>(main_array.ptr())))
+            return main_array;
+        return image_view(image);
+    }
+    py::object image_clustered() { return image_view(detector.get_image_clustered()); }
+    py::object image_L() { return image_view(detector.get_image_L()); }
+    py::object image_d() { return image_view(detector.get_image_d()); }
+
+    void adaptive_hist_eq(int length)
+    {
+        check_open();
+        check_odd(length, "length must be a positive odd integer.");
+        detector.adaptive_hist_eq(length);
+    }
+
+    void adaptive_hist_eq_tiled(int tile, int num_threads)
+    {
+        check_open();
+        if (tile < 1)
+            raise(PyExc_ValueError, "tile size must be positive.");
+        detector.adaptive_hist_eq_tiled(tile, num_threads);
+    }
+
+    void detect_significance(int L, int d, double sigma, bool keep_intermediates)
+    {
+        check_open();
+        check_odd(L, "L must be a positive odd integer.");
+        check_odd(d, "d must be a positive odd integer.");
+        detector.detect_significance(L, d, sigma, keep_intermediates);
+    }
+
+    py::tuple cluster(int engine, int num_threads)
+    {
+        check_open();
+        detector.cluster(engine_from(engine), num_threads);
+        return spans();
+    }
+
+    py::tuple cluster_grid(int eps, int minPts, int num_threads)
+    {
+        check_open();
+        check_odd(eps, "eps must be a positive odd integer.");
+        if (minPts < 1)
+            raise(PyExc_ValueError, "minPts must be positive.");
+        detector.cluster_grid(eps, minPts, num_threads);
+        return spans();
+    }
+
+    py::tuple run_algorithm(int equalize_length, int L, int d, double sigma,
+                            int engine, int num_threads, int eps, int minPts)
+    {
+        check_open();
+        check_odd(L, "L must be a positive odd integer.");
+        check_odd(d, "d must be a positive odd integer.");
+
+        AlgorithmParams params;
+        params.equalize_length = equalize_length;
+        params.L = L;
+        params.d = d;
+        params.sigma = sigma;
+        params.engine = engine_from(engine);
+        params.num_threads = num_threads;
+        params.eps = eps;
+        params.minPts = minPts;
+        if (params.engine == cluster_engine::grid)
+        {
+            check_odd(eps, "eps must be a positive odd integer.");
+            if (minPts < 1)
+                raise(PyExc_ValueError, "minPts must be positive.");
+        }
+
+        detector.run_algorithm(params);
+        return spans();
+    }
+
+    // every cluster's spans as an (M, 3) array of (row, begin, end), in the
+    // same order as the compact format (each cluster's core spans then its
+    // outer spans), and an (N, 2) array of each cluster's core and outer
+    // span counts
+    py::tuple spans()
+    {
+        const std::vector<Cluster> &clusters = detector.get_clusters();
+
+        std::size_t total = 0;
+        for (const auto &cluster : clusters)
+            total += cluster.coreSpans.size() + cluster.outerSpans.size();
+
+        std::vector<Span> all;
+        std::vector<int32_t> counts;
+        all.reserve(total);
+        counts.reserve(2 * clusters.size());
+        for (const auto &cluster : clusters)
+        {
+            all.insert(all.end(), cluster.coreSpans.begin(), cluster.coreSpans.end());
+            all.insert(all.end(), cluster.outerSpans.begin(), cluster.outerSpans.end());
+            counts.push_back(static_cast<int32_t>(cluster.coreSpans.size()));
+            counts.push_back(static_cast<int32_t>(cluster.outerSpans.size()));
+        }
+        return py::make_tuple(int32_array(std::move(all), 3),
+                              int32_array(std::move(counts), 2));
+    }
+
+    // a ClusterSummary per cluster, as raw bytes (an (N, 64) uint8 array, view
+    // it as detector.cluster_summary_dtype)
+    py::object summaries()
+    {
+        const std::vector<Cluster> &clusters = detector.get_clusters();
+        auto *owner = new std::vector<ClusterSummary>();
+        owner->reserve(clusters.size());
+        for (const auto &cluster : clusters)
+            owner->push_back(cluster.summary());
+
+        npy_intp dims[2] = {static_cast<npy_intp>(owner->size()),
+                            static_cast<npy_intp>(sizeof(ClusterSummary))};
+        return array_over(owner, owner->data(), NPY_UINT8, 2, dims, nullptr);
+    }
+
+    std::size_t workspace_bytes() const { return detector.workspace_bytes(); }
+    std::size_t memory_bytes() const { return detector.memory_bytes(); }
+};
+
+#if PY_MAJOR_VERSION >= 3
+void *init_numpy()
+{
+    import_array();
+    return nullptr;
+}
+#else
+void init_numpy() { import_array(); }
+#endif
+} // namespace
+} // namespace rrec
+
+BOOST_PYTHON_MODULE(rrec)
+{
+    using rrec::PyDetector;
+    rrec::init_numpy();
+
+    py::class_<PyDetector, boost::noncopyable>("Detector")
+        .def("set_image_main", &PyDetector::set_image_main)
+        .def("load_image", &PyDetector::load_image)
+        .def("load_pic", &PyDetector::load_pic)
+        .add_property("image_main", &PyDetector::image_main)
+        .add_property("image_clustered", &PyDetector::image_clustered)
+        .add_property("image_L", &PyDetector::image_L)
+        .add_property("image_d", &PyDetector::image_d)
+        .def("adaptive_hist_eq", &PyDetector::adaptive_hist_eq)
+        .def("adaptive_hist_eq_tiled", &PyDetector::adaptive_hist_eq_tiled,
+             (py::arg("tile"), py::arg("num_threads") = 0))
+        .def("detect_significance", &PyDetector::detect_significance,
+             (py::arg("L"), py::arg("d"), py::arg("sigma"),
+              py::arg("keep_intermediates") = false))
+        .def("cluster", &PyDetector::cluster,
+             (py::arg("engine") = 1, py::arg("num_threads") = 1))
+        .def("cluster_grid", &PyDetector::cluster_grid,
+             (py::arg("eps"), py::arg("min_pts"), py::arg("num_threads") = 1))
+        .def("run_algorithm", &PyDetector::run_algorithm,
+             (py::arg("equalize_length"), py::arg("L"), py::arg("d"),
+              py::arg("sigma"), py::arg("engine") = 1, py::arg("num_threads") = 1,
+              py::arg("eps") = 3, py::arg("min_pts") = 4))
+        .def("spans", &PyDetector::spans)
+        .def("summaries", &PyDetector::summaries)
+        .def("workspace_bytes", &PyDetector::workspace_bytes)
+        .def("memory_bytes", &PyDetector::memory_bytes);
+}
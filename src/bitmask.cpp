@@ -0,0 +1,131 @@
+#include "bitmask.hpp"
+
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace rrec
+{
+
+PackedMask::PackedMask() : num_rows{0}, num_cols{0}, num_words{0} {}
+
+PackedMask::PackedMask(int rows, int cols) { create(rows, cols); }
+
+void PackedMask::create(int rows, int cols)
+{
+    num_rows = rows;
+    num_cols = cols;
+    num_words = (cols + 63) / 64;
+    bits.assign(static_cast<size_t>(rows) * num_words, 0);
+}
+
+void PackedMask::pack_row(const unsigned char *p, uint64_t *out, int n)
+{
+    int j = 0;
+
+    // whole words first
+    for (; j + 64 <= n; j += 64)
+    {
+#if defined(__AVX2__)
+        uint64_t lo = static_cast<uint32_t>(_mm256_movemask_epi8(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + j))));
+        uint64_t hi = static_cast<uint32_t>(_mm256_movemask_epi8(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + j + 32))));
+        out[j >> 6] = lo | (hi << 32);
+#elif defined(__SSE2__)
+        uint64_t word = 0;
+        for (int k = 0; k < 4; ++k)
+        {
+            uint64_t part = static_cast<uint16_t>(_mm_movemask_epi8(
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + j + 16 * k))));
+            word |= part << (16 * k);
+        }
+        out[j >> 6] = word;
+#else
+        uint64_t word = 0;
+        for (int k = 0; k < 64; ++k)
+            word |= static_cast<uint64_t>(p[j + k] >> 7) << k;
+        out[j >> 6] = word;
+#endif
+    }
+
+    // then whatever is left of the row
+    if (j < n)
+    {
+        uint64_t word = 0;
+        for (int k = 0; j + k < n; ++k)
+            word |= static_cast<uint64_t>(p[j + k] >> 7) << k;
+        out[j >> 6] = word;
+    }
+}
+
+void PackedMask::from_mat(const cv::Mat &image)
+{
+    create(image.rows, image.cols);
+
+    for (int i = 0; i < num_rows; ++i)
+        pack_row(image.ptr<unsigned char>(i), row(i), num_cols);
+}
+
+void PackedMask::to_mat(cv::Mat &image) const
+{
+    image.create(num_rows, num_cols, CV_8UC1);
+
+    for (int i = 0; i < num_rows; ++i)
+    {
+        const uint64_t *in = row(i);
+        unsigned char *p = image.ptr<unsigned char>(i);
+        for (int j = 0; j < num_cols; ++j)
+            p[j] = ((in[j >> 6] >> (j & 63)) & 1) ? 255 : 0;
+    }
+}
+
+void PackedMask::core_points(PackedMask &core) const
+{
+    core.create(num_rows, num_cols);
+
+    // core points can't be on the first/last row or column
+    if (num_rows < 3 || num_cols < 3)
+        return;
+
+    // clears bits for column 0 and column num_cols - 1 (and the padding)
+    int last_word = (num_cols - 1) >> 6;
+    uint64_t last_mask = (static_cast<uint64_t>(1) << ((num_cols - 1) & 63)) - 1;
+
+    for (int i = 1; i < num_rows - 1; ++i)
+    {
+        const uint64_t *up = row(i - 1);
+        const uint64_t *mid = row(i);
+        const uint64_t *down = row(i + 1);
+        uint64_t *out = core.row(i);
+
+        for (int w = 0; w < num_words; ++w)
+        {
+            uint64_t prev = w > 0 ? mid[w - 1] : 0;
+            uint64_t next = w + 1 < num_words ? mid[w + 1] : 0;
+
+            // bit j of west is pixel j - 1, bit j of east is pixel j + 1
+            uint64_t west = (mid[w] << 1) | (prev >> 63);
+            uint64_t east = (mid[w] >> 1) | (next << 63);
+
+            out[w] = mid[w] & up[w] & down[w] & west & east;
+        }
+
+        out[0] &= ~static_cast<uint64_t>(1);
+        out[last_word] &= last_mask;
+    }
+}
+
+std::size_t PackedMask::count() const
+{
+    std::size_t total = 0;
+    for (uint64_t word : bits)
+        total += __builtin_popcountll(word);
+    return total;
+}
+
+} // namespace rrec
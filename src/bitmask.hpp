@@ -0,0 +1,66 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace rrec
+{
+// A binary image stored as one bit per pixel, each row padded out to a whole
+// number of 64 bit words. Bit j % 64 of word j / 64 of a row is pixel j, and
+// padding bits past the last column are always 0
+class PackedMask
+{
+  private:
+    int num_rows;
+    int num_cols;
+    int num_words; // words per row
+
+    std::vector<uint64_t> bits;
+
+  public:
+    PackedMask();
+    PackedMask(int rows, int cols); // all pixels start unset
+
+    void create(int rows, int cols); // resizes and clears
+
+    int rows() const { return num_rows; }
+    int cols() const { return num_cols; }
+    int words_per_row() const { return num_words; }
+    bool empty() const { return num_rows == 0 || num_cols == 0; }
+
+    uint64_t *row(int i) { return &bits[static_cast<size_t>(i) * num_words]; }
+    const uint64_t *row(int i) const
+    {
+        return &bits[static_cast<size_t>(i) * num_words];
+    }
+
+    bool get(int i, int j) const { return (row(i)[j >> 6] >> (j & 63)) & 1; }
+    void set(int i, int j)
+    {
+        row(i)[j >> 6] |= static_cast<uint64_t>(1) << (j & 63);
+    }
+
+    // packs a CV_8UC1 image, pixels >= 128 are set (i.e. the top bit of each
+    // byte, which lets SSE/AVX2 movemask do 16/32 pixels per instruction)
+    void from_mat(const cv::Mat &image);
+
+    // packs n bytes (>= 128 => set) into the (n + 63) / 64 words at out
+    static void pack_row(const unsigned char *p, uint64_t *out, int n);
+
+    // unpacks into a CV_8UC1 image of 0s and 255s
+    void to_mat(cv::Mat &image) const;
+
+    // Writes the points that are set and have all four orthogonal neighbours
+    // set into core, i.e. the erosion of the mask by a cross. Pixels on the
+    // edge of the image are never core. This is exactly DBSCAN's core point
+    // test for eps = 3, minPts = 4, done 64 pixels at a time with shifts/ANDs
+    void core_points(PackedMask &core) const;
+
+    std::size_t count() const; // number of set pixels
+
+    // memory held by the mask (create only reallocates when it has to grow)
+    std::size_t bytes() const { return bits.capacity() * sizeof(uint64_t); }
+};
+} // namespace rrec
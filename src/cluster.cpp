@@ -1,10 +1,101 @@
 #include "cluster.hpp"
 
+#include <algorithm>
+
 namespace rrec
 {
-int Cluster::getClusterNum() { return clusterNum; }
+int Cluster::getClusterNum() const { return clusterNum; }
 
 Cluster::Cluster(int N) { clusterNum = N; }
 
-int Cluster::size() { return corePoints.size() + outerPoints.size(); }
-} // namespace rrec
\ No newline at end of file
+void ClusterStats::add(int row, int begin, int end)
+{
+    long long n = end - begin;
+    long long r = row;
+
+    // sums of j and j^2 for j = begin .. end - 1
+    long long first = begin, last = end - 1;
+    long long cols = (first + last) * n / 2;
+    long long squares = (last * (last + 1) * (2 * last + 1) -
+                         (first - 1) * first * (2 * first - 1)) / 6;
+
+    if (area == 0)
+    {
+        minRow = maxRow = row;
+        minCol = begin;
+        maxCol = end - 1;
+    }
+    else
+    {
+        minRow = std::min(minRow, row);
+        maxRow = std::max(maxRow, row);
+        minCol = std::min(minCol, begin);
+        maxCol = std::max(maxCol, end - 1);
+    }
+
+    area += n;
+    sumRow += r * n;
+    sumCol += cols;
+    sumRowRow += r * r * n;
+    sumColCol += squares;
+    sumRowCol += r * cols;
+}
+
+double ClusterStats::varRow() const
+{
+    double mean = centroidRow();
+    return double(sumRowRow) / area - mean * mean;
+}
+
+double ClusterStats::varCol() const
+{
+    double mean = centroidCol();
+    return double(sumColCol) / area - mean * mean;
+}
+
+double ClusterStats::covRowCol() const
+{
+    return double(sumRowCol) / area - centroidRow() * centroidCol();
+}
+
+void Cluster::add(std::vector<Span> &spans, int row, int begin, int end)
+{
+    if (!spans.empty() && spans.back().row == row && spans.back().end == begin)
+        spans.back().end = end;
+    else
+        spans.push_back(Span{row, begin, end});
+}
+
+void Cluster::addCore(int row, int begin, int end)
+{
+    add(coreSpans, row, begin, end);
+    numCore += end - begin;
+    stats.add(row, begin, end);
+}
+
+void Cluster::addOuter(int row, int begin, int end)
+{
+    add(outerSpans, row, begin, end);
+    numOuter += end - begin;
+    stats.add(row, begin, end);
+}
+
+ClusterSummary Cluster::summary() const
+{
+    ClusterSummary s;
+    s.numCore = numCore;
+    s.numOuter = numOuter;
+    s.minRow = stats.minRow;
+    s.minCol = stats.minCol;
+    s.maxRow = stats.maxRow;
+    s.maxCol = stats.maxCol;
+    s.centroidRow = stats.centroidRow();
+    s.centroidCol = stats.centroidCol();
+    s.varRow = stats.varRow();
+    s.varCol = stats.varCol();
+    s.covRowCol = stats.covRowCol();
+    return s;
+}
+
+int Cluster::size() const { return numCore + numOuter; }
+} // namespace rrec
@@ -2,22 +2,179 @@
 
 #include <vector>
 #include <array>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
 
 namespace rrec
 {
+// the pixels [begin, end) on one row (print_clusters sends these as is, so
+// the layout is part of the protocol)
+struct Span
+{
+    int row;
+    int begin;
+    int end;
+
+    int size() const { return end - begin; }
+};
+
+// walks over every point in a list of spans as {row, col}, for code that
+// wants points rather than spans
+class PointIterator
+{
+  private:
+    const Span *span;
+    const Span *last; // one past the final span
+    int col;
+
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = std::array<int, 2>;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const value_type *;
+    using reference = value_type;
+
+    PointIterator(const Span *span, const Span *last)
+        : span{span}, last{last}, col{span != last ? span->begin : 0}
+    {
+    }
+
+    value_type operator*() const { return {span->row, col}; }
+
+    PointIterator &operator++()
+    {
+        if (++col == span->end)
+        {
+            ++span;
+            col = span != last ? span->begin : 0;
+        }
+        return *this;
+    }
+    PointIterator operator++(int)
+    {
+        PointIterator old{*this};
+        ++*this;
+        return old;
+    }
+
+    bool operator==(const PointIterator &other) const
+    {
+        return span == other.span && col == other.col;
+    }
+    bool operator!=(const PointIterator &other) const { return !(*this == other); }
+};
+
+// the points of a list of spans, in span order
+class PointRange
+{
+  private:
+    const std::vector<Span> *spans;
+    std::size_t num_points;
+
+  public:
+    PointRange(const std::vector<Span> &spans, std::size_t num_points)
+        : spans{&spans}, num_points{num_points}
+    {
+    }
+
+    PointIterator begin() const
+    {
+        return {spans->data(), spans->data() + spans->size()};
+    }
+    PointIterator end() const
+    {
+        return {spans->data() + spans->size(), spans->data() + spans->size()};
+    }
+    std::size_t size() const { return num_points; }
+    bool empty() const { return num_points == 0; }
+};
+
+// Moments and bounding box of a set of points, accumulated a span at a time
+// (every sum over a span has a closed form) so they come for free as a
+// cluster is built
+struct ClusterStats
+{
+    long long area = 0;
+    long long sumRow = 0;
+    long long sumCol = 0;
+    long long sumRowRow = 0;
+    long long sumColCol = 0;
+    long long sumRowCol = 0;
+
+    // bounding box, inclusive. Only meaningful if area > 0
+    int minRow = 0;
+    int maxRow = -1;
+    int minCol = 0;
+    int maxCol = -1;
+
+    void add(int row, int begin, int end);
+
+    double centroidRow() const { return double(sumRow) / area; }
+    double centroidCol() const { return double(sumCol) / area; }
+
+    // second central moments, divided by the area
+    double varRow() const;
+    double varCol() const;
+    double covRowCol() const;
+};
+
+// what print_clusters sends for each cluster in summary mode, instead of the
+// points themselves (the layout is part of the protocol)
+struct ClusterSummary
+{
+    int32_t numCore;
+    int32_t numOuter;
+    int32_t minRow; // bounding box, inclusive
+    int32_t minCol;
+    int32_t maxRow;
+    int32_t maxCol;
+    double centroidRow;
+    double centroidCol;
+    double varRow;
+    double varCol;
+    double covRowCol;
+};
+static_assert(sizeof(ClusterSummary) == 64, "ClusterSummary must be packed");
+
+// A cluster's points are stored as spans on each row, which for skyrmion
+// shaped blobs is a small fraction of the memory one entry per point takes
 class Cluster
 {
   private:
     int clusterNum; // unique cluster ID
 
+    int numCore = 0;  // points in coreSpans
+    int numOuter = 0; // points in outerSpans
+
+    ClusterStats stats; // of the core and outer points together
+
+    static void add(std::vector<Span> &spans, int row, int begin, int end);
+
   public:
-    int getClusterNum();
+    int getClusterNum() const;
 
-    std::vector<std::array<int, 2>> corePoints;  // cluster's core points
-    std::vector<std::array<int, 2>> outerPoints; // points on perimeter of cluster
+    std::vector<Span> coreSpans;  // cluster's core points
+    std::vector<Span> outerSpans; // points on perimeter of cluster
 
     Cluster(int N);
 
-    int size();
+    // appends points/spans. Adding them in raster order gives the fewest
+    // spans, as each one carries on the last span if it can
+    void addCore(int i, int j) { addCore(i, j, j + 1); }
+    void addOuter(int i, int j) { addOuter(i, j, j + 1); }
+    void addCore(int row, int begin, int end);
+    void addOuter(int row, int begin, int end);
+
+    // the points themselves, e.g. for (auto point : cluster.corePoints())
+    PointRange corePoints() const { return {coreSpans, std::size_t(numCore)}; }
+    PointRange outerPoints() const { return {outerSpans, std::size_t(numOuter)}; }
+
+    int size() const;
+    int numCorePoints() const { return numCore; }
+    int numOuterPoints() const { return numOuter; }
+
+    const ClusterStats &statistics() const { return stats; }
+    ClusterSummary summary() const;
 };
-} // namespace rrec
\ No newline at end of file
+} // namespace rrec
@@ -1,79 +1,47 @@
 #include "dbscan.hpp"
 
+#include <algorithm>
+
+#include "parallel.hpp"
+#include "summed_area.hpp"
+
 namespace rrec
 {
 
-void DBSCAN::getNeighbours(std::vector<std::vector<bool>> &thresh,
+void DBSCAN::getNeighbours(const PackedMask &coreMask,
                            std::vector<std::array<int, 2>> &neighbours,
                            int i, int j, int eps)
 {
-    // there can be no core nodes on the edge of an image
-    if (i == 0 ||
-        j == 0 ||
-        i == (thresh.size() - 1) ||
-        j == (thresh[i].size() - 1))
+    // with eps = 3 and minPts = 4 a point is core iff it and its 4 orthogonal
+    // neighbours are all significant, which core_points has already worked
+    // out for the whole image (edges are never core)
+    if (!coreMask.get(i, j))
     {
         neighbours[0][0] = -1;
         return;
     }
 
-    if (thresh[i - 1][j])
-    {
-
-        neighbours[0][0] = i - 1;
-        neighbours[0][1] = j;
-    }
-    else
-    {
-        neighbours[0][0] = -1;
-        return;
-    }
-    if (thresh[i][j - 1])
-    {
-
-        neighbours[1][0] = i;
-        neighbours[1][1] = j - 1;
-    }
-    else
-    {
-        neighbours[0][0] = -1;
-        return;
-    }
-    if (thresh[i + 1][j])
-    {
-
-        neighbours[2][0] = i + 1;
-        neighbours[2][1] = j;
-    }
-    else
-    {
-        neighbours[0][0] = -1;
-        return;
-    }
-    if (thresh[i][j + 1])
-    {
-        neighbours[3][0] = i;
-        neighbours[3][1] = j + 1;
-    }
-    else
-    {
-        neighbours[0][0] = -1;
-        return;
-    }
+    neighbours[0][0] = i - 1;
+    neighbours[0][1] = j;
+    neighbours[1][0] = i;
+    neighbours[1][1] = j - 1;
+    neighbours[2][0] = i + 1;
+    neighbours[2][1] = j;
+    neighbours[3][0] = i;
+    neighbours[3][1] = j + 1;
 }
 
-Cluster DBSCAN::getCluster(std::vector<std::vector<bool>> &thresh,
-                           std::vector<std::vector<int>> &pointFlags,
+Cluster DBSCAN::getCluster(const PackedMask &coreMask,
+                           FlagImage &pointFlags,
                            int i, int j, int eps, int minPts)
 {
-    static long long int clusterNum; // keeps track of which cluster we're up to
     int N = 0;                       // number of points currently in cluster
     int coreCount = 0;
     int perimCount = 0;
     int clusterStride = 2;
 
     std::vector<std::array<int, 2>> neighbours(4);
-    getNeighbours(thresh, neighbours, i, j, eps);
+    getNeighbours(coreMask, neighbours, i, j, eps);
 
     if (neighbours[0][0] == -1)
     {
@@ -82,8 +50,8 @@ Cluster DBSCAN::getCluster(std::vector<std::vector<bool>> &thresh,
     }
 
     pointFlags[i][j] = core;
-    corePoints[coreCount][0] = i;
-    corePoints[coreCount][1] = j;
+    work.corePoints[coreCount][0] = i;
+    work.corePoints[coreCount][1] = j;
     ++coreCount;
 
     Cluster cluster(clusterNum);
@@ -100,7 +68,7 @@ Cluster DBSCAN::getCluster(std::vector<std::vector<bool>> &thresh,
     // add the neighbours to clusterPoints
     for (int i = 0; i < 4; ++i)
     {
-        clusterPoints[i] = neighbours[i];
+        work.clusterPoints[i] = neighbours[i];
     }
 
     // now loop over all neighbours that could be in the cluster:
@@ -111,34 +79,34 @@ Cluster DBSCAN::getCluster(std::vector<std::vector<bool>> &thresh,
     // if the neighbour is not core, label it as perimeter
     for (int a = 0; a < N; ++a)
     {
-        int x = clusterPoints[a][0];
-        int y = clusterPoints[a][1];
+        int x = work.clusterPoints[a][0];
+        int y = work.clusterPoints[a][1];
         if (pointFlags[x][y] == noise)
         {
             pointFlags[x][y] = perimeter + clusterNum;
-            perimPoints[perimCount][0] = x;
-            perimPoints[perimCount][1] = y;
+            work.perimPoints[perimCount][0] = x;
+            work.perimPoints[perimCount][1] = y;
             ++perimCount;
         }
 
         if (pointFlags[x][y] == TBD)
         {
-            getNeighbours(thresh, neighbours, x, y, eps);
+            getNeighbours(coreMask, neighbours, x, y, eps);
 
             // the next line can be read as 'if [x, y] is a core node'
             if (neighbours[0][0] != -1)
             {
                 // if execution reached here, [x, y] is a core node point
                 pointFlags[x][y] = core + clusterNum;
-                corePoints[coreCount][0] = x;
-                corePoints[coreCount][1] = y;
+                work.corePoints[coreCount][0] = x;
+                work.corePoints[coreCount][1] = y;
                 ++coreCount;
                 for (auto coords : neighbours)
                 {
                     if (pointFlags[coords[0]][coords[1]] == unlabelled)
                     {
                         pointFlags[coords[0]][coords[1]] = TBD;
-                        clusterPoints[N] = coords;
+                        work.clusterPoints[N] = coords;
                         N += 1;
                     }
                 }
@@ -146,29 +114,23 @@ Cluster DBSCAN::getCluster(std::vector<std::vector<bool>> &thresh,
             else
             {
                 pointFlags[x][y] = perimeter + clusterNum;
-                perimPoints[perimCount][0] = x;
-                perimPoints[perimCount][1] = y;
+                work.perimPoints[perimCount][0] = x;
+                work.perimPoints[perimCount][1] = y;
                 ++perimCount;
             }
         }
     }
 
     // now we have all the cluster details, we should finish making the Cluster
-    // object - first populating the outerPoints vector
-    cluster.outerPoints.resize(perimCount);
+    // object. Points were found in the order the cluster grew, so put them in
+    // raster order first so they pack into as few spans as possible
+    std::sort(work.perimPoints.begin(), work.perimPoints.begin() + perimCount);
     for (int i = 0; i < perimCount; ++i)
-    {
-        cluster.outerPoints[i][0] = perimPoints[i][0];
-        cluster.outerPoints[i][1] = perimPoints[i][1];
-    }
+        cluster.addOuter(work.perimPoints[i][0], work.perimPoints[i][1]);
 
-    // now populate corePoints
-    cluster.corePoints.resize(coreCount);
+    std::sort(work.corePoints.begin(), work.corePoints.begin() + coreCount);
     for (int i = 0; i < coreCount; ++i)
-    {
-        cluster.corePoints[i][0] = corePoints[i][0];
-        cluster.corePoints[i][1] = corePoints[i][1];
-    }
+        cluster.addCore(work.corePoints[i][0], work.corePoints[i][1]);
 
     // incrament the cluster number!
     clusterNum += clusterStride;
@@ -176,16 +138,30 @@ Cluster DBSCAN::getCluster(std::vector<std::vector<bool>> &thresh,
     return cluster;
 }
 
-std::vector<Cluster> DBSCAN::do_dbscan(std::vector<std::vector<bool>> &thresh,
-                                       std::vector<std::vector<int>> &pointFlags)
+std::vector<Cluster> DBSCAN::do_dbscan(const PackedMask &thresh,
+                                       FlagImage &pointFlags)
 {
     // eps must be an odd integer
     int eps = 3;
     // set minPts = every neighbour - this allows for further optimizations!
     int minPts = 4;
 
-    int rows = thresh.size();
-    int cols = thresh[0].size();
+    int rows = thresh.rows();
+    int cols = thresh.cols();
+
+    // a cluster can't hold more points than the image (plus the 4 neighbours
+    // of its seed, which go on the stack unconditionally)
+    size_t most = static_cast<size_t>(rows) * cols + 4;
+    if (work.clusterPoints.size() < most)
+    {
+        work.clusterPoints.resize(most);
+        work.perimPoints.resize(most);
+        work.corePoints.resize(most);
+    }
+
+    // find every core point up front, 64 pixels at a time
+    PackedMask &coreMask = work.coreMask;
+    thresh.core_points(coreMask);
 
     std::vector<Cluster> clusters;
     // do the clustering
@@ -194,14 +170,15 @@ std::vector<Cluster> DBSCAN::do_dbscan(std::vector<std::vector<bool>> &thresh,
         // std::cout << "Clustering about row: " << i << std::endl;
         for (int j = 0; j < cols; ++j)
         {
-            if (thresh[i][j] && (pointFlags[i][j] == unlabelled))
+            bool significant = thresh.get(i, j);
+            if (significant && (pointFlags[i][j] == unlabelled))
             {
-                Cluster cluster = getCluster(thresh, pointFlags, i, j, eps,
+                Cluster cluster = getCluster(coreMask, pointFlags, i, j, eps,
                                              minPts);
                 if (cluster.getClusterNum() != -1)
                     clusters.push_back(cluster);
             }
-            if (!thresh[i][j] && pointFlags[i][j] == unlabelled)
+            if (!significant && pointFlags[i][j] == unlabelled)
             {
                 pointFlags[i][j] = noise;
             }
@@ -210,104 +187,455 @@ std::vector<Cluster> DBSCAN::do_dbscan(std::vector<std::vector<bool>> &thresh,
     return clusters;
 }
 
-DBSCAN::DBSCAN(int numpixels) : clusterPoints(numpixels),
-                                perimPoints(numpixels),
-                                corePoints(numpixels)
+std::vector<Cluster> DBSCAN::do_union_find(const PackedMask &thresh,
+                                           FlagImage &pointFlags)
 {
-}
+    int rows = thresh.rows();
+    int cols = thresh.cols();
 
-std::vector<Cluster> DBSCAN::getClusters(cv::Mat threshold, cv::Mat outImage)
-{
+    // clusters are the connected components of the core points, numbered in
+    // the order do_dbscan would have found them (raster order of their first
+    // core point, which do_dbscan uses as the seed)
+    PackedMask &coreMask = work.coreMask;
+    thresh.core_points(coreMask);
 
-    /*
-        Takes a threshold generated by detectSignal and returns a cv::Mat of the
-        original image with rectangles overlayed on top of detected skyrmions
-    */
-    size_t rows = threshold.rows;
-    size_t cols = threshold.cols;
+    Labelling &labelling = work.labelling;
+    label_components(coreMask, labelling, numThreads);
 
-    // make sure outImage is the correct size
-    outImage.create(rows, cols, CV_8UC1);
+    std::vector<Cluster> clusters;
+    clusters.reserve(labelling.num_components);
+    std::vector<long long> &seeds = work.seeds;
+    seeds.resize(labelling.num_components);
+    for (int c = 0; c < labelling.num_components; ++c)
+    {
+        clusters.push_back(Cluster(2 * c));
+        const Run &first = labelling.runs[labelling.first_run[c]];
+        seeds[c] = static_cast<long long>(first.row) * cols + first.begin;
+    }
+
+    // the runs are the core spans
+    for (const Run &run : labelling.runs)
+    {
+        clusters[run.label].addCore(run.row, run.begin, run.end);
+        for (int j = run.begin; j < run.end; ++j)
+            pointFlags[run.row][j] = core + 2 * run.label;
+    }
+
+    // now the perimeter points: significant points which aren't core. Each
+    // band of rows finds the owners of its points on its own (keeping the
+    // labels of the rows above and below the current one to hand), and the
+    // results are gathered in band order so the clusters come out the same
+    // whatever the number of threads
+    int num_bands = std::min(resolve_threads(numThreads), std::max(rows, 1));
+    std::vector<std::vector<std::array<int, 3>>> &found = work.found;
+    found.resize(std::max(found.size(), static_cast<size_t>(num_bands)));
+    for (auto &points : found)
+        points.clear();
+
+    parallel_for(num_bands, num_bands, [&](int band_begin, int band_end) {
+        for (int band = band_begin; band < band_end; ++band)
+        {
+            int begin = static_cast<int>(static_cast<long long>(rows) * band /
+                                         num_bands);
+            int end = static_cast<int>(static_cast<long long>(rows) * (band + 1) /
+                                       num_bands);
+
+            std::vector<int> above(cols, -1), here(cols, -1), below(cols, -1);
+            if (begin > 0)
+                fill_row_labels(labelling, begin - 1, cols, above.data());
+            if (begin < end)
+                fill_row_labels(labelling, begin, cols, here.data());
+
+            for (int i = begin; i < end; ++i)
+            {
+                if (i + 1 < rows)
+                    fill_row_labels(labelling, i + 1, cols, below.data());
+                else
+                    std::fill(below.begin(), below.end(), -1);
+
+                const uint64_t *t = thresh.row(i);
+                const uint64_t *c = coreMask.row(i);
+                for (int k = 0; k < thresh.words_per_row(); ++k)
+                {
+                    uint64_t w = t[k] & ~c[k];
+                    while (w)
+                    {
+                        int j = 64 * k + __builtin_ctzll(w);
+                        w &= w - 1;
+
+                        int up = above[j];
+                        int down = below[j];
+                        int left = j > 0 ? here[j - 1] : -1;
+                        int right = j + 1 < cols ? here[j + 1] : -1;
+
+                        int first = -1;
+                        for (int label : {up, down, left, right})
+                            if (label >= 0 && (first < 0 || label < first))
+                                first = label;
+                        if (first < 0)
+                            continue;
+
+                        // do_dbscan grows each cluster completely before its
+                        // raster scan moves on. If the earliest neighbouring
+                        // cluster was seeded before this point, its growth
+                        // reached the point first
+                        long long point = static_cast<long long>(i) * cols + j;
+                        int owner = -1;
+                        if (seeds[first] < point)
+                        {
+                            owner = first;
+                        }
+                        else
+                        {
+                            // otherwise the scan got here first and called it
+                            // noise, and noise is only picked up again by the
+                            // seed of a cluster, which checks its 4 neighbours
+                            // unconditionally
+                            if (right >= 0 && seeds[right] == point + 1)
+                                owner = right;
+                            if (down >= 0 && seeds[down] == point + cols &&
+                                (owner < 0 || down < owner))
+                                owner = down;
+                        }
+
+                        if (owner >= 0)
+                        {
+                            found[band].push_back({owner, i, j});
+                            pointFlags[i][j] = perimeter + 2 * owner;
+                        }
+                    }
+                }
 
-    std::vector<std::vector<bool>> thresh{rows, std::vector<bool>(cols)};
-    std::vector<std::vector<int>>
-        pointFlags{rows, std::vector<int>(cols, unlabelled)};
+                std::swap(above, here);
+                std::swap(here, below);
+            }
+        }
+    });
+
+    for (const auto &points : found)
+        for (const auto &point : points)
+            clusters[point[0]].addOuter(point[1], point[2]);
 
-    // now we want to populate the bool vector
-    unsigned char *thresholdPointer;
+    // everything else is noise
     for (int i = 0; i < rows; ++i)
-    {
-        thresholdPointer = threshold.ptr<unsigned char>(i);
         for (int j = 0; j < cols; ++j)
+            if (pointFlags[i][j] == unlabelled)
+                pointFlags[i][j] = noise;
+
+    return clusters;
+}
+
+std::vector<Cluster> DBSCAN::do_grid(const PackedMask &thresh,
+                                     FlagImage &pointFlags)
+{
+    int rows = thresh.rows();
+    int cols = thresh.cols();
+    int r = eps / 2; // how far the neighbourhood reaches along each axis
+
+    // a point is core if its window holds at least minPts significant points
+    SummedArea &density = work.density;
+    density.build(thresh, numThreads);
+
+    PackedMask &coreMask = work.coreMask;
+    coreMask.create(rows, cols);
+    parallel_for(rows, numThreads, [&](int begin, int end) {
+        for (int i = begin; i < end; ++i)
         {
-            if (thresholdPointer[j] < 128)
-                thresh[i][j] = false;
-            else
-                thresh[i][j] = true;
+            const uint64_t *t = thresh.row(i);
+            uint64_t *c = coreMask.row(i);
+            for (int k = 0; k < thresh.words_per_row(); ++k)
+            {
+                uint64_t w = t[k];
+                while (w)
+                {
+                    int j = 64 * k + __builtin_ctzll(w);
+                    w &= w - 1;
+                    if (density.count_around(i, j, r) >= minPts)
+                        c[k] |= static_cast<uint64_t>(1) << (j & 63);
+                }
+            }
         }
-    }
+    });
+
+    SummedArea &coreDensity = work.coreDensity;
+    coreDensity.build(coreMask, numThreads);
+
+    // Core points in the same s x s cell are at most s - 1 <= r apart, so
+    // every cell's core points belong to one cluster. Core points in cells
+    // more than one cell apart are too far apart to be neighbours, so only
+    // adjacent cells need joining up
+    int s = std::max(r, 1);
+    int grid_rows = (rows + s - 1) / s;
+    int grid_cols = (cols + s - 1) / s;
+
+    auto cell_core = [&](int gi, int gj) {
+        return coreDensity.count(gi * s, gj * s, gi * s + s - 1, gj * s + s - 1);
+    };
+
+    std::vector<int> &parent = work.parent;
+    parent.resize(static_cast<size_t>(grid_rows) * grid_cols);
+    for (int c = 0; c < static_cast<int>(parent.size()); ++c)
+        parent[c] = c;
+
+    // two adjacent cells are joined if any core point in the first has a
+    // core point of the second in its window
+    auto cells_touch = [&](int gi, int gj, int ni, int nj) {
+        int top = ni * s, left = nj * s;
+        int bottom = top + s - 1, right = left + s - 1;
+        for (int i = gi * s; i < std::min(gi * s + s, rows); ++i)
+            for (int j = gj * s; j < std::min(gj * s + s, cols); ++j)
+                if (coreMask.get(i, j) &&
+                    coreDensity.count(std::max(i - r, top), std::max(j - r, left),
+                                      std::min(i + r, bottom),
+                                      std::min(j + r, right)) > 0)
+                    return true;
+        return false;
+    };
+
+    if (r > 0)
+    {
+        const int offsets[4][2] = {{0, 1}, {1, -1}, {1, 0}, {1, 1}};
+        for (int gi = 0; gi < grid_rows; ++gi)
+        {
+            for (int gj = 0; gj < grid_cols; ++gj)
+            {
+                if (cell_core(gi, gj) == 0)
+                    continue;
 
-    std::vector<Cluster> clusters{do_dbscan(thresh, pointFlags)};
+                int cell = gi * grid_cols + gj;
+                for (const auto &offset : offsets)
+                {
+                    int ni = gi + offset[0];
+                    int nj = gj + offset[1];
+                    if (ni >= grid_rows || nj < 0 || nj >= grid_cols ||
+                        cell_core(ni, nj) == 0)
+                        continue;
+
+                    int neighbour = ni * grid_cols + nj;
+                    if (find_root(parent, cell) != find_root(parent, neighbour) &&
+                        cells_touch(gi, gj, ni, nj))
+                        unite(parent, cell, neighbour);
+                }
+            }
+        }
+    }
 
-    // do some additional pruning: kill very big/very small clusters
-    // in order to do this it can be useful to calculate some statistics first
-    int min{clusters[0].size()}, max{clusters[0].size()};
-    double mean{0};
-    for (Cluster cluster : clusters)
+    // number the clusters in the raster order of their first core point
+    std::vector<int> &root_label = work.rootLabel;
+    root_label.assign(parent.size(), -1);
+    std::vector<Cluster> clusters;
+    for (int i = 0; i < rows; ++i)
     {
-        if (cluster.size() > max)
-            max = cluster.size();
-        else if (cluster.size() < min)
-            min = cluster.size();
+        const uint64_t *c = coreMask.row(i);
+        for (int k = 0; k < coreMask.words_per_row(); ++k)
+        {
+            uint64_t w = c[k];
+            while (w)
+            {
+                int j = 64 * k + __builtin_ctzll(w);
+                w &= w - 1;
 
-        mean += cluster.size();
+                int root = find_root(parent, (i / s) * grid_cols + j / s);
+                if (root_label[root] < 0)
+                {
+                    root_label[root] = static_cast<int>(clusters.size());
+                    clusters.push_back(Cluster(2 * root_label[root]));
+                }
+
+                int label = root_label[root];
+                clusters[label].addCore(i, j);
+                pointFlags[i][j] = core + 2 * label;
+            }
+        }
     }
+
+    // flatten the forest so the perimeter pass can read it from any thread
+    std::vector<int> &cell_label = work.cellLabel;
+    cell_label.resize(parent.size());
+    for (int c = 0; c < static_cast<int>(parent.size()); ++c)
+        cell_label[c] = root_label[find_root(parent, c)];
+
+    // perimeter points: significant points with a core point in their window.
+    // As in do_union_find, each band of rows collects its own points and they
+    // are gathered in band order
+    int num_bands = std::min(resolve_threads(numThreads), std::max(rows, 1));
+    std::vector<std::vector<std::array<int, 3>>> &found = work.found;
+    found.resize(std::max(found.size(), static_cast<size_t>(num_bands)));
+    for (auto &points : found)
+        points.clear();
+
+    parallel_for(num_bands, num_bands, [&](int band_begin, int band_end) {
+        for (int band = band_begin; band < band_end; ++band)
+        {
+            int begin = static_cast<int>(static_cast<long long>(rows) * band /
+                                         num_bands);
+            int end = static_cast<int>(static_cast<long long>(rows) * (band + 1) /
+                                       num_bands);
+
+            for (int i = begin; i < end; ++i)
+            {
+                const uint64_t *t = thresh.row(i);
+                const uint64_t *c = coreMask.row(i);
+                for (int k = 0; k < thresh.words_per_row(); ++k)
+                {
+                    uint64_t w = t[k] & ~c[k];
+                    while (w)
+                    {
+                        int j = 64 * k + __builtin_ctzll(w);
+                        w &= w - 1;
+
+                        if (coreDensity.count_around(i, j, r) == 0)
+                            continue;
+
+                        // look through the cells the window overlaps for the
+                        // lowest numbered cluster in reach
+                        int owner = -1;
+                        for (int gi = std::max(i - r, 0) / s;
+                             gi <= std::min(i + r, rows - 1) / s; ++gi)
+                        {
+                            for (int gj = std::max(j - r, 0) / s;
+                                 gj <= std::min(j + r, cols - 1) / s; ++gj)
+                            {
+                                int label = cell_label[gi * grid_cols + gj];
+                                if (label < 0 || (owner >= 0 && label >= owner))
+                                    continue;
+
+                                if (coreDensity.count(std::max(i - r, gi * s),
+                                                      std::max(j - r, gj * s),
+                                                      std::min(i + r, gi * s + s - 1),
+                                                      std::min(j + r, gj * s + s - 1)) > 0)
+                                    owner = label;
+                            }
+                        }
+
+                        found[band].push_back({owner, i, j});
+                        pointFlags[i][j] = perimeter + 2 * owner;
+                    }
+                }
+            }
+        }
+    });
+
+    for (const auto &points : found)
+        for (const auto &point : points)
+            clusters[point[0]].addOuter(point[1], point[2]);
+
+    // everything else is noise
+    for (int i = 0; i < rows; ++i)
+        for (int j = 0; j < cols; ++j)
+            if (pointFlags[i][j] == unlabelled)
+                pointFlags[i][j] = noise;
+
+    return clusters;
+}
+
+DBSCAN::DBSCAN(int) : work(own), clusterNum{0}, numThreads{1}, eps{3}, minPts{4}
+{
+}
+
+DBSCAN::DBSCAN(ClusterWorkspace &workspace) : work(workspace),
+                                              clusterNum{0},
+                                              numThreads{1},
+                                              eps{3},
+                                              minPts{4}
+{
+}
+
+void DBSCAN::setThreads(int num_threads) { numThreads = num_threads; }
+
+void DBSCAN::setParameters(int eps, int minPts)
+{
+    this->eps = eps;
+    this->minPts = minPts;
+}
+
+void DBSCAN::prune(const std::vector<Cluster> &clusters, FlagImage &pointFlags)
+{
+    // kill very big/very small clusters. Every cluster already knows its
+    // area (see ClusterStats), so the mean and stddev of the areas only need
+    // a couple of passes over the clusters. With no clusters there's no mean
+    if (clusters.empty())
+        return;
+
+    double mean{0};
+    for (const Cluster &cluster : clusters)
+        mean += cluster.statistics().area;
     mean /= clusters.size();
 
     double stddev{0};
     // now work out the average deviation from the mean
-    for (Cluster cluster : clusters)
+    for (const Cluster &cluster : clusters)
     {
-        stddev += (cluster.size() - mean) * (cluster.size() - mean);
+        double area = cluster.statistics().area;
+        stddev += (area - mean) * (area - mean);
     }
     stddev /= clusters.size();
     stddev = std::sqrt(stddev);
 
-    // std::cout << "stddev: " << stddev << ", mean: " << mean << std::endl;
-    // std::cout << "min: " << min << ", max: " << max << std::endl;
-
-    // now work out which clusters are anomalous, saving the good'uns in
-    // finalClusters
-    std::vector<Cluster> finalClusters;
-    finalClusters.reserve(clusters.size());
+    // now work out which clusters are anomalous
     int upperBound = mean + stddev;
     int lowerBound = 4;
-    for (int i = 0; i < clusters.size(); ++i)
+    for (const Cluster &cluster : clusters)
     {
-        if (clusters[i].size() > upperBound ||
-            clusters[i].size() < lowerBound)
-        {
-            // if the cluster is too big/too small, remove it from image
-            // the image will be generated from pointFlags, so remove from there
-            for (auto coords : clusters[i].corePoints)
-            {
-                pointFlags[coords[0]][coords[1]] = noise;
-            }
-            for (auto coords : clusters[i].outerPoints)
-            {
-                if (clusters[i].size() > 2 * stddev + mean)
-                {
-                    pointFlags[coords[0]][coords[1]] = noise;
-                }
-                // pointFlags[coords[0]][coords[1]] = noise;
-            }
-        }
-        else
-        {
-            // if the cluster is the right size, put it in finalClusters
-            finalClusters.push_back(clusters[i]);
-        }
+        long long area = cluster.statistics().area;
+        if (area <= upperBound && area >= lowerBound)
+            continue;
+
+        // if the cluster is too big/too small, remove it from image
+        // the image will be generated from pointFlags, so remove from there
+        for (const Span &span : cluster.coreSpans)
+            std::fill(pointFlags[span.row] + span.begin,
+                      pointFlags[span.row] + span.end, int(noise));
+
+        // only the outer points of really big clusters go
+        if (area > 2 * stddev + mean)
+            for (const Span &span : cluster.outerSpans)
+                std::fill(pointFlags[span.row] + span.begin,
+                          pointFlags[span.row] + span.end, int(noise));
     }
+}
+
+std::vector<Cluster> DBSCAN::getClusters(cv::Mat threshold, cv::Mat outImage)
+{
+    // pack the threshold (pixels >= 128 are significant) and cluster that
+    work.thresh.from_mat(threshold);
+    return getClusters(work.thresh, outImage);
+}
+
+std::vector<Cluster> DBSCAN::getClusters(const PackedMask &thresh,
+                                         cv::Mat outImage)
+{
+    return getClusters(thresh, outImage, cluster_engine::dbscan);
+}
+
+std::vector<Cluster> DBSCAN::getClusters(const PackedMask &thresh,
+                                         cv::Mat outImage,
+                                         cluster_engine engine)
+{
+
+    /*
+        Takes a threshold generated by detectSignal and returns a cv::Mat of the
+        original image with rectangles overlayed on top of detected skyrmions
+    */
+    size_t rows = thresh.rows();
+    size_t cols = thresh.cols();
+
+    // make sure outImage is the correct size
+    outImage.create(rows, cols, CV_8UC1);
+
+    FlagImage &pointFlags = work.pointFlags;
+    pointFlags.assign(rows, cols, unlabelled);
+
+    std::vector<Cluster> clusters;
+    if (engine == cluster_engine::union_find)
+        clusters = do_union_find(thresh, pointFlags);
+    else if (engine == cluster_engine::grid)
+        clusters = do_grid(thresh, pointFlags);
+    else
+        clusters = do_dbscan(thresh, pointFlags);
+
+    // do some additional pruning: kill very big/very small clusters
+    prune(clusters, pointFlags);
 
     // now we have the thresholded image we can redraw image to show clustering
     unsigned char *imgPointer;
@@ -326,6 +654,8 @@ std::vector<Cluster> DBSCAN::getClusters(cv::Mat threshold, cv::Mat outImage)
         }
     }
 
+    work.update_peak();
+
     // return the vector of clusters
     return clusters;
 }
@@ -5,15 +5,34 @@
 #include <opencv2/opencv.hpp>
 
 #include "cluster.hpp"
+#include "bitmask.hpp"
+#include "labelling.hpp"
+#include "workspace.hpp"
 
 namespace rrec
 {
+// which algorithm DBSCAN::getClusters uses. dbscan and union_find give the
+// same clusters (for eps = 3, minPts = 4 with a cross shaped neighbourhood),
+// grid honours DBSCAN's eps/minPts parameters
+enum class cluster_engine
+{
+    dbscan,     // point by point region growing
+    union_find, // run-length connected component labelling of the core points
+    grid        // general DBSCAN with square eps x eps neighbourhoods
+};
+
 class DBSCAN
 {
   private:
-    std::vector<std::array<int, 2>> clusterPoints;
-    std::vector<std::array<int, 2>> perimPoints;
-    std::vector<std::array<int, 2>> corePoints;
+    ClusterWorkspace own; // only used if we weren't given a workspace
+    ClusterWorkspace &work;
+
+    long long clusterNum; // keeps track of which cluster we're up to
+    int numThreads;       // threads used by the union_find and grid engines
+
+    int eps;    // neighbourhood size used by the grid engine (odd)
+    int minPts; // core points have >= minPts significant points (themselves
+                // included) in their neighbourhood
 
     // we use this enum to label points
     enum dbscan_labels
@@ -25,20 +44,64 @@ class DBSCAN
         core
     };
 
-    void getNeighbours(std::vector<std::vector<bool>> &thresh,
+    // coreMask holds the precomputed core points (see PackedMask::core_points)
+    void getNeighbours(const PackedMask &coreMask,
                        std::vector<std::array<int, 2>> &neighbours,
                        int i, int j, int eps);
 
-    Cluster getCluster(std::vector<std::vector<bool>> &thresh,
-                       std::vector<std::vector<int>> &pointFlags,
+    Cluster getCluster(const PackedMask &coreMask,
+                       FlagImage &pointFlags,
                        int i, int j, int eps, int minPts);
 
-    std::vector<Cluster> do_dbscan(std::vector<std::vector<bool>> &thresh,
-                                   std::vector<std::vector<int>> &pointFlags);
+    std::vector<Cluster> do_dbscan(const PackedMask &thresh,
+                                   FlagImage &pointFlags);
+
+    // produces exactly what do_dbscan does (for eps = 3, minPts = 4): the
+    // clusters are the 4-connected components of the core points, and the
+    // perimeter points are attached to clusters the way do_dbscan's region
+    // growing would have attached them
+    std::vector<Cluster> do_union_find(const PackedMask &thresh,
+                                       FlagImage &pointFlags);
+
+    // DBSCAN over the significant pixels for any eps/minPts, where a pixel's
+    // neighbourhood is the eps x eps square centred on it. Neighbour counts
+    // come from summed area tables, so are O(1) whatever eps is, and the core
+    // points are joined up on a grid of (eps / 2) sized cells. Clusters are
+    // numbered in the raster order of their first core point, and a perimeter
+    // point goes to the lowest numbered cluster with a core point in reach
+    std::vector<Cluster> do_grid(const PackedMask &thresh,
+                                 FlagImage &pointFlags);
+
+    // takes clusters that are far bigger than the rest, or tiny, out of the
+    // drawn image by marking their points noise in pointFlags
+    void prune(const std::vector<Cluster> &clusters, FlagImage &pointFlags);
 
   public:
-    DBSCAN(int numPixels); // DBSCAN should be told the # of pixels in the img
+    // uses its own workspace, which grows to fit the image on first use (the
+    // number of pixels is no longer needed up front)
+    DBSCAN(int numPixels);
+
+    // uses (and grows) workspace rather than allocating its own buffers, so
+    // one workspace can serve every frame
+    explicit DBSCAN(ClusterWorkspace &workspace);
+
+    DBSCAN(const DBSCAN &) = delete;
+    DBSCAN &operator=(const DBSCAN &) = delete;
+
+    // number of threads the union_find and grid engines use (< 1 means one
+    // per core). Defaults to 1, the clusters don't depend on it
+    void setThreads(int num_threads);
+
+    // neighbourhood size (a positive odd number) and density threshold used
+    // by the grid engine. Defaults to eps = 3, minPts = 4
+    void setParameters(int eps, int minPts);
 
     std::vector<Cluster> getClusters(cv::Mat threshold, cv::Mat outImage);
+
+    // same as above for a mask that's already bit-packed
+    std::vector<Cluster> getClusters(const PackedMask &threshold,
+                                     cv::Mat outImage);
+    std::vector<Cluster> getClusters(const PackedMask &threshold,
+                                     cv::Mat outImage, cluster_engine engine);
 };
 } // namespace rrec
\ No newline at end of file
@@ -8,9 +8,29 @@
 
 #include "dbscan.hpp"
 #include "cluster.hpp"
+#include "pic.hpp"
+#include "equalizer.hpp"
+#include "significance.hpp"
+#include "gaussian.hpp"
+#include "workspace.hpp"
+#include "serialize.hpp"
+#include "stats.hpp"
 
 namespace rrec
 {
+// everything run_algorithm needs to go from a raw frame to clusters
+struct AlgorithmParams
+{
+    int equalize_length; // adaptive_hist_eq window, < 1 skips equalization
+    int L;               // background size (odd)
+    int d;               // signal size (odd)
+    double sigma;        // significance threshold
+    cluster_engine engine;
+    int num_threads; // for significance and clustering, < 1 => one per core
+    int eps;         // grid engine only
+    int minPts;      // grid engine only
+};
+
 class Detector
 {
   private:
@@ -19,19 +39,34 @@ class Detector
     cv::Mat image_d;
     cv::Mat image_clustered;
 
+    // bit-packed significance mask, only used if is_packed (see below)
+    PackedMask mask;
+
     std::vector<rrec::Cluster> clusters;
 
+    // clustering scratch memory, reused from frame to frame
+    ClusterWorkspace workspace;
+
+    cluster_format format = cluster_format::points;
+    std::vector<unsigned char> results; // the serialized clusters
+
     std::string path;
 
     float pic_cutoff; // .pic max threshold, defaults to 900 (see constructors)
 
+    int background_size = 0; // L of the last background calculation
+
     char pixel_from_intensity(std::vector<int> intensity, int num_pixels);
 
+    // clusters the mask (or image_clustered/image_main) with scanner
+    void run_scanner(DBSCAN &scanner, cluster_engine engine);
+
   public:
-    bool is_open;       // true if image was loaded properly into RAM
-    bool is_background; // true if calculate_background has been called properly
-    bool is_signal;     // true if calculate_signal has been called properly
-    bool is_clustered;  // true if calculate_significance has been called
+    bool is_open = false;       // true if image was loaded properly into RAM
+    bool is_background = false; // true if calculate_background has been called properly
+    bool is_signal = false;     // true if calculate_signal has been called properly
+    bool is_clustered = false;  // true if calculate_significance has been called
+    bool is_packed = false;     // true if the latest significance is in mask
     void err_not_open();
 
     cv::Mat get_image_main();
@@ -39,6 +74,10 @@ class Detector
     cv::Mat get_image_d();
     cv::Mat get_image_clustered();
     void set_image_main(cv::Mat image);
+    // like set_image_main, but image_main shares image's pixels instead of
+    // copying them. Nothing writes into them, equalizing replaces image_main
+    // with a new image. Sets is_open
+    void use_image_main(cv::Mat image);
 
     void load_vector(std::vector<char> image); // not implemented
     void load_image(std::string path);
@@ -56,9 +95,14 @@ class Detector
 
     // an adaptive histogram equalization algorithm
     void adaptive_hist_eq(int length);
+    void adaptive_hist_eq_reference(int length); // same output, much slower
+
+    // approximate, multithreaded adaptive equalization over tile*tile tiles
+    void adaptive_hist_eq_tiled(int tile, int num_threads);
 
     // creates image_L, which is an image representing weighted mean pixel vals
     void calculate_background(int L);
+    void calculate_background(int L, blur_engine engine);
 
     // creates image_d, which is an image representing signal at each pixel
     void calculate_signal(int d);
@@ -66,8 +110,48 @@ class Detector
     // creates image_clustered, which for now is a thresholded image
     void calculate_significance(double sigma);
 
+    // as above, but only writes the bit-packed mask (which cluster then uses
+    // directly), image_clustered isn't touched
+    void calculate_significance_packed(double sigma);
+
+    // as above, but uses the exact stddev of image_main over a window*window
+    // box around each pixel. window < 1 uses the background's L
+    void calculate_significance_exact(double sigma, int window);
+
+    // does calculate_background, calculate_signal and calculate_significance
+    // in a single pass over image_main. image_L and image_d are only kept if
+    // keep_intermediates is set, otherwise they're released. Runs on
+    // num_threads threads (< 1 means one per core)
+    void detect_significance(int L, int d, double sigma,
+                             bool keep_intermediates, int num_threads = 0);
+
     // clusters image_clustered if available, else it clusters image_main
     void cluster();
+    void cluster(cluster_engine engine); // same clusters, different algorithm
+    // as above, with the union_find engine spread over num_threads threads
+    // (< 1 means one per core). The clusters don't depend on the thread count
+    void cluster(cluster_engine engine, int num_threads);
+    // general DBSCAN (the grid engine) with eps x eps neighbourhoods
+    void cluster_grid(int eps, int minPts, int num_threads);
     void print_clusters();
+
+    // equalizes image_main (if asked to), finds the significant pixels in a
+    // single pass (see detect_significance, no intermediates are kept) and
+    // clusters them, both on params.num_threads threads
+    void run_algorithm(const AlgorithmParams &params);
+
+    // the clusters serialized in the current format, i.e. the bytes
+    // print_clusters sends. Valid until the next call
+    const std::vector<unsigned char> &serialized_clusters();
+    void set_cluster_format(cluster_format format);
+    cluster_format get_cluster_format() const { return format; }
+    const std::vector<Cluster> &get_clusters() const { return clusters; }
+
+    // memory held by the clustering workspace now, and the most it has held
+    std::size_t workspace_bytes() const;
+    std::size_t workspace_peak_bytes() const;
+
+    // everything the detector holds: images, mask, clusters and buffers
+    std::size_t memory_bytes() const;
 };
 } // namespace rrec
\ No newline at end of file
@@ -3,12 +3,28 @@ import struct
 import numpy as np
 from time import sleep
 
+# layout of the records sent for each cluster in Server.summaryFormat (matches
+# rrec::ClusterSummary). The bounding box is inclusive, var_*/cov_row_col are
+# the second central moments over the area
+cluster_summary_dtype = np.dtype([('num_core', np.int32),
+                                  ('num_outer', np.int32),
+                                  ('min_row', np.int32),
+                                  ('min_col', np.int32),
+                                  ('max_row', np.int32),
+                                  ('max_col', np.int32),
+                                  ('centroid_row', np.float64),
+                                  ('centroid_col', np.float64),
+                                  ('var_row', np.float64),
+                                  ('var_col', np.float64),
+                                  ('cov_row_col', np.float64)])
+
 
 class Detector(server.Server):
-    def __init__(self, mode, binary=None):
+    def __init__(self, mode, binary=None, address=None):
         # call server's __init__ method
-        super(Detector, self).__init__(mode, binary)
+        super(Detector, self).__init__(mode, binary, address)
         self._main_image = None
+        self._cluster_format = server.Server.pointsFormat
 
     # definition of the main_image property:
     @property
@@ -34,9 +50,38 @@ class Detector(server.Server):
             print "(PYTHON): Error in equalize"
             print self.readline()
 
-    def calculate_background(self, brightness_variance):
+    def equalize_tiled(self, tile, num_threads=0):
+        """
+        Faster, approximate adaptive equalization over tile*tile tiles which
+        runs on num_threads threads (0 means one per core).
+        """
+        if type(tile) != int or type(num_threads) != int:
+            raise TypeError("Args to equalize_tiled must be integers")
+        else:
+            self._send_instruction(server.Server.equalizeTiled)
+            self.request(struct.pack('i', tile))
+            self.request(struct.pack('i', num_threads))
+
+            if self.read(4) != server.Server.success:
+                print "(PYTHON): Error in equalize_tiled"
+                print self.readline()
+
+    def calculate_background(self, brightness_variance, engine=None):
+        """
+        Blurs the main image to get the background. engine can be
+        Server.opencvBlur (the default) or Server.recursiveBlur, whose cost
+        doesn't grow with brightness_variance.
+        """
         if type(brightness_variance) != int:
             raise TypeError("Arg to calculate_background must be an integer")
+        elif engine is not None:
+            self._send_instruction(server.Server.calculateBackgroundWith)
+            self.request(struct.pack('i', brightness_variance))
+            self.request(struct.pack('i', engine))
+
+            if self.read(4) != server.Server.success:
+                print "(PYTHON): Error in calculate_background"
+                print self.readline()
         else:
             self._send_instruction(server.Server.calculateBackground)
             self.request(struct.pack('i', brightness_variance))
@@ -73,48 +118,355 @@ class Detector(server.Server):
 
                 print "Instruction received, ", self.readline()
 
-    def cluster(self):
-        self._send_instruction(server.Server.cluster)
+    def calculate_significance_packed(self, sigma):
+        """
+        Like calculate_significance, but the C++ end keeps the result as a
+        bit-packed mask which cluster uses directly.
+        """
+        if type(sigma) != float and type(sigma) != int:
+            raise TypeError("sigma must be an int or a float")
+
+        self._send_instruction(server.Server.calculateSignificancePacked)
+        self.request(struct.pack('d', sigma))
+
+        response = self.read(4)
+        if response != server.Server.success:
+            print "(PYTHON): Error in calculate_significance_packed"
+            print "Response:", struct.unpack('i', response)[0]
+            print "Instruction received, ", self.readline()
+
+    def calculate_significance_exact(self, sigma, window=0):
+        """
+        Like calculate_significance, but uses the exact local standard
+        deviation over a window*window box (window=0 uses the background's
+        size) rather than interpolating it from the background brightness.
+        """
+        if type(sigma) != float and type(sigma) != int:
+            raise TypeError("sigma must be an int or a float")
+        if type(window) != int:
+            raise TypeError("window must be an integer")
+
+        self._send_instruction(server.Server.calculateSignificanceExact)
+        self.request(struct.pack('d', sigma))
+        self.request(struct.pack('i', window))
 
         response = self.read(4)
         if response != server.Server.success:
-            print "(PYTHON): Error in cluster"
+            print "(PYTHON): Error in calculate_significance_exact"
             print "Response:", struct.unpack('i', response)[0]
             print "Instruction received, ", self.readline()
+
+    def detect_significance(self, brightness_variance, signal_size, sigma,
+                            keep_intermediates=False):
+        """
+        Does calculate_background, calculate_signal and calculate_significance
+        in one pass on the C++ end. The background and signal images are only
+        kept if keep_intermediates is True.
+        """
+        if type(brightness_variance) != int or type(signal_size) != int:
+            raise TypeError(
+                "brightness_variance and signal_size must be integers")
+        if type(sigma) != float and type(sigma) != int:
+            raise TypeError("sigma must be an int or a float")
+
+        self._send_instruction(server.Server.detectSignificance)
+        self.request(struct.pack('i', brightness_variance))
+        self.request(struct.pack('i', signal_size))
+        self.request(struct.pack('d', sigma))
+        self.request(struct.pack('i', 1 if keep_intermediates else 0))
+
+        response = self.read(4)
+        if response != server.Server.success:
+            print "(PYTHON): Error in detect_significance"
+            print "Response:", struct.unpack('i', response)[0]
+            print "Instruction received, ", self.readline()
+
+    def cluster(self, engine=None, num_threads=None):
+        """
+        Clusters the significant pixels and returns the clusters. engine can
+        be Server.dbscanEngine (the default) or Server.unionFindEngine, which
+        gives the same clusters faster. num_threads spreads the union find
+        engine over that many threads (0 means one per core), the clusters
+        are the same either way.
+        """
+        if num_threads is not None:
+            if engine is None:
+                engine = server.Server.unionFindEngine
+            self._send_instruction(server.Server.clusterParallel)
+            self.request(struct.pack('ii', engine, num_threads))
+        elif engine is not None:
+            self._send_instruction(server.Server.clusterWith)
+            self.request(struct.pack('i', engine))
         else:
-            # now we need to parse the response sent from the C++ end
-            # get the total number of bytes (CURRENTLY UNUSED)
-            num_bytes = struct.unpack('i', self.read(4))[0]
+            self._send_instruction(server.Server.cluster)
 
-            # get the total number of different clusters
-            num_clusters = struct.unpack('i', self.read(4))[0]
+        return self._read_clusters("cluster")
 
-            # make a list to store the clusters in
-            clusters = range(num_clusters)
+    def run_algorithm(self, equalize_length, brightness_variance, signal_size,
+                      sigma, engine=None, num_threads=1, eps=3, min_pts=4):
+        """
+        Runs the whole detection on the C++ end in one round trip: adaptive
+        histogram equalization over equalize_length (0 skips it), background,
+        signal and significance (in a single pass) and clustering, returning
+        the clusters. engine defaults to Server.unionFindEngine, eps and
+        min_pts are only used by Server.gridEngine. num_threads is how many
+        threads significance and clustering run on (0 means one per core).
+        """
+        if engine is None:
+            engine = server.Server.unionFindEngine
 
-            for i in range(num_clusters):
-                # grab the number of core points from the C++ end
-                num_core_points = struct.unpack('i', self.read(4))[0]
+        self._send_instruction(server.Server.runAlgorithm)
+        self.request(struct.pack('=iiidiiii', equalize_length,
+                                 brightness_variance, signal_size, sigma,
+                                 engine, num_threads, eps, min_pts))
+        return self._read_clusters("run_algorithm")
 
-                # now grab the core points themselves, saving as a numpy array
-                core_points = np.fromstring(self.read(8 * num_core_points),
-                                            dtype=np.int32,
-                                            count=2*num_core_points)
+    def cluster_grid(self, eps, min_pts, num_threads=1):
+        """
+        General DBSCAN over the significant pixels: a pixel's neighbourhood is
+        the eps x eps square around it (eps must be odd), and core pixels have
+        at least min_pts significant pixels in their neighbourhood. Returns
+        the clusters like cluster does.
+        """
+        self._send_instruction(server.Server.clusterGrid)
+        self.request(struct.pack('iii', eps, min_pts, num_threads))
+        return self._read_clusters("cluster_grid")
 
-                core_points = np.reshape(core_points, (num_core_points, 2))
+    def start_pipeline(self, equalize_length, brightness_variance, signal_size,
+                       sigma, engine=None, num_threads=1, eps=3, min_pts=4,
+                       depth=4):
+        """
+        Starts the C++ end's pipelined engine, which runs frames through the
+        same steps as run_algorithm (with the same arguments) but with load,
+        equalization + significance and clustering + serialization each on
+        their own thread, so up to depth frames are worked on at once.
+        Frames go in with submit_frame and come back, in the same order, from
+        collect_frame. Clusters come in the format set when this is called.
+        A socket server only runs a few pipelines at once, needs num_threads
+        to be at least 1 and may use fewer threads than asked for.
+        """
+        if engine is None:
+            engine = server.Server.unionFindEngine
 
-                # now grab the number of outer points from the C++ end
-                num_outer_points = struct.unpack('i', self.read(4))[0]
-                outer_points = np.fromstring(self.read(8 * num_outer_points),
-                                             dtype=np.int32,
-                                             count=2*num_outer_points)
+        self._send_instruction(server.Server.pipelineStart)
+        self.request(struct.pack('=iiidiiiii', equalize_length,
+                                 brightness_variance, signal_size, sigma,
+                                 engine, num_threads, eps, min_pts, depth))
 
-                outer_points = np.reshape(outer_points, (num_outer_points, 2))
+        response = self.read(4)
+        if response != server.Server.success:
+            print "(PYTHON): Error in start_pipeline"
+            print "Response:", struct.unpack('i', response)[0]
+            print "Instruction received, ", self.readline()
+            return False
+        return True
+
+    def submit_frame(self, array):
+        """
+        Queues a 2D uint8 array in the pipeline, returning its sequence number
+        or None if depth frames are already in flight (collect one first).
+        """
+        assert array.dtype == np.uint8, "Frames must have dtype uint8"
+        n_rows, n_cols = array.shape
 
-                # store these guys in a cluster, in clusters
-                clusters[i] = Cluster(core_points, outer_points)
+        self._send_instruction(server.Server.pipelineSubmit)
+        self.request(struct.pack('ii', n_rows, n_cols))
+        self.request(np.ascontiguousarray(array).tobytes())
 
-            return clusters
+        response = self.read(4)
+        if response != server.Server.success:
+            message = self.readline()
+            if not message.startswith("pipeline full"):
+                print "(PYTHON): Error in submit_frame"
+                print "Response:", struct.unpack('i', response)[0]
+                print "Instruction received, ", message
+            return None
+        return struct.unpack('q', self.read(8))[0]
+
+    def collect_frame(self):
+        """
+        Waits for the oldest frame in the pipeline and returns its sequence
+        number and clusters.
+        """
+        self._send_instruction(server.Server.pipelineCollect)
+
+        response = self.read(4)
+        if response != server.Server.success:
+            print "(PYTHON): Error in collect_frame"
+            print "Response:", struct.unpack('i', response)[0]
+            print "Instruction received, ", self.readline()
+            return None, None
+        sequence = struct.unpack('q', self.read(8))[0]
+        return sequence, self._read_cluster_body()
+
+    def stop_pipeline(self):
+        self._send_instruction(server.Server.pipelineStop)
+        if self.read(4) != server.Server.success:
+            print "(PYTHON): Error in stop_pipeline"
+            print self.readline()
+
+    def run_pipelined(self, frames):
+        """
+        Runs an iterable of frames through a started pipeline, yielding each
+        one's clusters in order. The pipeline is kept as full as it will go.
+        """
+        in_flight = 0
+        for frame in frames:
+            while self.submit_frame(frame) is None:
+                if in_flight == 0:
+                    return  # not full, so the pipeline isn't working
+                yield self.collect_frame()[1]
+                in_flight -= 1
+            in_flight += 1
+        for i in range(in_flight):
+            yield self.collect_frame()[1]
+
+    def set_cluster_format(self, cluster_format):
+        """
+        Chooses how the C++ end sends clusters: Server.pointsFormat (every
+        point, the default) or Server.spansFormat (a (row, begin, end) span
+        for each run of points on a row, which is much smaller for big
+        clusters). The clusters returned look the same either way.
+        Server.summaryFormat only sends each cluster's point counts, bounding
+        box, centroid and second moments; clustering then returns a numpy
+        array of cluster_summary_dtype records instead of Clusters.
+        Server.compactFormat sends the spans delta encoded as varints, which
+        is smaller again and returns the same Clusters.
+        """
+        self._send_instruction(server.Server.setClusterFormat)
+        self.request(struct.pack('i', cluster_format))
+
+        response = self.read(4)
+        if response != server.Server.success:
+            print "(PYTHON): Error in set_cluster_format"
+            print "Response:", struct.unpack('i', response)[0]
+            print "Instruction received, ", self.readline()
+        else:
+            self._cluster_format = cluster_format
+
+    def workspace_bytes(self):
+        """
+        Returns (current, peak) bytes held by the C++ end's clustering
+        workspace, which is reused from frame to frame.
+        """
+        self._send_instruction(server.Server.workspaceBytes)
+
+        response = self.read(4)
+        if response != server.Server.success:
+            print "(PYTHON): Error in workspace_bytes"
+            print "Response:", struct.unpack('i', response)[0]
+            print "Instruction received, ", self.readline()
+        else:
+            return struct.unpack('QQ', self.read(16))
+
+    def _read_clusters(self, name):
+        """
+        Reads the response to a clustering instruction, returning the clusters.
+        """
+        response = self.read(4)
+        if response != server.Server.success:
+            print "(PYTHON): Error in", name
+            print "Response:", struct.unpack('i', response)[0]
+            print "Instruction received, ", self.readline()
+            return
+        return self._read_cluster_body()
+
+    def _read_cluster_body(self):
+        """
+        Reads the clusters that follow a successful reply.
+        """
+        # the clusters either follow in the pipe, or are in shared memory
+        read = self.read
+        if self._results_offset is not None:
+            length = struct.unpack('q', self.read(8))[0]
+            if length < 0:
+                print "(PYTHON): clusters didn't fit in shared memory"
+                return
+            read = _SharedReader(self._shm, self._results_offset).read
+
+        # the number of bytes that follow the header, and the number of
+        # clusters. Then everything is read in one go and parsed from memory
+        num_bytes, num_clusters = struct.unpack('ii', read(8))
+        body = read(num_bytes)
+
+        if self._cluster_format == server.Server.summaryFormat:
+            return np.frombuffer(body, dtype=cluster_summary_dtype,
+                                 count=num_clusters)
+        elif self._cluster_format == server.Server.compactFormat:
+            return _parse_compact(body, num_clusters)
+        elif self._cluster_format == server.Server.spansFormat:
+            return _parse_counted(body, num_clusters, 3, Cluster.from_spans)
+        return _parse_counted(body, num_clusters, 2, Cluster)
+
+
+class LocalDetector(object):
+    """
+    The same detection as Detector, but run in this process by the rrec
+    extension module instead of by b.out over pipes. Images aren't copied
+    going in or out: main_image views the array it's set to rather than
+    copying it, and the images and clusters returned are views of the
+    extension's memory. The array main_image is set to is never changed,
+    equalizing leaves its result in a new array which main_image returns
+    from then on.
+    """
+
+    def __init__(self):
+        # only needed (and only built) if a LocalDetector's used
+        import rrec
+        self._detector = rrec.Detector()
+
+    @property
+    def main_image(self):
+        return self._detector.image_main
+
+    @main_image.setter
+    def main_image(self, value):
+        if type(value) == str:
+            self._detector.load_image(value)
+        elif type(value) == np.ndarray:
+            self._detector.set_image_main(value)
+        else:
+            raise TypeError(
+                "main_image must be set to a string or a numpy array")
+
+    @property
+    def clustered_image(self):
+        return self._detector.image_clustered
+
+    def equalize(self, length=51):
+        self._detector.adaptive_hist_eq(length)
+
+    def equalize_tiled(self, tile, num_threads=0):
+        self._detector.adaptive_hist_eq_tiled(tile, num_threads)
+
+    def detect_significance(self, brightness_variance, signal_size, sigma,
+                            keep_intermediates=False):
+        self._detector.detect_significance(brightness_variance, signal_size,
+                                           sigma, keep_intermediates)
+
+    def cluster(self, engine=server.Server.unionFindEngine, num_threads=1):
+        return _clusters_from_spans(*self._detector.cluster(engine,
+                                                            num_threads))
+
+    def cluster_grid(self, eps, min_pts, num_threads=1):
+        return _clusters_from_spans(*self._detector.cluster_grid(eps, min_pts,
+                                                                 num_threads))
+
+    def run_algorithm(self, equalize_length, brightness_variance, signal_size,
+                      sigma, engine=server.Server.unionFindEngine,
+                      num_threads=1, eps=3, min_pts=4):
+        return _clusters_from_spans(*self._detector.run_algorithm(
+            equalize_length, brightness_variance, signal_size, sigma, engine,
+            num_threads, eps, min_pts))
+
+    def summaries(self):
+        """
+        The last clusters' summaries, as an array of cluster_summary_dtype.
+        """
+        return self._detector.summaries().view(cluster_summary_dtype)[:, 0]
+
+    def workspace_bytes(self):
+        return self._detector.workspace_bytes()
 
 
 class Cluster(object):
@@ -124,5 +476,130 @@ class Cluster(object):
 
     def __init__(self, core_points, outer_points):
         # simply grab the core and outer points
-        self.core_points = core_points
-        self.outer_points = outer_points
+        self._core_points = core_points
+        self._outer_points = outer_points
+        self.core_spans = None
+        self.outer_spans = None
+
+    @classmethod
+    def from_spans(cls, core_spans, outer_spans):
+        """
+        Makes a cluster from (row, begin, end) spans, only expanding them to
+        points if core_points/outer_points are asked for.
+        """
+        cluster = cls(None, None)
+        cluster.core_spans = core_spans
+        cluster.outer_spans = outer_spans
+        return cluster
+
+    @property
+    def core_points(self):
+        if self._core_points is None:
+            self._core_points = _expand_spans(self.core_spans)
+        return self._core_points
+
+    @property
+    def outer_points(self):
+        if self._outer_points is None:
+            self._outer_points = _expand_spans(self.outer_spans)
+        return self._outer_points
+
+
+def _expand_spans(spans):
+    """
+    Turns an (N, 3) array of (row, begin, end) spans into an (M, 2) array of
+    (row, col) points.
+    """
+    lengths = spans[:, 2] - spans[:, 1]
+    rows = np.repeat(spans[:, 0], lengths)
+
+    # each point's column is its span's begin plus its position in the span
+    starts = np.cumsum(lengths) - lengths
+    cols = np.arange(lengths.sum(), dtype=np.int32) - \
+        np.repeat(starts - spans[:, 1], lengths)
+    return np.column_stack((rows, cols)).astype(np.int32)
+
+
+def _parse_counted(body, num_clusters, width, make_cluster):
+    """
+    Parses the points or spans formats: for each cluster an int32 count then
+    that many rows of width int32s, once for the core and once for the outer
+    points/spans. make_cluster is called with the two arrays.
+    """
+    values = np.frombuffer(body, dtype=np.int32).copy()
+    clusters = []
+    position = 0
+    for i in range(num_clusters):
+        parts = []
+        for j in range(2):
+            count = values[position]
+            position += 1
+            parts.append(np.reshape(values[position:position + width*count],
+                                    (count, width)))
+            position += width*count
+        clusters.append(make_cluster(parts[0], parts[1]))
+    return clusters
+
+
+def _decode_varints(body):
+    """
+    Decodes a string of LEB128 varints into an int64 array, all at once.
+    """
+    data = np.frombuffer(body, dtype=np.uint8)
+
+    # a varint ends on each byte without its top bit set
+    ends = np.flatnonzero(data < 0x80)
+    starts = np.concatenate(([0], ends[:-1] + 1))
+    if len(ends) == 0:
+        return np.zeros(0, dtype=np.int64)
+
+    # each byte holds 7 bits, shifted by 7 times its place in its varint
+    place = np.arange(len(data)) - np.repeat(starts, ends - starts + 1)
+    terms = (data & 0x7f).astype(np.int64) << (7 * place)
+    return np.add.reduceat(terms, starts)
+
+
+def _parse_compact(body, num_clusters):
+    """
+    Parses Server.compactFormat (see serialize.hpp) without a python loop
+    over the spans.
+    """
+    values = _decode_varints(body)
+    counts = values[:2*num_clusters]
+    deltas = np.reshape(values[2*num_clusters:], (-1, 3))
+
+    # undo the zigzag then the deltas
+    zigzag = deltas[:, :2]
+    absolute = np.cumsum((zigzag >> 1) ^ -(zigzag & 1), axis=0)
+    spans = np.empty((len(deltas), 3), dtype=np.int32)
+    spans[:, :2] = absolute
+    spans[:, 2] = absolute[:, 1] + deltas[:, 2]
+
+    return _clusters_from_spans(spans, counts)
+
+
+def _clusters_from_spans(spans, counts):
+    """
+    Splits every cluster's spans, one after another, into Clusters. counts
+    holds each cluster's core then outer span count.
+    """
+    counts = np.ravel(counts)
+    num_clusters = len(counts) // 2
+    parts = np.split(spans, np.cumsum(counts)[:-1]) if num_clusters else []
+    return [Cluster.from_spans(parts[2*i], parts[2*i + 1])
+            for i in range(num_clusters)]
+
+
+class _SharedReader(object):
+    """
+    Reads consecutive chunks out of the shared memory segment, like a pipe.
+    """
+
+    def __init__(self, shm, offset):
+        self.shm = shm
+        self.position = offset
+
+    def read(self, num_bytes):
+        data = self.shm[self.position:self.position + num_bytes]
+        self.position += num_bytes
+        return data
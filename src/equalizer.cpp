@@ -0,0 +1,298 @@
+#include "equalizer.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "parallel.hpp"
+
+namespace rrec
+{
+
+void reference_hist_eq(const cv::Mat &in, cv::Mat &out, int length)
+{
+    int rows = in.rows;
+    int cols = in.cols;
+    int half = length / 2;
+    out.create(rows, cols, CV_8UC1);
+
+    for (int i = 0; i < rows; ++i)
+    {
+        const unsigned char *in_pointer = in.ptr<unsigned char>(i);
+        unsigned char *out_pointer = out.ptr<unsigned char>(i);
+
+        int row_beg = std::max(i - half, 0);
+        int row_end = std::min(i + half, rows - 1);
+
+        // histogram of the window around (i, 0)
+        std::vector<int> intensities(256, 0);
+        for (int a = row_beg; a <= row_end; ++a)
+        {
+            const unsigned char *window_pointer = in.ptr<unsigned char>(a);
+            for (int b = 0; b <= std::min(half, cols - 1); ++b)
+                ++intensities[window_pointer[b]];
+        }
+
+        for (int j = 0; j < cols; ++j)
+        {
+            int col_beg = std::max(j - half, 0);
+            int col_end = std::min(j + half, cols - 1);
+
+            // slide the window one column to the right
+            if (j > 0)
+            {
+                for (int a = row_beg; a <= row_end; ++a)
+                {
+                    const unsigned char *window_pointer =
+                        in.ptr<unsigned char>(a);
+                    if (j - half - 1 >= 0)
+                        --intensities[window_pointer[j - half - 1]];
+                    if (j + half < cols)
+                        ++intensities[window_pointer[j + half]];
+                }
+            }
+
+            int num_pixels = (col_end - col_beg + 1) * (row_end - row_beg + 1);
+
+            // count the pixels which are darker than this one
+            int sum{0};
+            for (int v = 0; v < in_pointer[j]; ++v)
+                sum += intensities[v];
+
+            out_pointer[j] = (255 * sum) / num_pixels;
+        }
+    }
+}
+
+void sliding_hist_eq(const cv::Mat &in, cv::Mat &out, int length)
+{
+    int rows = in.rows;
+    int cols = in.cols;
+    int half = length / 2;
+    out.create(rows, cols, CV_8UC1);
+
+    // one fine (256 bin) and coarse (16 bin) histogram per column, covering
+    // the rows in the window of the row currently being equalized
+    std::vector<uint32_t> col_fine(static_cast<size_t>(cols) * 256, 0);
+    std::vector<uint32_t> col_coarse(static_cast<size_t>(cols) * 16, 0);
+
+    auto add_row = [&](int a, int delta) {
+        const unsigned char *p = in.ptr<unsigned char>(a);
+        for (int j = 0; j < cols; ++j)
+        {
+            col_fine[static_cast<size_t>(j) * 256 + p[j]] += delta;
+            col_coarse[static_cast<size_t>(j) * 16 + (p[j] >> 4)] += delta;
+        }
+    };
+
+    // prime the column histograms with the rows around row 0
+    for (int a = 0; a <= std::min(half - 1, rows - 1); ++a)
+        add_row(a, 1);
+
+    uint32_t fine[256];
+    uint32_t coarse[16];
+
+    for (int i = 0; i < rows; ++i)
+    {
+        // slide the column histograms down a row
+        if (i - half - 1 >= 0)
+            add_row(i - half - 1, -1);
+        if (i + half < rows)
+            add_row(i + half, 1);
+
+        int row_beg = std::max(i - half, 0);
+        int row_end = std::min(i + half, rows - 1);
+        int window_rows = row_end - row_beg + 1;
+
+        // window histogram around (i, 0)
+        std::fill(fine, fine + 256, 0);
+        std::fill(coarse, coarse + 16, 0);
+        for (int b = 0; b <= std::min(half, cols - 1); ++b)
+        {
+            const uint32_t *f = &col_fine[static_cast<size_t>(b) * 256];
+            const uint32_t *c = &col_coarse[static_cast<size_t>(b) * 16];
+            for (int v = 0; v < 256; ++v)
+                fine[v] += f[v];
+            for (int v = 0; v < 16; ++v)
+                coarse[v] += c[v];
+        }
+
+        const unsigned char *in_pointer = in.ptr<unsigned char>(i);
+        unsigned char *out_pointer = out.ptr<unsigned char>(i);
+
+        for (int j = 0; j < cols; ++j)
+        {
+            int col_beg = std::max(j - half, 0);
+            int col_end = std::min(j + half, cols - 1);
+
+            // slide the window one column to the right. Adding and removing
+            // whole column histograms is 2*256 (vectorised) additions no
+            // matter how large the window is
+            if (j > 0)
+            {
+                bool leaving = j - half - 1 >= 0;
+                bool entering = j + half < cols;
+                const uint32_t *fl = &col_fine[static_cast<size_t>(
+                                                   std::max(j - half - 1, 0)) *
+                                               256];
+                const uint32_t *fe = &col_fine[static_cast<size_t>(
+                                                   std::min(j + half, cols - 1)) *
+                                               256];
+                const uint32_t *cl = &col_coarse[static_cast<size_t>(
+                                                     std::max(j - half - 1, 0)) *
+                                                 16];
+                const uint32_t *ce = &col_coarse[static_cast<size_t>(
+                                                     std::min(j + half, cols - 1)) *
+                                                 16];
+                if (leaving && entering)
+                {
+                    for (int v = 0; v < 256; ++v)
+                        fine[v] += fe[v] - fl[v];
+                    for (int v = 0; v < 16; ++v)
+                        coarse[v] += ce[v] - cl[v];
+                }
+                else if (leaving)
+                {
+                    for (int v = 0; v < 256; ++v)
+                        fine[v] -= fl[v];
+                    for (int v = 0; v < 16; ++v)
+                        coarse[v] -= cl[v];
+                }
+                else if (entering)
+                {
+                    for (int v = 0; v < 256; ++v)
+                        fine[v] += fe[v];
+                    for (int v = 0; v < 16; ++v)
+                        coarse[v] += ce[v];
+                }
+            }
+
+            int num_pixels = (col_end - col_beg + 1) * window_rows;
+
+            // number of darker pixels: whole coarse bins below this pixel's
+            // bin, then the fine bins inside its coarse bin
+            unsigned char value = in_pointer[j];
+            int bin = value >> 4;
+            uint32_t sum{0};
+            for (int v = 0; v < bin; ++v)
+                sum += coarse[v];
+            for (int v = bin << 4; v < value; ++v)
+                sum += fine[v];
+
+            out_pointer[j] = (255 * static_cast<int>(sum)) / num_pixels;
+        }
+    }
+}
+
+void tiled_hist_eq(const cv::Mat &in, cv::Mat &out, int tile, int num_threads)
+{
+    int rows = in.rows;
+    int cols = in.cols;
+    out.create(rows, cols, CV_8UC1);
+    if (rows == 0 || cols == 0)
+        return;
+
+    tile = std::max(tile, 1);
+    int tiles_y = (rows + tile - 1) / tile;
+    int tiles_x = (cols + tile - 1) / tile;
+
+    // mapping for every tile, 256 entries each
+    std::vector<float> luts(static_cast<size_t>(tiles_y) * tiles_x * 256);
+
+    parallel_for(tiles_y * tiles_x, num_threads, [&](int begin, int end) {
+        for (int t = begin; t < end; ++t)
+        {
+            int ty = t / tiles_x;
+            int tx = t % tiles_x;
+            int row_beg = ty * tile;
+            int row_end = std::min(row_beg + tile, rows);
+            int col_beg = tx * tile;
+            int col_end = std::min(col_beg + tile, cols);
+
+            int hist[256] = {0};
+            for (int a = row_beg; a < row_end; ++a)
+            {
+                const unsigned char *p = in.ptr<unsigned char>(a);
+                for (int b = col_beg; b < col_end; ++b)
+                    ++hist[p[b]];
+            }
+
+            // same mapping as the exact versions: 255 * (# darker) / #
+            float *lut = &luts[static_cast<size_t>(t) * 256];
+            float scale = 255.0f / ((row_end - row_beg) * (col_end - col_beg));
+            int darker = 0;
+            for (int v = 0; v < 256; ++v)
+            {
+                lut[v] = darker * scale;
+                darker += hist[v];
+            }
+        }
+    });
+
+    // work out, once per column, which two tiles a pixel sits between and how
+    // far along it is. Tile centres are at (t + 0.5) * tile, and pixels outside
+    // the outermost centres just use the outermost tile
+    std::vector<int> x0(cols), x1(cols);
+    std::vector<float> wx(cols);
+    for (int j = 0; j < cols; ++j)
+    {
+        float f = (j + 0.5f) / tile - 0.5f;
+        int t = static_cast<int>(std::floor(f));
+        float w = f - t;
+        if (t < 0)
+        {
+            t = 0;
+            w = 0;
+        }
+        if (t >= tiles_x - 1)
+        {
+            t = tiles_x - 1;
+            w = 0;
+        }
+        x0[j] = t;
+        x1[j] = std::min(t + 1, tiles_x - 1);
+        wx[j] = w;
+    }
+
+    parallel_for(rows, num_threads, [&](int begin, int end) {
+        for (int i = begin; i < end; ++i)
+        {
+            float f = (i + 0.5f) / tile - 0.5f;
+            int y0 = static_cast<int>(std::floor(f));
+            float wy = f - y0;
+            if (y0 < 0)
+            {
+                y0 = 0;
+                wy = 0;
+            }
+            if (y0 >= tiles_y - 1)
+            {
+                y0 = tiles_y - 1;
+                wy = 0;
+            }
+            int y1 = std::min(y0 + 1, tiles_y - 1);
+
+            const float *top = &luts[static_cast<size_t>(y0) * tiles_x * 256];
+            const float *bottom = &luts[static_cast<size_t>(y1) * tiles_x * 256];
+            const unsigned char *in_pointer = in.ptr<unsigned char>(i);
+            unsigned char *out_pointer = out.ptr<unsigned char>(i);
+
+            for (int j = 0; j < cols; ++j)
+            {
+                int v = in_pointer[j];
+                float tl = top[x0[j] * 256 + v];
+                float tr = top[x1[j] * 256 + v];
+                float bl = bottom[x0[j] * 256 + v];
+                float br = bottom[x1[j] * 256 + v];
+
+                float upper = tl + wx[j] * (tr - tl);
+                float lower = bl + wx[j] * (br - bl);
+                out_pointer[j] = static_cast<unsigned char>(
+                    upper + wy * (lower - upper) + 0.5f);
+            }
+        }
+    });
+}
+
+} // namespace rrec
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+namespace rrec
+{
+// Adaptive histogram equalization of a CV_8UC1 image. Every output pixel is
+// 255 * (# of pixels in the length*length window centred on it that are
+// darker than it) / (# of pixels in the window), where windows are clipped at
+// the edges of the image.
+
+// straightforward implementation which rebuilds the window's histogram row by
+// row, its cost per pixel grows linearly with length. Kept as a reference
+void reference_hist_eq(const cv::Mat &in, cv::Mat &out, int length);
+
+// Perreault/Hebert style implementation: one histogram per column is kept for
+// the rows currently in the window and slid down the image, and the window
+// histogram is updated by adding/removing whole column histograms as it moves
+// across a row. A 16 bin coarse histogram sits on top of the 256 bin one so
+// that the number of darker pixels is found in at most 32 additions. Nothing
+// here depends on length, so the cost per pixel is constant
+void sliding_hist_eq(const cv::Mat &in, cv::Mat &out, int length);
+
+// CLAHE-style approximation (without the contrast limiting): the image is cut
+// into tile*tile tiles, each tile gets its own mapping from intensity to
+// equalized intensity, and every pixel is bilinearly interpolated between the
+// mappings of the four tiles whose centres surround it. Tiles are built and
+// pixels are mapped on num_threads threads (< 1 means one per core). Much
+// cheaper than the exact versions, at the cost of exactness
+void tiled_hist_eq(const cv::Mat &in, cv::Mat &out, int tile, int num_threads);
+} // namespace rrec
@@ -0,0 +1,204 @@
+#include "gaussian.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include "parallel.hpp"
+
+namespace rrec
+{
+
+double gaussian_sigma(int ksize)
+{
+    return 0.3 * ((ksize - 1) * 0.5 - 1) + 0.8;
+}
+
+std::vector<float> gaussian_kernel(int ksize)
+{
+    // OpenCV doesn't sample the gaussian for small kernels, it uses these
+    static const float small_kernels[4][7] = {
+        {1.f},
+        {0.25f, 0.5f, 0.25f},
+        {0.0625f, 0.25f, 0.375f, 0.25f, 0.0625f},
+        {0.03125f, 0.109375f, 0.21875f, 0.28125f, 0.21875f, 0.109375f,
+         0.03125f}};
+
+    std::vector<float> kernel(ksize);
+    if (ksize % 2 == 1 && ksize <= 7)
+    {
+        for (int i = 0; i < ksize; ++i)
+            kernel[i] = small_kernels[ksize / 2][i];
+        return kernel;
+    }
+
+    double sigma = gaussian_sigma(ksize);
+    double scale = -0.5 / (sigma * sigma);
+    double sum = 0;
+    std::vector<double> weights(ksize);
+    for (int i = 0; i < ksize; ++i)
+    {
+        double x = i - (ksize - 1) * 0.5;
+        weights[i] = std::exp(scale * x * x);
+        sum += weights[i];
+    }
+    for (int i = 0; i < ksize; ++i)
+        kernel[i] = static_cast<float>(weights[i] / sum);
+    return kernel;
+}
+
+namespace
+{
+// filter coefficients from Young & van Vliet (1995), scaled so that
+// y[n] = B x[n] + b1 y[n-1] + b2 y[n-2] + b3 y[n-3]
+struct RecursiveCoefficients
+{
+    float B, b1, b2, b3;
+
+    explicit RecursiveCoefficients(double sigma)
+    {
+        double q;
+        if (sigma >= 2.5)
+            q = 0.98711 * sigma - 0.96330;
+        else
+            q = 3.97156 - 4.14554 * std::sqrt(1 - 0.26891 * std::max(sigma, 0.5));
+
+        double q2 = q * q;
+        double q3 = q2 * q;
+        double c0 = 1.57825 + 2.44413 * q + 1.4281 * q2 + 0.422205 * q3;
+        double c1 = 2.44413 * q + 2.85619 * q2 + 1.26661 * q3;
+        double c2 = -(1.4281 * q2 + 1.26661 * q3);
+        double c3 = 0.422205 * q3;
+
+        b1 = static_cast<float>(c1 / c0);
+        b2 = static_cast<float>(c2 / c0);
+        b3 = static_cast<float>(c3 / c0);
+        B = static_cast<float>(1 - (c1 + c2 + c3) / c0);
+    }
+};
+
+// blurs one padded line of n floats in place (forwards, then backwards). The
+// filter starts from steady state on the first/last value, which the padding
+// makes a reasonable guess
+void recursive_line(float *line, int n, const RecursiveCoefficients &c)
+{
+    float w1 = line[0], w2 = line[0], w3 = line[0];
+    for (int i = 0; i < n; ++i)
+    {
+        float w = c.B * line[i] + c.b1 * w1 + c.b2 * w2 + c.b3 * w3;
+        w3 = w2;
+        w2 = w1;
+        w1 = w;
+        line[i] = w;
+    }
+
+    w1 = w2 = w3 = line[n - 1];
+    for (int i = n - 1; i >= 0; --i)
+    {
+        float w = c.B * line[i] + c.b1 * w1 + c.b2 * w2 + c.b3 * w3;
+        w3 = w2;
+        w2 = w1;
+        w1 = w;
+        line[i] = w;
+    }
+}
+} // namespace
+
+void recursive_gaussian_blur(const cv::Mat &in, cv::Mat &out, double sigma,
+                             int num_threads)
+{
+    int rows = in.rows;
+    int cols = in.cols;
+    out.create(rows, cols, CV_8UC1);
+    if (rows == 0 || cols == 0)
+        return;
+
+    RecursiveCoefficients c(sigma);
+
+    // the filter's impulse response has died off after ~4 sigma
+    int pad = static_cast<int>(std::ceil(4 * sigma)) + 3;
+
+    // horizontal pass, each row is padded into its own scratch line
+    std::vector<float> horizontal(static_cast<size_t>(rows) * cols);
+    parallel_for(rows, num_threads, [&](int begin, int end) {
+        std::vector<float> line(cols + 2 * pad);
+        for (int i = begin; i < end; ++i)
+        {
+            const unsigned char *p = in.ptr<unsigned char>(i);
+            for (int j = -pad; j < cols + pad; ++j)
+                line[j + pad] = p[reflect101(j, cols)];
+
+            recursive_line(line.data(), cols + 2 * pad, c);
+
+            std::copy(line.begin() + pad, line.begin() + pad + cols,
+                      horizontal.begin() + static_cast<size_t>(i) * cols);
+        }
+    });
+
+    // vertical pass. Running the recursion down whole rows at a time (rather
+    // than down one column) keeps memory access sequential and vectorisable,
+    // so each thread takes a band of columns and walks all the padded rows
+    int padded_rows = rows + 2 * pad;
+    parallel_for(cols, num_threads, [&](int begin, int end) {
+        int width = end - begin;
+        if (width <= 0)
+            return;
+        std::vector<float> lines(static_cast<size_t>(padded_rows) * width);
+        auto line = [&](int a) { return &lines[static_cast<size_t>(a) * width]; };
+
+        for (int a = 0; a < padded_rows; ++a)
+        {
+            const float *src = &horizontal[static_cast<size_t>(
+                                               reflect101(a - pad, rows)) *
+                                               cols +
+                                           begin];
+            std::copy(src, src + width, line(a));
+        }
+
+        // forwards
+        std::vector<float> w1(line(0), line(0) + width);
+        std::vector<float> w2(w1), w3(w1);
+        for (int a = 0; a < padded_rows; ++a)
+        {
+            float *x = line(a);
+            for (int j = 0; j < width; ++j)
+            {
+                float w = c.B * x[j] + c.b1 * w1[j] + c.b2 * w2[j] + c.b3 * w3[j];
+                w3[j] = w2[j];
+                w2[j] = w1[j];
+                w1[j] = w;
+                x[j] = w;
+            }
+        }
+
+        // backwards, writing out the rows that aren't padding
+        std::copy(line(padded_rows - 1), line(padded_rows - 1) + width,
+                  w1.begin());
+        w2 = w1;
+        w3 = w1;
+        for (int a = padded_rows - 1; a >= 0; --a)
+        {
+            float *x = line(a);
+            for (int j = 0; j < width; ++j)
+            {
+                float w = c.B * x[j] + c.b1 * w1[j] + c.b2 * w2[j] + c.b3 * w3[j];
+                w3[j] = w2[j];
+                w2[j] = w1[j];
+                w1[j] = w;
+                x[j] = w;
+            }
+
+            int i = a - pad;
+            if (i >= 0 && i < rows)
+            {
+                unsigned char *o = out.ptr<unsigned char>(i) + begin;
+                for (int j = 0; j < width; ++j)
+                {
+                    float v = x[j] + 0.5f;
+                    o[j] = v >= 255.0f ? 255 : (v > 0.0f ? static_cast<unsigned char>(v) : 0);
+                }
+            }
+        }
+    });
+}
+
+} // namespace rrec
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+namespace rrec
+{
+// the sigma cv::GaussianBlur picks for an odd ksize when sigma is left at 0
+double gaussian_sigma(int ksize);
+
+// the normalised 1D kernel cv::GaussianBlur uses for an odd ksize when sigma
+// is left at 0 (including OpenCV's fixed tables for ksize <= 7)
+std::vector<float> gaussian_kernel(int ksize);
+
+// which implementation to blur with
+enum class blur_engine
+{
+    opencv,   // cv::GaussianBlur, exact but the cost per pixel grows with ksize
+    recursive // recursive_gaussian_blur, constant cost per pixel
+};
+
+// Young & van Vliet's recursive (IIR) approximation of a gaussian blur of a
+// CV_8UC1 image: a third order filter is run forwards and then backwards along
+// every row and then every column, so the cost per pixel doesn't depend on
+// sigma. Lines are padded by reflection (like cv::BORDER_REFLECT_101) before
+// filtering. Rows, then column bands, are split over num_threads threads
+void recursive_gaussian_blur(const cv::Mat &in, cv::Mat &out, double sigma,
+                             int num_threads);
+
+// index of p in a row of length n under cv::BORDER_REFLECT_101 (gfedcb|abcdefgh|gfedcba)
+inline int reflect101(int p, int n)
+{
+    if (n == 1)
+        return 0;
+    while (p < 0 || p >= n)
+    {
+        if (p < 0)
+            p = -p;
+        if (p >= n)
+            p = 2 * n - 2 - p;
+    }
+    return p;
+}
+} // namespace rrec
@@ -0,0 +1,198 @@
+#include "labelling.hpp"
+
+#include <algorithm>
+#include <cstdint>
+
+#include "parallel.hpp"
+
+namespace rrec
+{
+
+int find_root(std::vector<int> &parent, int x)
+{
+    // path halving
+    while (parent[x] != x)
+    {
+        parent[x] = parent[parent[x]];
+        x = parent[x];
+    }
+    return x;
+}
+
+void unite(std::vector<int> &parent, int a, int b)
+{
+    a = find_root(parent, a);
+    b = find_root(parent, b);
+    if (a < b)
+        parent[b] = a;
+    else if (b < a)
+        parent[a] = b;
+}
+
+namespace
+{
+// unions the runs [a, a_end) on one row with the runs [b, b_end) on the row
+// below wherever they overlap (4-connected means sharing a column)
+void join_rows(const std::vector<Run> &runs, std::vector<int> &parent, int a,
+               int a_end, int b, int b_end)
+{
+    while (a < a_end && b < b_end)
+    {
+        if (runs[a].begin < runs[b].end && runs[b].begin < runs[a].end)
+            unite(parent, a, b);
+
+        // step past whichever run finishes first
+        if (runs[a].end < runs[b].end)
+            ++a;
+        else
+            ++b;
+    }
+}
+
+// pulls the runs out of rows [begin, end) of mask, appending them to runs and
+// giving each a provisional label (its index) in parent, and unions runs with
+// the overlapping runs on the row above within the same range of rows
+void label_band(const PackedMask &mask, int begin, int end,
+                std::vector<Run> &runs, std::vector<int> &row_start,
+                std::vector<int> &parent)
+{
+    int words = mask.words_per_row();
+
+    for (int i = begin; i < end; ++i)
+    {
+        int row_begin = static_cast<int>(runs.size());
+        row_start[i] = row_begin;
+
+        const uint64_t *r = mask.row(i);
+        for (int k = 0; k < words; ++k)
+        {
+            uint64_t w = r[k];
+            while (w)
+            {
+                int start = __builtin_ctzll(w);
+                uint64_t rest = ~w >> start;
+                int length = rest ? __builtin_ctzll(rest) : 64 - start;
+
+                int run_begin = 64 * k + start;
+                int run_end = run_begin + length;
+
+                // runs carry on across word boundaries
+                if (static_cast<int>(runs.size()) > row_begin &&
+                    runs.back().end == run_begin)
+                {
+                    runs.back().end = run_end;
+                }
+                else
+                {
+                    int index = static_cast<int>(runs.size());
+                    runs.push_back(Run{i, run_begin, run_end, index});
+                    parent.push_back(index);
+                }
+
+                uint64_t bits = length == 64 ? ~static_cast<uint64_t>(0)
+                                             : (static_cast<uint64_t>(1) << length) - 1;
+                w &= ~(bits << start);
+            }
+        }
+
+        if (i > begin)
+            join_rows(runs, parent, row_start[i - 1], row_begin, row_begin,
+                      static_cast<int>(runs.size()));
+    }
+}
+} // namespace
+
+void label_components(const PackedMask &mask, Labelling &labelling)
+{
+    label_components(mask, labelling, 1);
+}
+
+void label_components(const PackedMask &mask, Labelling &labelling,
+                      int num_threads)
+{
+    int rows = mask.rows();
+    std::vector<Run> &runs = labelling.runs;
+    runs.clear();
+    labelling.row_start.assign(rows + 1, 0);
+
+    // provisional labels are run indices
+    std::vector<int> &parent = labelling.parent;
+    parent.clear();
+
+    int num_bands = std::min(resolve_threads(num_threads), std::max(rows, 1));
+    if (num_bands <= 1)
+    {
+        label_band(mask, 0, rows, runs, labelling.row_start, parent);
+    }
+    else
+    {
+        // label each band of rows on its own, with its own run indices
+        std::vector<std::vector<Run>> band_runs(num_bands);
+        std::vector<std::vector<int>> band_parent(num_bands);
+        std::vector<int> band_first_row(num_bands + 1);
+        for (int b = 0; b <= num_bands; ++b)
+            band_first_row[b] = static_cast<int>(static_cast<long long>(rows) * b /
+                                                 num_bands);
+
+        parallel_for(num_bands, num_bands, [&](int begin, int end) {
+            for (int b = begin; b < end; ++b)
+                label_band(mask, band_first_row[b], band_first_row[b + 1],
+                           band_runs[b], labelling.row_start, band_parent[b]);
+        });
+
+        // stitch the bands together in order, shifting their run indices, so
+        // the result is exactly what a single band would have produced
+        for (int b = 0; b < num_bands; ++b)
+        {
+            int offset = static_cast<int>(runs.size());
+            for (int i = band_first_row[b]; i < band_first_row[b + 1]; ++i)
+                labelling.row_start[i] += offset;
+            for (int p : band_parent[b])
+                parent.push_back(p + offset);
+            runs.insert(runs.end(), band_runs[b].begin(), band_runs[b].end());
+        }
+
+        // and merge components across the seams between bands
+        for (int b = 1; b < num_bands; ++b)
+        {
+            int seam = band_first_row[b];
+            int above_end = labelling.row_start[seam];
+            int below_end = seam + 1 < rows ? labelling.row_start[seam + 1]
+                                            : static_cast<int>(runs.size());
+            join_rows(runs, parent, labelling.row_start[seam - 1], above_end,
+                      above_end, below_end);
+        }
+    }
+    labelling.row_start[rows] = static_cast<int>(runs.size());
+
+    // hand out component numbers in order of their root (first) run. Roots
+    // are always a component's first run, so this doesn't depend on how the
+    // rows were split up
+    labelling.num_components = 0;
+    labelling.first_run.clear();
+    for (int r = 0; r < static_cast<int>(runs.size()); ++r)
+    {
+        int root = find_root(parent, r);
+        if (root == r)
+        {
+            runs[r].label = labelling.num_components++;
+            labelling.first_run.push_back(r);
+        }
+        else
+        {
+            runs[r].label = runs[root].label;
+        }
+    }
+}
+
+void fill_row_labels(const Labelling &labelling, int i, int cols, int *labels)
+{
+    std::fill(labels, labels + cols, -1);
+    for (int r = labelling.row_start[i]; r < labelling.row_start[i + 1]; ++r)
+    {
+        const Run &run = labelling.runs[r];
+        std::fill(labels + run.begin, labels + run.end, run.label);
+    }
+}
+
+} // namespace rrec
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <vector>
+
+#include "bitmask.hpp"
+
+namespace rrec
+{
+// a horizontal run of set pixels [begin, end) on one row
+struct Run
+{
+    int row;
+    int begin;
+    int end;
+    int label; // index of the connected component the run belongs to
+};
+
+// the 4-connected components of a mask, stored as runs
+struct Labelling
+{
+    // every run in the mask in raster order
+    std::vector<Run> runs;
+
+    // runs on row i are runs[row_start[i]] .. runs[row_start[i + 1] - 1]
+    std::vector<int> row_start;
+
+    // components are numbered 0 .. num_components - 1 in the raster order of
+    // their first pixel, whose run is the component's first run
+    int num_components;
+    std::vector<int> first_run;
+
+    // the union-find forest over the runs, kept here so labelling frame
+    // after frame doesn't reallocate it
+    std::vector<int> parent;
+};
+
+// union-find over a forest stored as parent indices (roots are their own
+// parent). find_root halves paths as it goes
+int find_root(std::vector<int> &parent, int x);
+
+// links the trees of a and b, always under the smaller root so that the root
+// of a tree is its smallest member (for runs: a component's first run in
+// raster order)
+void unite(std::vector<int> &parent, int a, int b);
+
+// Labels the 4-connected components of mask. Runs are pulled out of the
+// packed rows a word at a time (with count-trailing-zeros), each run is
+// unioned with the runs it overlaps on the row above, and a final pass over
+// the union-find forest hands out component numbers
+void label_components(const PackedMask &mask, Labelling &labelling);
+
+// as above, with the rows split into num_threads bands (< 1 means one per
+// core) which are labelled concurrently and then merged along their seams.
+// The result is identical whatever the number of threads
+void label_components(const PackedMask &mask, Labelling &labelling,
+                      int num_threads);
+
+// writes the component label of every pixel on row i into labels (-1 for
+// pixels which aren't in a run)
+void fill_row_labels(const Labelling &labelling, int i, int cols, int *labels);
+} // namespace rrec
@@ -1,16 +1,33 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <cstdlib>
 
 #include "server.hpp"
+#include "socket_server.hpp"
+#include "stats.hpp"
 
-int main()
+int main(int argc, char **argv)
 {
     // const int rows{1296};
     // const int cols{1728};
 
+    // RREC_STATS turns on the per-stage timers, see stats.hpp
+    rrec::global_stats().from_environment();
+
+    // b.out --socket PATH [WORKERS [SESSION_MB]] serves any number of clients
+    // on a unix socket, otherwise we talk to the python process that ran us
+    if (argc >= 3 && std::string(argv[1]) == "--socket")
+    {
+        int workers = argc >= 4 ? std::atoi(argv[3]) : 0;
+        std::size_t session_mb = argc >= 5 ? std::atol(argv[4]) : 0;
+
+        rrec::SocketServer socket_server{argv[2], workers, session_mb << 20};
+        return socket_server.run() ? 0 : 1;
+    }
+
     rrec::Server main_server{};
     main_server.listen_to_python(1);
 
     return 0;
-}
\ No newline at end of file
+}
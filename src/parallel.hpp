@@ -0,0 +1,45 @@
+#pragma once
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+namespace rrec
+{
+// number of threads to use when the caller asked for num_threads, where
+// anything < 1 means "one per core"
+inline int resolve_threads(int num_threads)
+{
+    if (num_threads > 0)
+        return num_threads;
+    int cores = static_cast<int>(std::thread::hardware_concurrency());
+    return cores > 0 ? cores : 1;
+}
+
+// calls fn(begin, end) on num_threads threads, splitting [0, n) into
+// contiguous chunks of (nearly) equal size. The calling thread does the first
+// chunk itself, so num_threads == 1 never spawns anything
+template <typename F>
+void parallel_for(int n, int num_threads, F fn)
+{
+    num_threads = std::min(resolve_threads(num_threads), std::max(n, 1));
+    if (num_threads <= 1)
+    {
+        fn(0, n);
+        return;
+    }
+
+    std::vector<std::thread> workers;
+    workers.reserve(num_threads - 1);
+    for (int t = 1; t < num_threads; ++t)
+    {
+        int begin = static_cast<int>(static_cast<long long>(n) * t / num_threads);
+        int end = static_cast<int>(static_cast<long long>(n) * (t + 1) / num_threads);
+        workers.emplace_back([=] { fn(begin, end); });
+    }
+    fn(0, static_cast<int>(static_cast<long long>(n) / num_threads));
+
+    for (auto &worker : workers)
+        worker.join();
+}
+} // namespace rrec
@@ -0,0 +1,191 @@
+#include "pic.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace rrec
+{
+
+void pic_to_gray(const float *in, unsigned char *out, std::size_t n,
+                 float cutoff)
+{
+    const float scale = 255.0f / cutoff;
+    std::size_t i = 0;
+
+#if defined(__AVX2__)
+    const __m256 vscale = _mm256_set1_ps(scale);
+    const __m256 v255 = _mm256_set1_ps(255.0f);
+    // 32 pixels per iteration: four float vectors get scaled, clamped from
+    // above (anything over cutoff ends up >= 255), rounded to the nearest int
+    // and then packed with unsigned saturation, which also clamps below at 0
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i a = _mm256_cvtps_epi32(
+            _mm256_min_ps(v255, _mm256_mul_ps(_mm256_loadu_ps(in + i), vscale)));
+        __m256i b = _mm256_cvtps_epi32(
+            _mm256_min_ps(v255, _mm256_mul_ps(_mm256_loadu_ps(in + i + 8), vscale)));
+        __m256i c = _mm256_cvtps_epi32(
+            _mm256_min_ps(v255, _mm256_mul_ps(_mm256_loadu_ps(in + i + 16), vscale)));
+        __m256i d = _mm256_cvtps_epi32(
+            _mm256_min_ps(v255, _mm256_mul_ps(_mm256_loadu_ps(in + i + 24), vscale)));
+
+        // the avx2 packs work within 128 bit lanes, so fix the order up after
+        __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(a, b),
+                                             _mm256_packs_epi32(c, d));
+        packed = _mm256_permutevar8x32_epi32(
+            packed, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), packed);
+    }
+#elif defined(__SSE2__)
+    const __m128 vscale = _mm_set1_ps(scale);
+    const __m128 v255 = _mm_set1_ps(255.0f);
+    // same as the avx2 kernel above, 16 pixels at a time
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i a = _mm_cvtps_epi32(
+            _mm_min_ps(v255, _mm_mul_ps(_mm_loadu_ps(in + i), vscale)));
+        __m128i b = _mm_cvtps_epi32(
+            _mm_min_ps(v255, _mm_mul_ps(_mm_loadu_ps(in + i + 4), vscale)));
+        __m128i c = _mm_cvtps_epi32(
+            _mm_min_ps(v255, _mm_mul_ps(_mm_loadu_ps(in + i + 8), vscale)));
+        __m128i d = _mm_cvtps_epi32(
+            _mm_min_ps(v255, _mm_mul_ps(_mm_loadu_ps(in + i + 12), vscale)));
+
+        __m128i packed = _mm_packus_epi16(_mm_packs_epi32(a, b),
+                                          _mm_packs_epi32(c, d));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), packed);
+    }
+#endif
+
+    // whatever is left over (or everything, without SSE)
+    for (; i < n; ++i)
+    {
+        float f = in[i] * scale;
+
+        // written so that NaNs drop through to 0, like cv::saturate_cast
+        if (f >= 255.0f)
+            out[i] = 255;
+        else if (f > 0.0f)
+            out[i] = static_cast<unsigned char>(std::lrint(f));
+        else
+            out[i] = 0;
+    }
+}
+
+bool read_pic(const std::string &path, float cutoff, int rows, int cols,
+              cv::Mat &out)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    const std::size_t num_pixels = static_cast<std::size_t>(rows) * cols;
+    const std::size_t needed = pic_header_bytes + num_pixels * sizeof(float);
+    const std::size_t file_size = static_cast<std::size_t>(info.st_size);
+
+    out.create(rows, cols, CV_8UC1);
+
+    // fast path: map the whole file (mmap offsets have to be page aligned, so
+    // the header is skipped in place rather than by offsetting the mapping)
+    // and convert straight out of the page cache into out
+    void *mapping = MAP_FAILED;
+    if (S_ISREG(info.st_mode) && file_size >= needed)
+        mapping = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (mapping != MAP_FAILED)
+    {
+        const unsigned char *base = static_cast<const unsigned char *>(mapping);
+        const float *F = reinterpret_cast<const float *>(base +
+                                                         pic_header_bytes);
+
+        if (reinterpret_cast<std::uintptr_t>(F) % alignof(float) == 0)
+        {
+            madvise(mapping, file_size, MADV_SEQUENTIAL);
+
+            if (out.isContinuous())
+            {
+                pic_to_gray(F, out.data, num_pixels, cutoff);
+            }
+            else
+            {
+                for (int i = 0; i < rows; ++i)
+                    pic_to_gray(F + static_cast<std::size_t>(i) * cols,
+                                out.ptr<unsigned char>(i), cols, cutoff);
+            }
+
+            munmap(mapping, file_size);
+            close(fd);
+            return true;
+        }
+        munmap(mapping, file_size);
+    }
+
+    // fallback: pipes, special files and truncated .pics end up here. Read
+    // whatever pixel data there is in one call and treat the rest as 0
+    std::vector<float> F(num_pixels, 0.0f);
+    std::size_t want = num_pixels * sizeof(float);
+    std::size_t got = 0;
+    char *dest = reinterpret_cast<char *>(F.data());
+
+    // skip the header (lseek won't work on a pipe, so just read through it)
+    std::vector<char> header(pic_header_bytes);
+    std::size_t skipped = 0;
+    while (skipped < pic_header_bytes)
+    {
+        ssize_t n = read(fd, header.data() + skipped,
+                         pic_header_bytes - skipped);
+        if (n <= 0)
+            break;
+        skipped += n;
+    }
+    while (skipped == pic_header_bytes && got < want)
+    {
+        ssize_t n = read(fd, dest + got, want - got);
+        if (n <= 0)
+            break;
+        got += n;
+    }
+    close(fd);
+
+    for (int i = 0; i < rows; ++i)
+        pic_to_gray(F.data() + static_cast<std::size_t>(i) * cols,
+                    out.ptr<unsigned char>(i), cols, cutoff);
+
+    return true;
+}
+
+bool write_pic(const std::string &path, const float *pixels, int rows,
+               int cols)
+{
+    FILE *file = std::fopen(path.c_str(), "wb");
+    if (!file)
+        return false;
+
+    const std::size_t num_pixels = static_cast<std::size_t>(rows) * cols;
+    std::vector<char> header(pic_header_bytes, 0);
+    bool ok = std::fwrite(header.data(), 1, header.size(), file) == header.size() &&
+              std::fwrite(pixels, sizeof(float), num_pixels, file) == num_pixels;
+    return std::fclose(file) == 0 && ok;
+}
+
+} // namespace rrec
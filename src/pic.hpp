@@ -0,0 +1,28 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <cstddef>
+#include <string>
+
+namespace rrec
+{
+// every .pic file starts with a header of this many bytes, the rest of the
+// file is rows*cols 4 byte floats stored row by row
+const std::size_t pic_header_bytes = 624;
+
+// converts n raw .pic floats to 8bit pixels in a single pass: values above
+// cutoff saturate at 255, everything else is scaled by 255/cutoff and rounded
+void pic_to_gray(const float *in, unsigned char *out, std::size_t n,
+                 float cutoff);
+
+// reads the .pic at path straight into out (resized to a CV_8UC1 rows*cols
+// image). The file is memory mapped where possible, otherwise it is read in
+// one go into a temporary buffer. Returns false if the file can't be opened
+bool read_pic(const std::string &path, float cutoff, int rows, int cols,
+              cv::Mat &out);
+
+// writes rows*cols floats as a .pic that read_pic can load, with an all zero
+// header. Returns false if the file can't be written
+bool write_pic(const std::string &path, const float *pixels, int rows,
+               int cols);
+} // namespace rrec
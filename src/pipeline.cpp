@@ -0,0 +1,232 @@
+#include "pipeline.hpp"
+
+#include <cstring>
+#include <exception>
+#include <utility>
+
+#include "dbscan.hpp"
+#include "equalizer.hpp"
+#include "pic.hpp"
+#include "significance.hpp"
+#include "stats.hpp"
+
+namespace rrec
+{
+// the queues between stages only hold a couple of frames, so a stage can't
+// get more than that far ahead of the next one. The ends hold every frame
+// (plus the stop marker), so submitting and finishing never have to wait
+FramePipeline::FramePipeline(const AlgorithmParams &params,
+                             cluster_format format, std::size_t depth)
+    : params{params}, format{format}, pool{depth > 0 ? depth : 1},
+      to_load{(depth > 0 ? depth : 1) + 1}, to_detect{2}, to_cluster{2},
+      finished{depth > 0 ? depth : 1}
+{
+    for (std::size_t k = 0; k < pool.capacity(); ++k)
+    {
+        frames.emplace_back(new PipelineFrame);
+        pool.push(frames.back().get());
+    }
+
+    stages.emplace_back(&FramePipeline::load_stage, this);
+    stages.emplace_back(&FramePipeline::detect_stage, this);
+    stages.emplace_back(&FramePipeline::cluster_stage, this);
+}
+
+FramePipeline::~FramePipeline()
+{
+    // every stage passes the null on once it's done what's ahead of it
+    to_load.push(nullptr);
+    for (std::thread &stage : stages)
+        stage.join();
+}
+
+PipelineFrame *FramePipeline::acquire()
+{
+    PipelineFrame *frame = nullptr;
+    return pool.try_pop(frame) ? frame : nullptr;
+}
+
+void FramePipeline::submit(PipelineFrame *frame)
+{
+    frame->error.clear();
+    frame->sequence = num_submitted.fetch_add(1);
+    to_load.push(frame);
+}
+
+void FramePipeline::note_size(std::size_t pixels)
+{
+    std::size_t largest = largest_frame.load();
+    while (pixels > largest && !largest_frame.compare_exchange_weak(largest, pixels))
+    {
+    }
+}
+
+bool FramePipeline::try_submit(const unsigned char *pixels, int rows, int cols)
+{
+    PipelineFrame *frame = acquire();
+    if (!frame)
+        return false;
+
+    // the copy goes into the frame's own buffer, which only reallocates if
+    // this frame is bigger than the last one it held
+    frame->path.clear();
+    frame->image.create(rows, cols, CV_8UC1);
+    for (int i = 0; i < rows; ++i)
+        std::memcpy(frame->image.ptr<unsigned char>(i),
+                    pixels + static_cast<std::size_t>(i) * cols, cols);
+    note_size(static_cast<std::size_t>(rows) * cols);
+
+    submit(frame);
+    return true;
+}
+
+bool FramePipeline::try_submit_file(const std::string &path, int rows,
+                                    int cols, float cutoff)
+{
+    PipelineFrame *frame = acquire();
+    if (!frame)
+        return false;
+
+    frame->path = path;
+    frame->rows = rows;
+    frame->cols = cols;
+    frame->cutoff = cutoff;
+    submit(frame);
+    return true;
+}
+
+const PipelineFrame *FramePipeline::next()
+{
+    if (pending() == 0)
+        return nullptr;
+    PipelineFrame *frame = finished.pop();
+    num_returned.fetch_add(1);
+    return frame;
+}
+
+const PipelineFrame *FramePipeline::try_next()
+{
+    PipelineFrame *frame = nullptr;
+    if (!finished.try_pop(frame))
+        return nullptr;
+    num_returned.fetch_add(1);
+    return frame;
+}
+
+void FramePipeline::release(const PipelineFrame *frame)
+{
+    if (frame)
+        pool.push(const_cast<PipelineFrame *>(frame));
+}
+
+std::size_t FramePipeline::memory_bytes() const
+{
+    // image, equalized and mask are a byte per pixel, packed a bit
+    std::size_t per_frame = largest_frame.load() * 3 + largest_frame.load() / 8;
+    return frames.size() * per_frame + workspace_held.load();
+}
+
+void FramePipeline::load_stage()
+{
+    while (PipelineFrame *frame = to_load.pop())
+    {
+        if (!frame->path.empty())
+        {
+            StageTimer timer{stage::load};
+            const std::string &path = frame->path;
+            try
+            {
+                if (path.size() > 4 && path.substr(path.size() - 4) == ".pic")
+                {
+                    if (!read_pic(path, frame->cutoff, frame->rows, frame->cols,
+                                  frame->image))
+                        frame->error = "couldn't open " + path + ".";
+                }
+                else
+                {
+                    frame->image = cv::imread(path, cv::IMREAD_GRAYSCALE);
+                    if (frame->image.empty())
+                        frame->error = "couldn't read " + path + ".";
+                }
+            }
+            catch (const std::exception &e)
+            {
+                frame->error = e.what();
+            }
+            timer.bytes = frame->image.total();
+            note_size(frame->image.total());
+        }
+        to_detect.push(frame);
+    }
+    to_detect.push(nullptr);
+}
+
+void FramePipeline::detect_stage()
+{
+    while (PipelineFrame *frame = to_detect.pop())
+    {
+        if (frame->error.empty())
+        {
+            try
+            {
+                if (params.equalize_length > 0)
+                {
+                    StageTimer timer{stage::equalize, frame->image.total()};
+                    sliding_hist_eq(frame->image, frame->equalized,
+                                    params.equalize_length);
+                    std::swap(frame->image, frame->equalized);
+                }
+
+                StageTimer timer{stage::significance, frame->image.total()};
+                fused_significance(frame->image, frame->mask, params.L, params.d,
+                                   params.sigma, nullptr, nullptr,
+                                   params.num_threads);
+                frame->packed.from_mat(frame->mask);
+            }
+            catch (const std::exception &e)
+            {
+                frame->error = e.what();
+            }
+        }
+        to_cluster.push(frame);
+    }
+    to_cluster.push(nullptr);
+}
+
+void FramePipeline::cluster_stage()
+{
+    while (PipelineFrame *frame = to_cluster.pop())
+    {
+        if (frame->error.empty())
+        {
+            try
+            {
+                {
+                    StageTimer timer{stage::cluster, frame->mask.total()};
+                    DBSCAN scanner{workspace};
+                    scanner.setThreads(params.num_threads);
+                    if (params.engine == cluster_engine::grid)
+                        scanner.setParameters(params.eps, params.minPts);
+                    frame->clusters = scanner.getClusters(frame->packed, frame->mask,
+                                                          params.engine);
+                }
+
+                StageTimer timer{stage::serialize};
+                serialize_clusters(frame->clusters, format, frame->results);
+                timer.bytes = frame->results.size();
+            }
+            catch (const std::exception &e)
+            {
+                frame->error = e.what();
+            }
+            workspace_held.store(workspace.bytes());
+        }
+        if (!frame->error.empty())
+        {
+            frame->clusters.clear();
+            frame->results.clear();
+        }
+        finished.push(frame);
+    }
+}
+} // namespace rrec
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bitmask.hpp"
+#include "cluster.hpp"
+#include "detector.hpp"
+#include "queue.hpp"
+#include "serialize.hpp"
+#include "workspace.hpp"
+
+namespace rrec
+{
+// One frame on its way through a FramePipeline, along with every buffer it
+// needs on the way. Frames are recycled, so once the pipeline has seen a
+// frame of some size the images aren't allocated again
+struct PipelineFrame
+{
+    uint64_t sequence = 0; // submission order, from 0
+
+    // where the pixels come from: the file at path (read by the load stage),
+    // or if path is empty they're already in image
+    std::string path;
+    int rows = 0; // for .pic files
+    int cols = 0;
+    float cutoff = 900;
+
+    cv::Mat image;     // the frame, equalized once the detect stage is done
+    cv::Mat equalized; // equalization's output, swapped with image after
+    cv::Mat mask;      // significant pixels, 0/255, then the clusters drawn in
+    PackedMask packed; // mask, packed for clustering
+
+    std::vector<Cluster> clusters;
+    std::vector<unsigned char> results; // the clusters, serialized
+    std::string error; // why the frame failed, in which case results is empty
+};
+
+// Runs frames through the same steps as Detector::run_algorithm, with the
+// steps split over three threads so different frames are in different stages
+// at once:
+//
+//     submit -> load -> equalize + significance -> cluster + serialize -> next
+//
+// While frame N is being clustered and serialized, N + 1 is being equalized
+// and thresholded and N + 2 read in, so once it's full the pipeline turns out
+// frames at the rate of its slowest stage rather than of all of them added
+// up. The stages are joined by bounded SpscQueues and a stage waits when the
+// one after it is full, so a slow stage holds up the ones before it instead
+// of frames piling up. Each stage is one thread and the queues are FIFO, so
+// frames come out in the order they went in.
+//
+// Frames come from a pool of depth, so at most depth frames are in flight
+// (submitted but not yet released). try_submit must never be called from
+// two threads at once, and neither must next/try_next/release, but the
+// submitting and collecting sides can each be a different thread
+class FramePipeline
+{
+  private:
+    AlgorithmParams params;
+    cluster_format format;
+
+    std::vector<std::unique_ptr<PipelineFrame>> frames; // every frame we own
+
+    // free frames go from release back to try_submit through pool, and a
+    // null frame down the stages tells them to stop
+    SpscQueue<PipelineFrame *> pool;
+    SpscQueue<PipelineFrame *> to_load;
+    SpscQueue<PipelineFrame *> to_detect;
+    SpscQueue<PipelineFrame *> to_cluster;
+    SpscQueue<PipelineFrame *> finished;
+
+    ClusterWorkspace workspace; // the cluster stage's
+    std::atomic<std::size_t> workspace_held{0}; // its bytes, after each frame
+
+    std::atomic<uint64_t> num_submitted{0};
+    std::atomic<uint64_t> num_returned{0}; // by next/try_next
+    std::atomic<std::size_t> largest_frame{0}; // pixels
+
+    std::vector<std::thread> stages;
+
+    PipelineFrame *acquire(); // a free frame, null if there isn't one
+    void submit(PipelineFrame *frame);
+    void note_size(std::size_t pixels); // keeps largest_frame up to date
+
+    void load_stage();
+    void detect_stage();
+    void cluster_stage();
+
+  public:
+    // params as for run_algorithm (num_threads goes to every stage's
+    // kernels), and the results are serialized in format
+    FramePipeline(const AlgorithmParams &params, cluster_format format,
+                  std::size_t depth = 4);
+    // finishes the frames already submitted, then stops the stages. Counts
+    // as submitting, as far as threads are concerned
+    ~FramePipeline();
+
+    FramePipeline(const FramePipeline &) = delete;
+    FramePipeline &operator=(const FramePipeline &) = delete;
+
+    // queues a frame of rows*cols uint8 pixels, copying them before it
+    // returns. False (and nothing is queued) if depth frames are in flight
+    bool try_submit(const unsigned char *pixels, int rows, int cols);
+
+    // queues an image file for the load stage to read: a .pic of rows*cols
+    // (see read_pic) or anything cv::imread understands, in which case rows
+    // and cols are ignored
+    bool try_submit_file(const std::string &path, int rows, int cols,
+                         float cutoff);
+
+    // the oldest frame next hasn't returned yet. next waits for it to finish
+    // (null if nothing has been submitted that hasn't been returned),
+    // try_next returns null if it isn't finished. Either way the frame is
+    // the caller's until it's given back with release
+    const PipelineFrame *next();
+    const PipelineFrame *try_next();
+    void release(const PipelineFrame *frame);
+
+    std::size_t depth() const { return frames.size(); }
+    uint64_t submitted() const { return num_submitted.load(); }
+    // submitted frames next hasn't returned yet
+    std::size_t pending() const { return num_submitted.load() - num_returned.load(); }
+
+    // roughly what the pipeline holds: every frame's image buffers at the
+    // biggest size submitted so far, plus the clustering workspace
+    std::size_t memory_bytes() const;
+};
+} // namespace rrec
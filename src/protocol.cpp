@@ -0,0 +1,108 @@
+#include "protocol.hpp"
+
+#include <cstring>
+
+namespace rrec
+{
+bool StreamReader::read(void *data, std::size_t bytes)
+{
+    if (ok && bytes > 0 && fread(data, 1, bytes, in) != bytes)
+        ok = false;
+    return ok;
+}
+
+std::string StreamReader::read_line()
+{
+    std::string line;
+    int c;
+    while ((c = fgetc(in)) != EOF && c != '\n')
+        line.push_back(static_cast<char>(c));
+    if (c == EOF)
+        ok = false;
+    return line;
+}
+
+bool FrameReader::read(void *out, std::size_t bytes)
+{
+    if (!ok || bytes > size - pos)
+    {
+        // hand back zeros rather than whatever was in out
+        std::memset(out, 0, bytes);
+        ok = false;
+        return false;
+    }
+    std::memcpy(out, data + pos, bytes);
+    pos += bytes;
+    return true;
+}
+
+std::string FrameReader::read_line()
+{
+    const unsigned char *start = data + pos;
+    const void *newline = std::memchr(start, '\n', size - pos);
+    std::size_t length = newline ? static_cast<const unsigned char *>(newline) - start
+                                 : size - pos;
+
+    std::string line(reinterpret_cast<const char *>(start), length);
+    pos += newline ? length + 1 : length;
+    return line;
+}
+
+void Response::status(int code)
+{
+    if (!failed)
+        put(static_cast<int32_t>(code));
+}
+
+void Response::error(int code, const std::string &message)
+{
+    if (failed)
+        return;
+    put(static_cast<int32_t>(code));
+    write(message.data(), message.size());
+    bytes.push_back('\n');
+    failed = true;
+}
+
+void Response::write(const void *data, std::size_t size)
+{
+    if (failed || size == 0)
+        return;
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    bytes.insert(bytes.end(), p, p + size);
+}
+
+void Response::send(FILE *out) const
+{
+    if (!bytes.empty())
+        fwrite(bytes.data(), 1, bytes.size(), out);
+    fflush(out);
+}
+
+void Response::send_frame(FILE *out, uint32_t opcode, uint32_t request_id) const
+{
+    FrameHeader header;
+    header.length = static_cast<uint32_t>(sizeof(header) - 4 + bytes.size());
+    header.opcode = opcode;
+    header.request_id = request_id;
+
+    fwrite(&header, sizeof(header), 1, out);
+    if (!bytes.empty())
+        fwrite(bytes.data(), 1, bytes.size(), out);
+    fflush(out);
+}
+
+void Response::append_frame(std::vector<unsigned char> &out, uint32_t opcode,
+                            uint32_t request_id) const
+{
+    FrameHeader header;
+    header.length = static_cast<uint32_t>(sizeof(header) - 4 + bytes.size());
+    header.opcode = opcode;
+    header.request_id = request_id;
+
+    const unsigned char *h = reinterpret_cast<const unsigned char *>(&header);
+    out.reserve(out.size() + sizeof(header) + bytes.size());
+    out.insert(out.end(), h, h + sizeof(header));
+    out.insert(out.end(), bytes.begin(), bytes.end());
+}
+} // namespace rrec
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace rrec
+{
+// Every message in version 2 of the protocol is a frame:
+//
+//     uint32 length      bytes after this field
+//     uint32 opcode      the instruction, echoed back in the response
+//     uint32 request_id  chosen by python, echoed back in the response
+//     payload            the instruction's arguments, or for a response an
+//                        int32 status followed by whatever it returns (the
+//                        error message, for errors)
+//
+// so a reader always knows where the next message starts, and python can
+// send any number of requests before reading the responses back by ID
+struct FrameHeader
+{
+    uint32_t length;
+    uint32_t opcode;
+    uint32_t request_id;
+};
+static_assert(sizeof(FrameHeader) == 12, "FrameHeader must be packed");
+
+// the most a single frame may hold, anything bigger is taken as garbage
+constexpr uint32_t max_frame_length = 1u << 30;
+
+// where an instruction's arguments come from
+class RequestReader
+{
+  public:
+    virtual ~RequestReader() = default;
+
+    // reads exactly bytes into data, false if there weren't that many left
+    virtual bool read(void *data, std::size_t bytes) = 0;
+
+    // reads up to the next '\n' (dropped) or the end of the input
+    virtual std::string read_line() = 0;
+
+    // false once a read has come up short
+    virtual bool good() const = 0;
+
+    // bytes left to read, or as many as anyone could want if the reader
+    // can't tell (a stream)
+    virtual std::size_t remaining() const = 0;
+
+    template <typename T> T get()
+    {
+        T value{};
+        read(&value, sizeof(T));
+        return value;
+    }
+};
+
+// the arguments straight off a stream, for the version 1 protocol
+class StreamReader : public RequestReader
+{
+  private:
+    FILE *in;
+    bool ok = true;
+
+  public:
+    explicit StreamReader(FILE *in) : in{in} {}
+
+    bool read(void *data, std::size_t bytes) override;
+    std::string read_line() override;
+    bool good() const override { return ok; }
+    std::size_t remaining() const override { return SIZE_MAX; }
+};
+
+// the arguments out of a frame's payload, which has already been read in
+class FrameReader : public RequestReader
+{
+  private:
+    const unsigned char *data;
+    std::size_t size;
+    std::size_t pos = 0;
+    bool ok = true;
+
+  public:
+    FrameReader(const void *data, std::size_t size)
+        : data{static_cast<const unsigned char *>(data)}, size{size}
+    {
+    }
+
+    bool read(void *out, std::size_t bytes) override;
+    std::string read_line() override;
+    bool good() const override { return ok; }
+    std::size_t remaining() const override { return ok ? size - pos : 0; }
+};
+
+// The reply to one instruction, built up in memory and sent in one go once
+// the instruction is done. After an error nothing else is added, so a
+// handler that carries on after reporting an error can't put anything
+// python isn't expecting after the message
+class Response
+{
+  private:
+    std::vector<unsigned char> bytes;
+    bool failed = false;
+
+  public:
+    void clear()
+    {
+        bytes.clear();
+        failed = false;
+    }
+
+    // the int32 status every reply starts with
+    void status(int code);
+
+    // the error status code then the message, terminated by '\n'
+    void error(int code, const std::string &message);
+
+    void write(const void *data, std::size_t size);
+
+    template <typename T> void put(const T &value) { write(&value, sizeof(T)); }
+
+    bool is_error() const { return failed; }
+    bool empty() const { return bytes.empty(); }
+    const unsigned char *data() const { return bytes.data(); }
+    std::size_t size() const { return bytes.size(); }
+
+    // sends the reply as is (version 1), or wrapped in a frame (version 2)
+    void send(FILE *out) const;
+    void send_frame(FILE *out, uint32_t opcode, uint32_t request_id) const;
+
+    // the same frame added to the end of out, for whoever sends it later
+    void append_frame(std::vector<unsigned char> &out, uint32_t opcode,
+                      uint32_t request_id) const;
+};
+} // namespace rrec
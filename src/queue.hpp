@@ -0,0 +1,171 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace rrec
+{
+// Waiting for a lock-free queue: spin for a bit, then yield, then give up so
+// the waiter can go to sleep until it's woken. A thread that only has to wait
+// a moment doesn't pay for a trip through the scheduler, and one stuck behind
+// a slow stage (or an idle pipeline) doesn't wake up until there's something
+// for it to do
+class Backoff
+{
+  private:
+    int spins = 0;
+
+  public:
+    // false once it's time to stop spinning and sleep instead
+    bool pause()
+    {
+        if (spins < 64)
+        {
+#if defined(__SSE2__)
+            _mm_pause();
+#endif
+            ++spins;
+            return true;
+        }
+        if (spins < 128)
+        {
+            std::this_thread::yield();
+            ++spins;
+            return true;
+        }
+        return false;
+    }
+    void reset() { spins = 0; }
+};
+
+// Bounded queue for exactly one producer thread and one consumer thread: a
+// ring of capacity slots, where only the producer moves tail and only the
+// consumer moves head. Neither ever waits for the other, try_push/try_pop
+// just say if the queue was full/empty. push and pop wait (see Backoff) until
+// there is room/something there, which is what holds a producer back when
+// its consumer is slower. A push or pop only takes a lock when the other end
+// has given up spinning and gone to sleep, to wake it
+template <typename T> class SpscQueue
+{
+  private:
+    std::vector<T> slots;
+
+    // head and tail count every pop/push ever, the slot is that mod capacity.
+    // Padded so the two threads don't fight over one cache line
+    char pad0[64];
+    std::atomic<std::size_t> head{0}; // next to pop, written by the consumer
+    char pad1[64];
+    std::atomic<std::size_t> tail{0}; // next to push, written by the producer
+    char pad2[64];
+
+    // where push and pop sleep once Backoff runs out. sleepers counts them,
+    // so the other end only goes near the lock when someone's there to wake
+    std::mutex park_lock;
+    std::condition_variable parked;
+    std::atomic<int> sleepers{0};
+
+    bool put(const T &value)
+    {
+        std::size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == slots.size())
+            return false;
+        slots[t % slots.size()] = value;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool take(T &value)
+    {
+        std::size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return false;
+        value = slots[h % slots.size()];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // spins, then sleeps, until done() (a put or take) succeeds
+    template <typename F> void wait_for(F done)
+    {
+        Backoff backoff;
+        while (!done())
+        {
+            if (backoff.pause())
+                continue;
+
+            std::unique_lock<std::mutex> guard{park_lock};
+            sleepers.fetch_add(1, std::memory_order_relaxed);
+            // pairs with the fence in wake: either done() below sees the
+            // other end's move, or the other end sees us in sleepers
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            parked.wait(guard, done);
+            sleepers.fetch_sub(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+
+    // after a put or take, wakes the other end if it's asleep waiting for it
+    void wake()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers.load(std::memory_order_relaxed) > 0)
+        {
+            std::lock_guard<std::mutex> guard{park_lock};
+            parked.notify_all();
+        }
+    }
+
+  public:
+    explicit SpscQueue(std::size_t capacity) : slots(capacity > 0 ? capacity : 1) {}
+
+    SpscQueue(const SpscQueue &) = delete;
+    SpscQueue &operator=(const SpscQueue &) = delete;
+
+    std::size_t capacity() const { return slots.size(); }
+
+    // only exact when called from the producer or consumer, and when the
+    // other one isn't moving
+    std::size_t size() const
+    {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+
+    bool try_push(const T &value)
+    {
+        if (!put(value))
+            return false;
+        wake();
+        return true;
+    }
+
+    bool try_pop(T &value)
+    {
+        if (!take(value))
+            return false;
+        wake();
+        return true;
+    }
+
+    void push(const T &value)
+    {
+        wait_for([&] { return put(value); });
+        wake();
+    }
+
+    T pop()
+    {
+        T value;
+        wait_for([&] { return take(value); });
+        wake();
+        return value;
+    }
+};
+} // namespace rrec
@@ -0,0 +1,122 @@
+#include "scoring.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+
+namespace rrec
+{
+double DetectionScore::precision() const
+{
+    int found = true_positives + false_positives;
+    return found ? double(true_positives) / found : 1.0;
+}
+
+double DetectionScore::recall() const
+{
+    int present = true_positives + false_negatives;
+    return present ? double(true_positives) / present : 1.0;
+}
+
+double DetectionScore::f1() const
+{
+    double p = precision();
+    double r = recall();
+    return p + r > 0 ? 2 * p * r / (p + r) : 0.0;
+}
+
+DetectionScore &DetectionScore::operator+=(const DetectionScore &other)
+{
+    int matches = true_positives + other.true_positives;
+    if (matches)
+        mean_error = (mean_error * true_positives +
+                      other.mean_error * other.true_positives) /
+                     matches;
+    true_positives = matches;
+    false_positives += other.false_positives;
+    false_negatives += other.false_negatives;
+    return *this;
+}
+
+DetectionScore score_detections(const std::vector<Cluster> &clusters,
+                                const std::vector<TruthPoint> &truth,
+                                double max_distance, int min_area)
+{
+    struct Candidate
+    {
+        double distance;
+        int cluster;
+        int skyrmion;
+    };
+
+    // the truth goes into a grid of max_distance sized cells, so each
+    // centroid only has to look at the 3x3 cells around it
+    const double cell = std::max(max_distance, 1.0);
+    auto key = [](long long r, long long c) { return (r << 32) ^ (c & 0xffffffff); };
+    std::unordered_map<long long, std::vector<int>> grid;
+    for (int s = 0; s < static_cast<int>(truth.size()); ++s)
+        grid[key(static_cast<long long>(std::floor(truth[s].row / cell)),
+                 static_cast<long long>(std::floor(truth[s].col / cell)))]
+            .push_back(s);
+
+    std::vector<Candidate> candidates;
+    int num_clusters = 0;
+    for (int c = 0; c < static_cast<int>(clusters.size()); ++c)
+    {
+        const ClusterStats &stats = clusters[c].statistics();
+        if (stats.area == 0 || stats.area < min_area)
+            continue;
+        ++num_clusters;
+
+        double row = stats.centroidRow();
+        double col = stats.centroidCol();
+        long long r0 = static_cast<long long>(std::floor(row / cell));
+        long long c0 = static_cast<long long>(std::floor(col / cell));
+        for (long long r = r0 - 1; r <= r0 + 1; ++r)
+        {
+            for (long long cc = c0 - 1; cc <= c0 + 1; ++cc)
+            {
+                auto found = grid.find(key(r, cc));
+                if (found == grid.end())
+                    continue;
+                for (int s : found->second)
+                {
+                    double d = std::hypot(row - truth[s].row, col - truth[s].col);
+                    if (d <= max_distance)
+                        candidates.push_back({d, c, s});
+                }
+            }
+        }
+    }
+
+    // greedy matching, closest first (ties broken by index so the score
+    // doesn't depend on the sort)
+    std::sort(candidates.begin(), candidates.end(),
+              [](const Candidate &a, const Candidate &b) {
+                  if (a.distance != b.distance)
+                      return a.distance < b.distance;
+                  if (a.cluster != b.cluster)
+                      return a.cluster < b.cluster;
+                  return a.skyrmion < b.skyrmion;
+              });
+    std::vector<bool> cluster_used(clusters.size(), false);
+    std::vector<bool> skyrmion_used(truth.size(), false);
+
+    DetectionScore score;
+    double total_error = 0;
+    for (const Candidate &m : candidates)
+    {
+        if (cluster_used[m.cluster] || skyrmion_used[m.skyrmion])
+            continue;
+        cluster_used[m.cluster] = true;
+        skyrmion_used[m.skyrmion] = true;
+        ++score.true_positives;
+        total_error += m.distance;
+    }
+
+    score.false_positives = num_clusters - score.true_positives;
+    score.false_negatives = static_cast<int>(truth.size()) - score.true_positives;
+    score.mean_error = score.true_positives ? total_error / score.true_positives : 0;
+    return score;
+}
+} // namespace rrec
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <vector>
+
+#include "cluster.hpp"
+#include "synthetic.hpp"
+
+namespace rrec
+{
+// how well a set of clusters matches the true skyrmion positions
+struct DetectionScore
+{
+    int true_positives = 0;  // clusters matched to a skyrmion
+    int false_positives = 0; // clusters with no skyrmion near enough
+    int false_negatives = 0; // skyrmions no cluster was matched to
+    double mean_error = 0;   // mean centroid distance over the matches, pixels
+
+    double precision() const;
+    double recall() const;
+    double f1() const;
+
+    // adds another frame's counts (the errors are weighted by matches)
+    DetectionScore &operator+=(const DetectionScore &other);
+};
+
+// Matches cluster centroids to truth one to one, closest pairs first, as long
+// as they're within max_distance pixels of each other. Clusters with fewer
+// than min_area points are ignored altogether
+DetectionScore score_detections(const std::vector<Cluster> &clusters,
+                                const std::vector<TruthPoint> &truth,
+                                double max_distance, int min_area = 0);
+} // namespace rrec
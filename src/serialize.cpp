@@ -0,0 +1,153 @@
+#include "serialize.hpp"
+
+#include <cstring>
+
+namespace rrec
+{
+namespace
+{
+// the biggest varint a uint32 can take
+constexpr std::size_t max_varint_bytes = 5;
+
+unsigned char *put_int(unsigned char *p, int32_t value)
+{
+    std::memcpy(p, &value, 4);
+    return p + 4;
+}
+
+unsigned char *put_varint(unsigned char *p, uint32_t value)
+{
+    while (value >= 0x80)
+    {
+        *p++ = static_cast<unsigned char>(value | 0x80);
+        value >>= 7;
+    }
+    *p++ = static_cast<unsigned char>(value);
+    return p;
+}
+
+// small magnitudes of either sign to small unsigned numbers
+uint32_t zigzag(int value)
+{
+    return (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31);
+}
+
+unsigned char *put_points(unsigned char *p, const PointRange &points)
+{
+    p = put_int(p, static_cast<int32_t>(points.size()));
+    for (auto point : points)
+    {
+        p = put_int(p, point[0]);
+        p = put_int(p, point[1]);
+    }
+    return p;
+}
+
+unsigned char *put_spans(unsigned char *p, const std::vector<Span> &spans)
+{
+    p = put_int(p, static_cast<int32_t>(spans.size()));
+    if (!spans.empty())
+        std::memcpy(p, spans.data(), sizeof(Span) * spans.size());
+    return p + sizeof(Span) * spans.size();
+}
+
+// the most bytes the body of each format can take
+std::size_t max_body_bytes(const std::vector<Cluster> &clusters,
+                           cluster_format format)
+{
+    std::size_t bytes = 0;
+    switch (format)
+    {
+    case cluster_format::points:
+        for (const auto &cluster : clusters)
+            bytes += 8 + 8 * static_cast<std::size_t>(cluster.size());
+        break;
+    case cluster_format::spans:
+        for (const auto &cluster : clusters)
+            bytes += 8 + sizeof(Span) * (cluster.coreSpans.size() +
+                                         cluster.outerSpans.size());
+        break;
+    case cluster_format::summary:
+        bytes = sizeof(ClusterSummary) * clusters.size();
+        break;
+    case cluster_format::compact:
+        for (const auto &cluster : clusters)
+            bytes += max_varint_bytes *
+                     (2 + 3 * (cluster.coreSpans.size() + cluster.outerSpans.size()));
+        break;
+    }
+    return bytes;
+}
+} // namespace
+
+void serialize_clusters(const std::vector<Cluster> &clusters,
+                        cluster_format format, std::vector<unsigned char> &out)
+{
+    out.resize(8 + max_body_bytes(clusters, format));
+    unsigned char *body = out.data() + 8;
+    unsigned char *p = body;
+
+    switch (format)
+    {
+    case cluster_format::points:
+        for (const auto &cluster : clusters)
+        {
+            p = put_points(p, cluster.corePoints());
+            p = put_points(p, cluster.outerPoints());
+        }
+        break;
+
+    case cluster_format::spans:
+        for (const auto &cluster : clusters)
+        {
+            p = put_spans(p, cluster.coreSpans);
+            p = put_spans(p, cluster.outerSpans);
+        }
+        break;
+
+    case cluster_format::summary:
+        for (const auto &cluster : clusters)
+        {
+            ClusterSummary summary = cluster.summary();
+            std::memcpy(p, &summary, sizeof(summary));
+            p += sizeof(summary);
+        }
+        break;
+
+    case cluster_format::compact:
+    {
+        // the counts all go first, so python can split the spans up without
+        // walking the stream
+        for (const auto &cluster : clusters)
+        {
+            p = put_varint(p, static_cast<uint32_t>(cluster.coreSpans.size()));
+            p = put_varint(p, static_cast<uint32_t>(cluster.outerSpans.size()));
+        }
+
+        int row = 0;
+        int begin = 0;
+        auto put = [&](const std::vector<Span> &spans) {
+            for (const auto &span : spans)
+            {
+                p = put_varint(p, zigzag(span.row - row));
+                p = put_varint(p, zigzag(span.begin - begin));
+                p = put_varint(p, static_cast<uint32_t>(span.size()));
+                row = span.row;
+                begin = span.begin;
+            }
+        };
+        for (const auto &cluster : clusters)
+        {
+            put(cluster.coreSpans);
+            put(cluster.outerSpans);
+        }
+        break;
+    }
+    }
+
+    // now the body's done we know exactly how big it is
+    out.resize(p - out.data());
+    put_int(out.data(), static_cast<int32_t>(p - body));
+    put_int(out.data() + 4, static_cast<int32_t>(clusters.size()));
+}
+} // namespace rrec
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "cluster.hpp"
+
+namespace rrec
+{
+// how print_clusters sends each cluster's points
+enum class cluster_format
+{
+    points,  // every point as (row, col)
+    spans,   // (row, begin, end) for each run of points on a row
+    summary, // just a ClusterSummary per cluster
+    compact  // spans, delta encoded as varints (see below)
+};
+
+// Every format starts with two int32s: the number of bytes after them, and
+// the number of clusters. Then, per format:
+//
+//   points:  for each cluster, int32 core count then (row, col) int32 pairs,
+//            and the same for the outer points
+//   spans:   for each cluster, int32 core span count then (row, begin, end)
+//            int32 triples, and the same for the outer spans
+//   summary: a ClusterSummary per cluster
+//   compact: a stream of LEB128 varints. First each cluster's core and outer
+//            span counts, then every span in the same order as in spans (the
+//            core spans of the first cluster, its outer spans, the core spans
+//            of the second cluster, ...) as zigzag(row - previous row),
+//            zigzag(begin - previous begin) and end - begin. The previous
+//            row/begin start at 0
+//
+// The whole thing is built in out (resized to fit, so a buffer reused frame
+// after frame only reallocates when the results grow) so it can be sent with
+// a single write
+void serialize_clusters(const std::vector<Cluster> &clusters,
+                        cluster_format format, std::vector<unsigned char> &out);
+} // namespace rrec
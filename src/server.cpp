@@ -1,5 +1,9 @@
 #include "server.hpp"
 
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+
 namespace rrec
 {
 Server::Server() {} // default constructor doesn't currently do anything
@@ -21,19 +25,25 @@ Server::Server(std::string path, int rows, int cols)
     }
 }
 
+Server::~Server() { stop_pipeline(); }
+
 void Server::handle_BadInput(std::string err_msg)
 {
-    // send an error response
-    int temp = static_cast<int>(response_type::error);
-    fwrite(&temp, 4, 1, stdout);
-    fflush(stdout);
-    std::cout << err_msg << std::endl;
+    // the message goes in the reply, after which the reply is closed so
+    // nothing the handler does afterwards can follow it
+    out.error(static_cast<int>(response_type::error), err_msg);
+}
+
+// true if path names a .pic file rather than an ordinary image
+static bool is_pic(const std::string &path)
+{
+    return path.length() >= 4 && path.compare(path.length() - 4, 4, ".pic") == 0;
 }
 
 void Server::handle_LoadFromFile(std::string path)
 {
     // work out if user wants to load a stored .pic file or ordinary image file
-    if (path.substr(path.length() - 4, 4) == ".pic")
+    if (is_pic(path))
     {
         // we can't open .pic files without knowing how many rows/cols there are
         detector.is_open = false;
@@ -42,13 +52,17 @@ void Server::handle_LoadFromFile(std::string path)
     else
     {
         detector.load_image(path);
+        if (!detector.is_open)
+        {
+            handle_BadInput("image_main empty after call to imread");
+        }
     }
 }
 
 void Server::handle_LoadFromFile(std::string path, int rows, int cols)
 {
     // work out if user wants to load a stored .pic file or ordinary image file
-    if (path.substr(path.length() - 4, 4) == ".pic")
+    if (is_pic(path))
     {
         // we have enough information to open a .pic file
         detector.load_pic(path, rows, cols);
@@ -71,27 +85,73 @@ void Server::handle_Equalize()
     }
 }
 
+void Server::handle_EqualizeTiled(int tile, int num_threads)
+{
+    if (!detector.is_open)
+    {
+        handle_BadInput("file not open.");
+    }
+    else if (tile < 1)
+    {
+        handle_BadInput("tile size must be positive.");
+    }
+    else
+    {
+        // num_threads < 1 lets the detector use every core
+        detector.adaptive_hist_eq_tiled(tile, num_threads);
+    }
+}
+
 void Server::handle_CalculateBackground(int L)
 {
-    if (detector.is_open)
+    if (!detector.is_open)
     {
-        detector.calculate_background(L);
+        handle_BadInput("file not open.");
+    }
+    else if (L < 1 || L % 2 == 0)
+    {
+        handle_BadInput("L must be a positive odd integer.");
     }
     else
+    {
+        detector.calculate_background(L);
+    }
+}
+
+void Server::handle_CalculateBackground(int L, int engine)
+{
+    if (!detector.is_open)
     {
         handle_BadInput("file not open.");
     }
+    else if (L < 1 || L % 2 == 0)
+    {
+        handle_BadInput("L must be a positive odd integer.");
+    }
+    else if (engine != static_cast<int>(blur_engine::opencv) &&
+             engine != static_cast<int>(blur_engine::recursive))
+    {
+        handle_BadInput("unknown background engine.");
+    }
+    else
+    {
+        detector.calculate_background(L, static_cast<blur_engine>(engine));
+    }
 }
 
 void Server::handle_CalculateSignal(int d)
 {
-    if (detector.is_open)
+    if (!detector.is_open)
     {
-        detector.calculate_signal(d);
+        handle_BadInput("file not open.");
+    }
+    else if (d < 1 || d % 2 == 0)
+    {
+        handle_BadInput("d must be a positive odd integer.");
     }
     else
     {
-        handle_BadInput("file not open.");
+        detector.calculate_signal(d);
     }
 }
 
@@ -115,15 +175,415 @@ void Server::handle_CalculateSignificance(double sigma)
     }
 }
 
+void Server::handle_CalculateSignificanceExact(double sigma, int window)
+{
+    if (!detector.is_open)
+    {
+        handle_BadInput("file not open.");
+    }
+    else if (!detector.is_background)
+    {
+        handle_BadInput("background not calculated.");
+    }
+    else if (!detector.is_signal)
+    {
+        handle_BadInput("signal not calculated.");
+    }
+    else
+    {
+        detector.calculate_significance_exact(sigma, window);
+    }
+}
+
+void Server::handle_CalculateSignificancePacked(double sigma)
+{
+    if (!detector.is_open)
+    {
+        handle_BadInput("file not open.");
+    }
+    else if (!detector.is_background)
+    {
+        handle_BadInput("background not calculated.");
+    }
+    else if (!detector.is_signal)
+    {
+        handle_BadInput("signal not calculated.");
+    }
+    else
+    {
+        detector.calculate_significance_packed(sigma);
+    }
+}
+
+void Server::handle_DetectSignificance(int L, int d, double sigma,
+                                       bool keep_intermediates)
+{
+    if (!detector.is_open)
+    {
+        handle_BadInput("file not open.");
+    }
+    else if (L < 1 || L % 2 == 0 || d < 1 || d % 2 == 0)
+    {
+        handle_BadInput("L and d must be positive odd integers.");
+    }
+    else
+    {
+        detector.detect_significance(L, d, sigma, keep_intermediates);
+    }
+}
+
 void Server::handle_Cluster()
 {
     if (!detector.is_open)
     {
         handle_BadInput("file not open.");
+        return;
     }
     detector.cluster();
 }
 
+void Server::handle_Cluster(int engine)
+{
+    handle_Cluster(engine, 1);
+}
+
+void Server::handle_Cluster(int engine, int num_threads)
+{
+    if (!detector.is_open)
+    {
+        handle_BadInput("file not open.");
+        return;
+    }
+    else if (engine != static_cast<int>(cluster_engine::dbscan) &&
+             engine != static_cast<int>(cluster_engine::union_find) &&
+             engine != static_cast<int>(cluster_engine::grid))
+    {
+        handle_BadInput("unknown clustering engine.");
+        return;
+    }
+    detector.cluster(static_cast<cluster_engine>(engine), num_threads);
+}
+
+void Server::handle_ClusterGrid(int eps, int minPts, int num_threads)
+{
+    if (!detector.is_open)
+    {
+        handle_BadInput("file not open.");
+        return;
+    }
+    else if (eps < 1 || eps % 2 == 0)
+    {
+        handle_BadInput("eps must be a positive odd number.");
+        return;
+    }
+    else if (minPts < 1)
+    {
+        handle_BadInput("minPts must be positive.");
+        return;
+    }
+    detector.cluster_grid(eps, minPts, num_threads);
+}
+
+void Server::handle_WorkspaceBytes()
+{
+    handle_Success();
+
+    // current size then peak size of the clustering workspace, as uint64s
+    uint64_t sizes[2] = {detector.workspace_bytes(),
+                         detector.workspace_peak_bytes()};
+    out.write(sizes, sizeof(sizes));
+}
+
+void Server::handle_SetClusterFormat(int format)
+{
+    if (format != static_cast<int>(cluster_format::points) &&
+        format != static_cast<int>(cluster_format::spans) &&
+        format != static_cast<int>(cluster_format::summary) &&
+        format != static_cast<int>(cluster_format::compact))
+    {
+        handle_BadInput("unknown cluster format.");
+        return;
+    }
+    detector.set_cluster_format(static_cast<cluster_format>(format));
+    handle_Success();
+}
+
+void Server::handle_OpenShared(std::string name, long long bytes)
+{
+    if (bytes <= 0)
+    {
+        // a size of 0 just closes the segment
+        shared.close();
+        results_offset = -1;
+        handle_Success();
+        return;
+    }
+    else if (memory_cap > 0 &&
+             held_bytes() - shared.size() + static_cast<std::size_t>(bytes) > memory_cap)
+    {
+        // the segment we have now is replaced, so doesn't count
+        handle_BadInput("shared memory would go over the session memory cap.");
+        return;
+    }
+    if (!shared.open(name, static_cast<std::size_t>(bytes)))
+    {
+        handle_BadInput("couldn't open shared memory " + name + ".");
+        return;
+    }
+    handle_Success();
+}
+
+void Server::handle_LoadFromShared(int rows, int cols, long long offset)
+{
+    if (rows <= 0 || cols <= 0 || offset < 0 ||
+        !shared.contains(offset, static_cast<std::size_t>(rows) * cols))
+    {
+        handle_BadInput("image doesn't fit in shared memory.");
+        return;
+    }
+
+    // wrap the segment without copying, set_image_main takes its own copy
+    // so python is free to overwrite the segment as soon as we reply
+    cv::Mat image(rows, cols, CV_8UC1, shared.at(offset));
+    detector.set_image_main(image);
+    detector.is_open = true;
+    handle_Success();
+}
+
+void Server::handle_ImageToShared(int image, long long offset)
+{
+    cv::Mat source;
+    switch (image)
+    {
+    case image_main:
+        source = detector.get_image_main();
+        break;
+    case image_clustered:
+        source = detector.get_image_clustered();
+        break;
+    case image_L:
+        source = detector.get_image_L();
+        break;
+    case image_d:
+        source = detector.get_image_d();
+        break;
+    default:
+        handle_BadInput("unknown image.");
+        return;
+    }
+
+    if (source.empty())
+    {
+        handle_BadInput("image hasn't been calculated.");
+        return;
+    }
+
+    std::size_t row_bytes = source.cols * source.elemSize();
+    std::size_t bytes = row_bytes * source.rows;
+    if (offset < 0 || !shared.contains(offset, bytes))
+    {
+        handle_BadInput("image doesn't fit in shared memory.");
+        return;
+    }
+
+    for (int i = 0; i < source.rows; ++i)
+        std::memcpy(shared.at(offset + row_bytes * i), source.ptr(i), row_bytes);
+
+    // python only needs to know the shape and element size to view it
+    handle_Success();
+    int header[3] = {source.rows, source.cols, static_cast<int>(source.elemSize())};
+    out.write(header, sizeof(header));
+}
+
+void Server::handle_SetResultsShared(long long offset)
+{
+    if (offset >= 0 && !shared.is_open())
+    {
+        handle_BadInput("shared memory isn't open.");
+        return;
+    }
+    results_offset = offset;
+    handle_Success();
+}
+
+bool Server::check_params(const AlgorithmParams &params)
+{
+    int engine = static_cast<int>(params.engine);
+    if (params.L < 1 || params.L % 2 == 0 || params.d < 1 ||
+             params.d % 2 == 0)
+    {
+        handle_BadInput("L and d must be positive odd integers.");
+        return false;
+    }
+    else if (engine != static_cast<int>(cluster_engine::dbscan) &&
+             engine != static_cast<int>(cluster_engine::union_find) &&
+             engine != static_cast<int>(cluster_engine::grid))
+    {
+        handle_BadInput("unknown clustering engine.");
+        return false;
+    }
+    else if (params.engine == cluster_engine::grid &&
+             (params.eps < 1 || params.eps % 2 == 0 || params.minPts < 1))
+    {
+        handle_BadInput("eps must be a positive odd number and minPts positive.");
+        return false;
+    }
+    return true;
+}
+
+bool Server::check_image(int rows, int cols, RequestReader &in)
+{
+    if (rows <= 0 || cols <= 0)
+    {
+        handle_BadInput("image must have at least one row and column.");
+        return false;
+    }
+
+    // version 1 reads straight off stdin, where there's no telling how much
+    // is coming, but there's no memory cap there either
+    std::size_t bytes = static_cast<std::size_t>(rows) * cols;
+    if (bytes > in.remaining())
+    {
+        handle_BadInput("request payload too short.");
+        return false;
+    }
+    else if (memory_cap > 0 && held_bytes() + bytes > memory_cap)
+    {
+        handle_BadInput("image would go over the session memory cap.");
+        return false;
+    }
+    return true;
+}
+
+bool Server::handle_RunAlgorithm(const AlgorithmParams &params)
+{
+    if (!detector.is_open)
+    {
+        handle_BadInput("file not open.");
+        return false;
+    }
+    else if (!check_params(params))
+    {
+        return false;
+    }
+
+    detector.run_algorithm(params);
+    return true;
+}
+
+void Server::handle_PipelineStart(const AlgorithmParams &params, int depth)
+{
+    if (!check_params(params))
+        return;
+    if (depth < 1 || depth > 64)
+    {
+        handle_BadInput("pipeline depth must be between 1 and 64.");
+        return;
+    }
+
+    // a shared server can't let every client have a pipeline on every core
+    AlgorithmParams limited = params;
+    if (pipeline_budget)
+    {
+        if (params.num_threads < 1)
+        {
+            handle_BadInput("num_threads must be positive on a shared server.");
+            return;
+        }
+        limited.num_threads = std::min(params.num_threads, pipeline_budget->threads());
+    }
+
+    // the old pipeline (if any) finishes its frames before it goes, and
+    // results come out in whatever format the detector is using now
+    stop_pipeline();
+    if (pipeline_budget && !pipeline_budget->acquire())
+    {
+        handle_BadInput("too many pipelines running, try again later.");
+        return;
+    }
+    pipeline.reset(new FramePipeline{limited, detector.get_cluster_format(),
+                                     static_cast<std::size_t>(depth)});
+    handle_Success();
+}
+
+void Server::handle_PipelineSubmit(int rows, int cols)
+{
+    if (!pipeline)
+    {
+        handle_BadInput("pipeline not started.");
+        return;
+    }
+    if (!pipeline->try_submit(pipeline_input.data(), rows, cols))
+    {
+        handle_BadInput("pipeline full, collect a frame first.");
+        return;
+    }
+
+    // the frame's sequence number, which pipelineCollect hands back with it
+    handle_Success();
+    out.put(static_cast<long long>(pipeline->submitted() - 1));
+}
+
+void Server::handle_PipelineCollect()
+{
+    if (!pipeline)
+    {
+        handle_BadInput("pipeline not started.");
+        return;
+    }
+    else if (pipeline->pending() == 0)
+    {
+        handle_BadInput("no frames in the pipeline.");
+        return;
+    }
+
+    // waits for the oldest frame, which goes back in the pool as soon as its
+    // results have been copied into the reply
+    const PipelineFrame *frame = pipeline->next();
+    if (!frame->error.empty())
+    {
+        handle_BadInput("frame " + std::to_string(frame->sequence) + ": " +
+                        frame->error);
+    }
+    else
+    {
+        handle_Success();
+        out.put(static_cast<long long>(frame->sequence));
+        send_results(frame->results);
+    }
+    pipeline->release(frame);
+}
+
+void Server::handle_PipelineStop()
+{
+    // whatever is still in flight is finished and thrown away
+    stop_pipeline();
+    handle_Success();
+}
+
+void Server::send_clusters()
+{
+    send_results(detector.serialized_clusters());
+}
+
+void Server::send_results(const std::vector<unsigned char> &bytes)
+{
+    if (results_offset < 0)
+    {
+        out.write(bytes.data(), bytes.size());
+        return;
+    }
+
+    // only the length goes in the reply, -1 if the clusters didn't fit
+    long long length = -1;
+    if (shared.contains(results_offset, bytes.size()))
+    {
+        std::memcpy(shared.at(results_offset), bytes.data(), bytes.size());
+        length = bytes.size();
+    }
+    out.put(length);
+}
+
 void Server::handle_ImageRequest()
 {
     // not implemented (fully)
@@ -139,156 +599,538 @@ void Server::handle_ImageRequest()
         cv::Mat image(detector.get_image_main());
 
         // write the data in one shot
-        fwrite(image.data, 1, image.rows * image.cols, stdout);
-        fflush(stdout);
+        out.write(image.data, image.rows * image.cols);
     }
 }
 
 void Server::handle_NotImplemented()
 {
-    int temp = static_cast<int>(response_type::not_implemented);
-    fwrite(&temp, 4, 1, stdout);
-    fflush(stdout);
+    out.status(static_cast<int>(response_type::not_implemented));
 }
 
 void Server::handle_Success()
 {
-    int temp = static_cast<int>(response_type::success);
-    fwrite(&temp, 4, 1, stdout);
-    fflush(stdout);
+    // does nothing if the instruction has already failed
+    out.status(static_cast<int>(response_type::success));
 }
 
-void Server::listen_to_python(int mode)
+void Server::handle_Protocol(int version)
 {
-    if (mode == static_cast<int>(server_type::offline))
+    if (version != 1 && version != 2)
     {
-        while (1 < 2)
+        handle_BadInput("unknown protocol version.");
+        return;
+    }
+    // the reply still goes out the old way, everything after it is framed
+    framed = version == 2;
+    handle_Success();
+}
+
+void Server::handle_Stats(int reset, int enable)
+{
+    Stats &counters = global_stats();
+    if (enable >= 0)
+        counters.enable(enable != 0);
+
+    // one line of JSON, so python can readline it in either protocol version
+    std::ostringstream json;
+    json << "{\"enabled\": " << (counters.enabled() ? "true" : "false")
+         << ", \"stages\": " << counters.json()
+         << ", \"detector\": {\"memory_bytes\": " << detector.memory_bytes()
+         << ", \"workspace_bytes\": " << detector.workspace_bytes()
+         << ", \"workspace_peak_bytes\": " << detector.workspace_peak_bytes()
+         << "}}\n";
+    if (reset)
+        counters.reset();
+
+    handle_Success();
+    std::string text = json.str();
+    out.write(text.data(), text.size());
+}
+
+void Server::dispatch(unsigned int instruction, RequestReader &in)
+{
+    StageTimer timer{stage::request};
+
+    // if there are any arguments which we need to grab from the python end,
+    // grab them here and then pass them to the appropriate handler.
+    // if we don't need to grab any args, then just call the relevant handler
+    // right away. Handlers add to out, which is sent once we return
+    switch (instruction)
+    {
+    case imageRequest:
+    {
+        handle_ImageRequest();
+        break;
+    }
+    case loadFromFile:
+    {
+        // grab the path to the file, on its own line
+        std::string path = in.read_line();
+
+        handle_LoadFromFile(path);
+
+        // if execution reached here, return success
+        handle_Success();
+        break;
+    }
+    case loadFromPython:
+    {
+        // first we need to grab n_rows and n_cols
+        int n_rows, n_cols;
+        in.read(&n_rows, sizeof(n_rows));
+        in.read(&n_cols, sizeof(n_cols));
+        if (!check_image(n_rows, n_cols, in))
+            break;
+
+        // make a cv::Mat to store the data in (python sends uint8s)
+        cv::Mat temporary_image;
+        temporary_image.create(n_rows, n_cols, CV_8UC1);
+
+        // now we know how much data to read, read in the image
+        in.read(temporary_image.data, temporary_image.total());
+
+        // set temporary_image to be image_main
+        detector.set_image_main(temporary_image);
+        detector.is_open = true;
+
+        handle_Success();
+        break;
+    }
+    case runAlgorithm:
+    {
+        // every parameter comes in one go: equalization length, L, d,
+        // sigma, then the clustering engine, threads, eps and minPts
+        AlgorithmParams params;
+        int engine;
+        in.read(&params.equalize_length, sizeof(params.equalize_length));
+        in.read(&params.L, sizeof(params.L));
+        in.read(&params.d, sizeof(params.d));
+        in.read(&params.sigma, sizeof(params.sigma));
+        in.read(&engine, sizeof(engine));
+        in.read(&params.num_threads, sizeof(params.num_threads));
+        in.read(&params.eps, sizeof(params.eps));
+        in.read(&params.minPts, sizeof(params.minPts));
+        params.engine = static_cast<cluster_engine>(engine);
+
+        // one reply: success followed by the clusters
+        if (handle_RunAlgorithm(params))
         {
-            unsigned int instruction;
-            fread(&instruction, 4, 1, stdin);
-
-            // int temp = static_cast<int>()
-
-            // if there are any arguments which we need to grab from the python end,
-            // grab them here and then pass them to the appropriate handler.
-            // if we don't need to grab any args from stdin, then just call the
-            // relevant handler right away.
-            switch (instruction)
-            {
-            case imageRequest:
-            {
-                handle_ImageRequest();
-                break;
-            }
-            case loadFromFile:
-            {
-                // grab the path to the file from stdin
-                std::string path;
-                std::getline(std::cin, path);
-
-                handle_LoadFromFile(path);
-
-                // if execution reached here, return success
-                handle_Success();
-                break;
-            }
-            case loadFromPython:
-            {
-                // first we need to grab n_rows and n_cols from stdin
-                int n_rows, n_cols;
-                fread(&n_rows, sizeof(int), 1, stdin);
-                fread(&n_cols, sizeof(int), 1, stdin);
-
-                // make a cv::Mat to store the data in
-                cv::Mat temporary_image;
-                temporary_image.create(n_rows, n_cols, CV_32FC1);
-
-                // now we know how much data to read, read in the image
-                fread(temporary_image.data, 1, n_rows * n_cols, stdin);
-
-                // set temporary_image to be image_main
-                detector.set_image_main(temporary_image);
-                detector.is_open = true;
-
-                handle_Success();
-                break;
-            }
-            case runAlgorithm:
-            { // NOT IMPLEMENTED
-                handle_NotImplemented();
-                break;
-            }
-            case equalize:
-            {
-                // simply call the equalize method, more error checks needed
-                handle_Equalize();
-
-                // if execution reached here, return success
-                handle_Success();
-                break;
-            }
-            case calculateBackground:
-            {
-                // grab L parameter
-                int L;
-                fread(&L, 4, 1, stdin);
-                handle_CalculateBackground(L);
-
-                // if execution reached here, return success
-                handle_Success();
-                break;
-            }
-            case calculateSignal:
-            {
-                // int temp = static_cast<int>(response_type::error);
-                // fwrite(&temp, 4, 1, stdout);
-                // std::cout << "testing" << std::endl;
-                // fflush(stdout);
-                int d;
-                fread(&d, 4, 1, stdin);
-
-                handle_CalculateSignal(d);
-                // if execution reached here, return success
-                handle_Success();
-                break;
-            }
-            case calculateSignificance:
-            {
-                double sigma;
-
-                fread(&sigma, sizeof(double), 1, stdin);
-                handle_CalculateSignificance(sigma);
-
-                // if execution reached here, return success
-                handle_Success();
-                break;
-            }
-            case cluster:
-            {
-                handle_Cluster();
-
-                // if execution reached here, return success
-                handle_Success();
-
-                // now we should feed the python end the generated clusters
-                detector.print_clusters();
-                break;
-            }
-
-            default:
-                // if execution reaches here, request isn't implemented
-                int temp = static_cast<int>(response_type::not_implemented);
-                fwrite(&temp, 4, 1, stdout);
-                fflush(stdout);
-                std::cout << instruction << std::endl;
-                break;
-            }
+            handle_Success();
+            send_clusters();
         }
+        break;
     }
-    else
+    case equalize:
+    {
+        // simply call the equalize method, more error checks needed
+        handle_Equalize();
+
+        // if execution reached here, return success
+        handle_Success();
+        break;
+    }
+    case calculateBackground:
+    {
+        // grab L parameter
+        int L;
+        in.read(&L, sizeof(L));
+        handle_CalculateBackground(L);
+
+        // if execution reached here, return success
+        handle_Success();
+        break;
+    }
+    case calculateSignal:
     {
+        // int temp = static_cast<int>(response_type::error);
+        // fwrite(&temp, 4, 1, stdout);
+        // std::cout << "testing" << std::endl;
+        // fflush(stdout);
+        int d;
+        in.read(&d, sizeof(d));
+
+        handle_CalculateSignal(d);
+        // if execution reached here, return success
+        handle_Success();
+        break;
+    }
+    case calculateSignificance:
+    {
+        double sigma;
+
+        in.read(&sigma, sizeof(sigma));
+        handle_CalculateSignificance(sigma);
+
+        // if execution reached here, return success
+        handle_Success();
+        break;
+    }
+    case cluster:
+    {
+        handle_Cluster();
+
+        // if execution reached here, return success
+        handle_Success();
+
+        // now we should feed the python end the generated clusters
+        send_clusters();
+        break;
+    }
+    case equalizeTiled:
+    {
+        // grab the tile size and the number of threads to use
+        int tile, num_threads;
+        in.read(&tile, sizeof(tile));
+        in.read(&num_threads, sizeof(num_threads));
+        handle_EqualizeTiled(tile, num_threads);
+
+        // if execution reached here, return success
+        handle_Success();
+        break;
+    }
+    case detectSignificance:
+    {
+        // grab L, d, sigma and whether to keep image_L and image_d
+        int L, d, keep_intermediates;
+        double sigma;
+        in.read(&L, sizeof(L));
+        in.read(&d, sizeof(d));
+        in.read(&sigma, sizeof(sigma));
+        in.read(&keep_intermediates, sizeof(keep_intermediates));
+        handle_DetectSignificance(L, d, sigma, keep_intermediates != 0);
+
+        // if execution reached here, return success
+        handle_Success();
+        break;
+    }
+    case calculateBackgroundWith:
+    {
+        // grab L and which blur engine to use
+        int L, engine;
+        in.read(&L, sizeof(L));
+        in.read(&engine, sizeof(engine));
+        handle_CalculateBackground(L, engine);
+
+        // if execution reached here, return success
+        handle_Success();
+        break;
+    }
+    case calculateSignificanceExact:
+    {
+        // grab sigma and the stddev window (< 1 => background's L)
+        double sigma;
+        int window;
+        in.read(&sigma, sizeof(sigma));
+        in.read(&window, sizeof(window));
+        handle_CalculateSignificanceExact(sigma, window);
+
+        // if execution reached here, return success
+        handle_Success();
+        break;
+    }
+    case calculateSignificancePacked:
+    {
+        double sigma;
+
+        in.read(&sigma, sizeof(sigma));
+        handle_CalculateSignificancePacked(sigma);
+
+        // if execution reached here, return success
+        handle_Success();
+        break;
+    }
+    case clusterWith:
+    {
+        // grab which clustering engine to use
+        int engine;
+        in.read(&engine, sizeof(engine));
+        handle_Cluster(engine);
+
+        // if execution reached here, return success
+        handle_Success();
+
+        // now we should feed the python end the generated clusters
+        send_clusters();
+        break;
+    }
+
+    case clusterParallel:
+    {
+        // grab the clustering engine and how many threads to use
+        int engine;
+        int num_threads;
+        in.read(&engine, sizeof(engine));
+        in.read(&num_threads, sizeof(num_threads));
+        handle_Cluster(engine, num_threads);
+
+        // if execution reached here, return success
+        handle_Success();
+
+        // now we should feed the python end the generated clusters
+        send_clusters();
+        break;
+    }
+
+    case clusterGrid:
+    {
+        // grab eps, minPts and how many threads to use
+        int eps;
+        int minPts;
+        int num_threads;
+        in.read(&eps, sizeof(eps));
+        in.read(&minPts, sizeof(minPts));
+        in.read(&num_threads, sizeof(num_threads));
+        handle_ClusterGrid(eps, minPts, num_threads);
+
+        // if execution reached here, return success
+        handle_Success();
+
+        // now we should feed the python end the generated clusters
+        send_clusters();
+        break;
+    }
+
+    case workspaceBytes:
+    {
+        handle_WorkspaceBytes();
+        break;
+    }
+
+    case setClusterFormat:
+    {
+        // grab the format clusters should be sent in from now on
+        int format;
+        in.read(&format, sizeof(format));
+        handle_SetClusterFormat(format);
+        break;
+    }
+
+    case openShared:
+    {
+        // the segment's name on its own line, then its size
+        std::string name = in.read_line();
+        long long bytes;
+        in.read(&bytes, sizeof(bytes));
+        handle_OpenShared(name, bytes);
+        break;
+    }
+
+    case loadFromShared:
+    {
+        // the image is rows x cols uint8s at offset in the segment
+        int n_rows, n_cols;
+        long long offset;
+        in.read(&n_rows, sizeof(n_rows));
+        in.read(&n_cols, sizeof(n_cols));
+        in.read(&offset, sizeof(offset));
+        handle_LoadFromShared(n_rows, n_cols, offset);
+        break;
+    }
+
+    case imageToShared:
+    {
+        // which image (see image_type) and where to put it
+        int image;
+        long long offset;
+        in.read(&image, sizeof(image));
+        in.read(&offset, sizeof(offset));
+        handle_ImageToShared(image, offset);
+        break;
+    }
+
+    case setResultsShared:
+    {
+        long long offset;
+        in.read(&offset, sizeof(offset));
+        handle_SetResultsShared(offset);
+        break;
+    }
+
+    case useProtocol:
+    {
+        int version;
+        in.read(&version, sizeof(version));
+        handle_Protocol(version);
+        break;
+    }
+
+    case stats:
+    {
+        // whether to reset the stats once they've been read, and whether to
+        // turn recording on (1), off (0) or leave it be (-1)
+        int reset, enable;
+        in.read(&reset, sizeof(reset));
+        in.read(&enable, sizeof(enable));
+        handle_Stats(reset, enable);
+        break;
+    }
+
+    case pipelineStart:
+    {
+        // the same parameters as runAlgorithm, then how many frames may be
+        // in flight at once
+        AlgorithmParams params;
+        int engine, depth;
+        in.read(&params.equalize_length, sizeof(params.equalize_length));
+        in.read(&params.L, sizeof(params.L));
+        in.read(&params.d, sizeof(params.d));
+        in.read(&params.sigma, sizeof(params.sigma));
+        in.read(&engine, sizeof(engine));
+        in.read(&params.num_threads, sizeof(params.num_threads));
+        in.read(&params.eps, sizeof(params.eps));
+        in.read(&params.minPts, sizeof(params.minPts));
+        in.read(&depth, sizeof(depth));
+        params.engine = static_cast<cluster_engine>(engine);
+        handle_PipelineStart(params, depth);
+        break;
+    }
+
+    case pipelineSubmit:
+    {
+        // n_rows, n_cols then the uint8 pixels, as for loadFromPython
+        int n_rows, n_cols;
+        in.read(&n_rows, sizeof(n_rows));
+        in.read(&n_cols, sizeof(n_cols));
+        if (!check_image(n_rows, n_cols, in))
+            break;
+
+        // the pixels are always read, even if they can't be submitted, so
+        // the next instruction starts where it should
+        pipeline_input.resize(static_cast<std::size_t>(n_rows) * n_cols);
+        in.read(pipeline_input.data(), pipeline_input.size());
+        handle_PipelineSubmit(n_rows, n_cols);
+        break;
+    }
+
+    case pipelineCollect:
+    {
+        handle_PipelineCollect();
+        break;
+    }
+
+    case pipelineStop:
+    {
+        handle_PipelineStop();
+        break;
+    }
+
+    default:
+    {
+        // if execution reaches here, request isn't implemented
         handle_NotImplemented();
+        std::string line = std::to_string(instruction) + "\n";
+        out.write(line.data(), line.size());
+        break;
+    }
+    }
+    timer.bytes = out.size();
+}
+
+void Server::listen_to_python(int mode)
+{
+    if (mode != static_cast<int>(server_type::offline))
+    {
+        handle_NotImplemented();
+        out.send(stdout);
+        return;
+    }
+
+    // version 1: bare instructions, each reply sent as soon as it's ready
+    StreamReader stream{stdin};
+    while (!framed)
+    {
+        unsigned int instruction;
+        if (!stream.read(&instruction, sizeof(instruction)))
+            return; // python has gone away
+
+        out.clear();
+        dispatch(instruction, stream);
+        if (!stream.good())
+            return;
+        out.send(stdout);
+    }
+
+    listen_framed();
+}
+
+void Server::handle_frame(uint32_t opcode, const unsigned char *payload,
+                          std::size_t size)
+{
+    out.clear();
+    FrameReader request{payload, size};
+    dispatch(opcode, request);
+
+    if (!request.good())
+    {
+        // the handler read past the end of the payload, whatever it made
+        // of the missing arguments isn't worth sending
+        out.clear();
+        handle_BadInput("request payload too short.");
+    }
+    else if (memory_cap > 0 && held_bytes() > memory_cap)
+    {
+        clear_state();
+        out.clear();
+        handle_BadInput("session memory cap exceeded, detector state cleared.");
+    }
+    else if (out.empty())
+    {
+        handle_Success();
+    }
+}
+
+std::size_t Server::held_bytes() const
+{
+    return detector.memory_bytes() + (pipeline ? pipeline->memory_bytes() : 0) +
+           shared.size();
+}
+
+void Server::clear_state()
+{
+    // start again from nothing, keeping only the cluster format
+    cluster_format format = detector.get_cluster_format();
+    detector = Detector{};
+    detector.set_cluster_format(format);
+    stop_pipeline();
+}
+
+void Server::stop_pipeline()
+{
+    if (!pipeline)
+        return;
+    pipeline.reset();
+    if (pipeline_budget)
+        pipeline_budget->release();
+}
+
+void Server::listen_framed()
+{
+    std::vector<unsigned char> payload;
+    while (1 < 2)
+    {
+        FrameHeader header;
+        if (fread(&header, sizeof(header), 1, stdin) != 1)
+            return;
+
+        // the length covers the opcode and ID, so anything shorter (or
+        // absurdly long) means we've lost track of where frames start
+        if (header.length < sizeof(header) - 4 || header.length > max_frame_length)
+        {
+            out.clear();
+            handle_BadInput("bad frame length.");
+            out.send_frame(stdout, header.opcode, header.request_id);
+            return;
+        }
+
+        payload.resize(header.length - (sizeof(header) - 4));
+        if (!payload.empty() &&
+            fread(payload.data(), 1, payload.size(), stdin) != payload.size())
+            return;
+
+        handle_frame(header.opcode, payload.data(), payload.size());
+        out.send_frame(stdout, header.opcode, header.request_id);
     }
 }
 
-} // namespace rrec
\ No newline at end of file
+} // namespace rrec
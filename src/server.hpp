@@ -4,16 +4,78 @@
 #include <fstream>
 #include <vector>
 #include <string>
+#include <atomic>
+#include <cstdint>
+#include <memory>
 
 #include "detector.hpp"
+#include "pipeline.hpp"
+#include "protocol.hpp"
+#include "shm.hpp"
 
 namespace rrec
 {
+// How many pipelines (see pipelineStart) the servers sharing a budget may run
+// between them, and how many threads each pipeline's kernels may use. The
+// socket server's sessions share one, so however many clients start
+// pipelines the threads they get are bounded
+class PipelineBudget
+{
+  private:
+    std::atomic<int> running{0};
+    int max_pipelines;
+    int max_threads;
+
+  public:
+    PipelineBudget(int max_pipelines, int max_threads)
+        : max_pipelines{max_pipelines}, max_threads{max_threads}
+    {
+    }
+
+    // takes a pipeline's slot, false if they're all taken
+    bool acquire()
+    {
+        int n = running.load();
+        while (n < max_pipelines && !running.compare_exchange_weak(n, n + 1))
+        {
+        }
+        return n < max_pipelines;
+    }
+    void release() { running.fetch_sub(1); }
+
+    int threads() const { return max_threads; }
+};
+
 class Server
 {
   private:
     Detector detector;
 
+    // segment shared with python, see the openShared instruction
+    SharedMemory shared;
+    long long results_offset = -1; // where clusters go in shared, < 0 => stdout
+
+    // the reply to the instruction being handled, handlers add to it and it's
+    // sent once they're done
+    Response out;
+    bool framed = false; // protocol version 2, see protocol.hpp
+
+    // most the detector, pipeline and shared memory may hold after a
+    // request, 0 for no limit. Going over it throws the detector and
+    // pipeline's state away (see handle_frame)
+    std::size_t memory_cap = 0;
+
+    // frames being run through the pipelined engine, see pipelineStart.
+    // Submitted pixels are read into pipeline_input first
+    std::unique_ptr<FramePipeline> pipeline;
+    std::vector<unsigned char> pipeline_input;
+
+    // where pipeline's slot came from, if it's limited (see PipelineBudget)
+    PipelineBudget *pipeline_budget = nullptr;
+
+    // finishes and drops the pipeline, giving its slot back
+    void stop_pipeline();
+
     // these enums dictate the content of the incoming python request
     enum message_type
     {
@@ -25,7 +87,27 @@ class Server
         calculateBackground,
         calculateSignal,
         calculateSignificance,
-        cluster
+        cluster,
+        equalizeTiled,
+        detectSignificance,
+        calculateBackgroundWith,
+        calculateSignificanceExact,
+        calculateSignificancePacked,
+        clusterWith,
+        clusterParallel,
+        clusterGrid,
+        workspaceBytes,
+        setClusterFormat,
+        openShared,
+        loadFromShared,
+        imageToShared,
+        setResultsShared,
+        useProtocol,
+        stats,
+        pipelineStart,
+        pipelineSubmit,
+        pipelineCollect,
+        pipelineStop
     };
 
     enum class response_type
@@ -53,6 +135,7 @@ class Server
     Server();
     Server(std::string path);
     Server(std::string path, int rows, int cols);
+    ~Server();
 
     // all of the handlers implemented by the server
     void handle_BadInput(std::string err_msg);
@@ -61,15 +144,77 @@ class Server
     void handle_LoadFromFile(std::string path, int rows, int cols);
     void handle_LoadFromPython();
     void handle_Equalize();
+    void handle_EqualizeTiled(int tile, int num_threads);
     void handle_CalculateBackground(int L);
+    void handle_CalculateBackground(int L, int engine);
     void handle_CalculateSignal(int d);
     void handle_CalculateSignificance(double sigma);
+    void handle_CalculateSignificanceExact(double sigma, int window);
+    void handle_CalculateSignificancePacked(double sigma);
+    void handle_DetectSignificance(int L, int d, double sigma,
+                                   bool keep_intermediates);
     void handle_Cluster();
+    void handle_Cluster(int engine);
+    void handle_Cluster(int engine, int num_threads);
+    void handle_ClusterGrid(int eps, int minPts, int num_threads);
+    void handle_WorkspaceBytes();
+    void handle_SetClusterFormat(int format);
+    void handle_OpenShared(std::string name, long long bytes);
+    void handle_LoadFromShared(int rows, int cols, long long offset);
+    void handle_ImageToShared(int image, long long offset);
+    void handle_SetResultsShared(long long offset);
+    void handle_Protocol(int version);
+    void handle_Stats(int reset, int enable);
+    bool handle_RunAlgorithm(const AlgorithmParams &params); // false on error
+    void handle_PipelineStart(const AlgorithmParams &params, int depth);
+    void handle_PipelineSubmit(int rows, int cols);
+    void handle_PipelineCollect();
+    void handle_PipelineStop();
+
+    // handle_BadInput and false if run_algorithm can't take params
+    bool check_params(const AlgorithmParams &params);
+
+    // handle_BadInput and false unless a rows x cols uint8 image is really
+    // what's left of in and would fit under the memory cap, so a request
+    // can't make us allocate more than it sent
+    bool check_image(int rows, int cols, RequestReader &in);
+
+    // what the detector, pipeline and shared memory hold, see memory_cap
+    std::size_t held_bytes() const;
+
+    // adds the clusters to the reply, or puts them in the shared memory
+    // segment if python asked for results there (then only their length goes
+    // in the reply)
+    void send_clusters();
+    void send_results(const std::vector<unsigned char> &bytes); // the same
     void handle_FourierPrep();    // writes in smtest file format
     void handle_NotImplemented(); // called in place of NI methods
     void handle_Success();        // called after success
 
-    // listens to stdin and calls an appropriate handler depending on input
+    // grabs the instruction's arguments from in and calls its handler
+    void dispatch(unsigned int instruction, RequestReader &in);
+
+    // handles one version 2 request, leaving its reply in reply()
+    void handle_frame(uint32_t opcode, const unsigned char *payload,
+                      std::size_t size);
+    const Response &reply() const { return out; }
+    // makes the reply an error without handling anything
+    void reject(const std::string &message)
+    {
+        out.clear();
+        handle_BadInput(message);
+    }
+    void set_memory_cap(std::size_t bytes) { memory_cap = bytes; }
+    // limits pipelineStart to budget's slots and threads, which must outlive
+    // the server. Without one a pipeline can have any number of threads
+    void set_pipeline_budget(PipelineBudget *budget) { pipeline_budget = budget; }
+    // throws away the detector's images and clusters and stops the pipeline,
+    // the cluster format and shared memory are kept
+    void clear_state();
+
+    // listens to stdin and calls an appropriate handler depending on input,
+    // switching to listen_framed if python asks for protocol version 2
     void listen_to_python(int mode);
+    void listen_framed();
 };
 } // namespace rrec
\ No newline at end of file
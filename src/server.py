@@ -1,6 +1,13 @@
 import struct
 import subprocess
 import atexit
+import errno
+import fcntl
+import json
+import mmap
+import os
+import select
+import socket
 
 import numpy as np
 
@@ -25,43 +32,251 @@ class Server(object):
     calculateSignal = struct.pack('i', 6)
     calculateSignificance = struct.pack('i', 7)
     cluster = struct.pack('i', 8)
+    equalizeTiled = struct.pack('i', 9)
+    detectSignificance = struct.pack('i', 10)
+    calculateBackgroundWith = struct.pack('i', 11)
+    calculateSignificanceExact = struct.pack('i', 12)
+    calculateSignificancePacked = struct.pack('i', 13)
+    clusterWith = struct.pack('i', 14)
+    clusterParallel = struct.pack('i', 15)
+    clusterGrid = struct.pack('i', 16)
+    workspaceBytes = struct.pack('i', 17)
+    setClusterFormat = struct.pack('i', 18)
+    openShared = struct.pack('i', 19)
+    loadFromShared = struct.pack('i', 20)
+    imageToShared = struct.pack('i', 21)
+    setResultsShared = struct.pack('i', 22)
+    useProtocol = struct.pack('i', 23)
+    stats = struct.pack('i', 24)
+    pipelineStart = struct.pack('i', 25)
+    pipelineSubmit = struct.pack('i', 26)
+    pipelineCollect = struct.pack('i', 27)
+    pipelineStop = struct.pack('i', 28)
 
-    def __init__(self, mode=local, binary=None):
-        # if mode is local, run the subprocess binary on local machine
+    # images understood by imageToShared
+    mainImage = 0
+    clusteredImage = 1
+    backgroundImage = 2
+    signalImage = 3
+
+    # blur engines understood by calculateBackgroundWith
+    opencvBlur = 0
+    recursiveBlur = 1
+
+    # clustering engines understood by clusterWith/clusterParallel
+    dbscanEngine = 0
+    unionFindEngine = 1
+    gridEngine = 2 # eps = 3, minPts = 4, see clusterGrid for other values
+
+    # cluster formats understood by setClusterFormat
+    pointsFormat = 0
+    spansFormat = 1
+    summaryFormat = 2
+    compactFormat = 3
+
+    def __init__(self, mode=local, binary=None, address=None):
+        # if mode is local, run the subprocess binary on local machine. If
+        # it's online, connect to the server already listening on the unix
+        # socket at address (see b.out --socket)
         self.mode = mode
         if mode == Server.local:
             self.process = subprocess.Popen("./" + binary,
                                             stdin=subprocess.PIPE,
                                             stdout=subprocess.PIPE)
+            self._writer = self.process.stdin
+            self._reader = self.process.stdout
+
+            # kill subprocess on program termination
+            atexit.register(lambda: self.process.kill())
+        elif mode == Server.online:
+            self._socket = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            self._socket.connect(address)
+            self._writer = self._socket.makefile('wb', 0)
+            self._reader = self._socket.makefile('rb')
         else:
-            # for now, throw an error if the mode is set to be anything else
-            print "Set mode='local', mode='online' has not yet been implemented"
+            print "Set mode='local' or mode='online'"
             print "exiting..."
             exit()
 
-        # kill subprocess on program termination
-        atexit.register(lambda: self.process.kill())
+        # shared memory segment, see open_shared_memory
+        self._shm = None
+        self._results_offset = None
+
+        # protocol version 2 state, see use_framed_protocol. The socket
+        # server only speaks version 2
+        self._framed = False
+        self._next_id = 0
+        self._pending = None   # [opcode, payload pieces] not yet sent
+        self._reply = ''       # the reply read() and readline() serve from
+        self._reply_pos = 0
+        self._responses = {}   # replies that arrived before they were wanted
+        self._inbox = bytearray()  # bytes read that aren't a whole reply yet
+        if mode == Server.online:
+            self._start_framing()
 
     def request(self, message):
         """
-        Sends an ascii message to the stdin of the C++ backend.
+        Sends an ascii message to the stdin of the C++ backend. When framed,
+        it's added to the frame started by _send_instruction instead.
         """
-        if self.mode == Server.local:
-            return self.process.stdin.write(message)
+        if self._framed:
+            self._pending[1].append(message)
+            return
+        return self._writer.write(message)
 
     def read(self, num_chars):
         """
         Reads num_chars characters from the C++ backend's stdout file.
         """
-        if self.mode == Server.local:
-            return self.process.stdout.read(num_chars)
+        if self._framed:
+            self._await_reply()
+            data = self._reply[self._reply_pos:self._reply_pos + num_chars]
+            self._reply_pos += len(data)
+            return data
+        return self._reader.read(num_chars)
 
     def readline(self):
         """
         Reads a line from the C++ backend's stdout file.
         """
-        if self.mode == Server.local:
-            return self.process.stdout.readline()
+        if self._framed:
+            self._await_reply()
+            end = self._reply.find('\n', self._reply_pos)
+            end = len(self._reply) if end < 0 else end + 1
+            data = self._reply[self._reply_pos:end]
+            self._reply_pos = end
+            return data
+        return self._reader.readline()
+
+    def get_stats(self, reset=False, enable=None):
+        """
+        Returns the C++ end's per-stage timings as a dict: for each stage
+        (load, equalize, ..., request) the number of calls, total time, bytes
+        processed and p50/p99/max latency in ns, plus how much memory its
+        detector holds. enable turns recording on or off (it's off unless
+        b.out was started with RREC_STATS set), reset clears the counters
+        once they've been read.
+        """
+        self._send_instruction(Server.stats)
+        self.request(struct.pack('ii', int(reset),
+                                 -1 if enable is None else int(enable)))
+
+        response = self.read(4)
+        if response != Server.success:
+            print "(PYTHON): Error in get_stats"
+            print struct.unpack('i', response)[0]
+            print self.readline()
+            return
+        return json.loads(self.readline())
+
+    def use_framed_protocol(self):
+        """
+        Switches to protocol version 2, where every request and reply is a
+        frame carrying its length, opcode and a request ID. Every other method
+        works as before, but submit() and collect() can also be used to have
+        many requests in flight at once and collect their replies in any
+        order. Replies that come back while submit() is still writing are
+        read and kept until they're collected, so the two ends can't end up
+        waiting on each other. Returns True on success.
+        """
+        self._send_instruction(Server.useProtocol)
+        self.request(struct.pack('i', 2))
+        response = self.read(4)
+        if response != Server.success:
+            print "(PYTHON): Error in use_framed_protocol"
+            print struct.unpack('i', response)[0]
+            print self.readline()
+            return False
+        self._start_framing()
+        return True
+
+    def _start_framing(self):
+        """
+        From here on every request and reply is a frame. They go straight
+        through the file descriptors (never the file objects' buffers), with
+        writes made non-blocking so submit() can read while it writes.
+        """
+        self._framed = True
+        self._in_fd = self._reader.fileno()
+        self._out_fd = self._writer.fileno()
+        flags = fcntl.fcntl(self._out_fd, fcntl.F_GETFL)
+        fcntl.fcntl(self._out_fd, fcntl.F_SETFL, flags | os.O_NONBLOCK)
+
+    def submit(self, instruction, payload=''):
+        """
+        Sends a framed request without waiting for the reply, and returns its
+        request ID for collect(). Any replies that arrive while it's being
+        written are read and kept for collect().
+        """
+        request_id = self._next_id
+        self._next_id = (self._next_id + 1) & 0xffffffff
+
+        # the length covers the opcode and the ID as well as the payload
+        header = struct.pack('=III', 8 + len(payload),
+                             struct.unpack('I', instruction)[0], request_id)
+
+        # the C++ end stops reading while its replies aren't being read, so
+        # with many requests in flight writing alone could block for ever
+        data = memoryview(header + payload)
+        while len(data) > 0:
+            readable, writable, _ = select.select([self._in_fd],
+                                                  [self._out_fd], [])
+            if readable:
+                self._receive()
+            if writable:
+                try:
+                    data = data[os.write(self._out_fd, data):]
+                except OSError as e:
+                    if e.errno not in (errno.EAGAIN, errno.EINTR):
+                        raise
+        return request_id
+
+    def collect(self, request_id):
+        """
+        Waits for the reply to a submitted request and returns its status
+        (Server.success etc) and the rest of its payload. Replies to other
+        requests which arrive first are kept for when they're collected.
+        """
+        while request_id not in self._responses:
+            select.select([self._in_fd], [], [])
+            self._receive()
+        reply = self._responses.pop(request_id)
+        return reply[:4], reply[4:]
+
+    def _receive(self):
+        """
+        Reads what the C++ end has sent, and keeps any whole replies in it
+        under their request IDs until they're collected.
+        """
+        try:
+            data = os.read(self._in_fd, 1 << 20)
+        except OSError as e:
+            if e.errno in (errno.EAGAIN, errno.EINTR):
+                return
+            raise
+        if not data:
+            raise IOError("the C++ end has gone")
+
+        self._inbox += data
+        while len(self._inbox) >= 12:
+            length, opcode, reply_id = struct.unpack_from('=III', self._inbox)
+            if len(self._inbox) < 4 + length:
+                break
+            self._responses[reply_id] = bytes(self._inbox[12:4 + length])
+            del self._inbox[:4 + length]
+
+    def _await_reply(self):
+        """
+        Sends the frame built up by _send_instruction and request(), if there
+        is one, and makes its reply the one read() and readline() serve from.
+        """
+        if self._pending is None:
+            return
+        instruction, pieces = self._pending
+        self._pending = None
+        status, payload = self.collect(self.submit(instruction, ''.join(pieces)))
+        self._reply = status + payload
+        self._reply_pos = 0
 
     def load_array(self, array):
         """
@@ -124,6 +339,111 @@ class Server(object):
                           (num_rows, num_cols),
                           order='C')
 
+    def open_shared_memory(self, num_bytes, name=None):
+        """
+        Makes the C++ end create a num_bytes POSIX shared memory segment and
+        maps it here too. Images and clusters can then be passed through it
+        (see load_shared, image_shared and set_results_shared) rather than
+        being copied through the pipes. Returns True on success.
+        """
+        if name is None:
+            name = "/rrec.%d.%d" % (os.getpid(), id(self))
+
+        self._send_instruction(Server.openShared)
+        self.request(name + '\n')
+        self.request(struct.pack('q', num_bytes))
+
+        response = self.read(4)
+        if response != Server.success:
+            print "(PYTHON): Error in open_shared_memory"
+            print struct.unpack('i', response)[0]
+            print self.readline()
+            return False
+
+        # on linux shm_open's segments live in /dev/shm
+        path = "/dev/shm/" + name.lstrip('/')
+        try:
+            with open(path, 'r+b') as f:
+                self._shm = mmap.mmap(f.fileno(), num_bytes)
+        except (IOError, OSError, mmap.error) as e:
+            print "(PYTHON): Error in open_shared_memory"
+            print e
+            return False
+        finally:
+            # the name can go whether or not we got it mapped (the memory
+            # itself is freed once both ends unmap it, even if we're killed).
+            # The C++ end unlinks it too when it closes it, so it may be gone
+            try:
+                os.unlink(path)
+            except OSError:
+                pass
+        return True
+
+    def shared_array(self, shape, dtype=np.uint8, offset=0):
+        """
+        A numpy array viewing the shared memory segment at offset. Nothing is
+        copied: writes to it are seen by the C++ end and vice versa.
+        """
+        return np.ndarray(shape, dtype=dtype, buffer=self._shm, offset=offset)
+
+    def load_shared(self, array=None, shape=None, offset=0):
+        """
+        Loads the C++ code's main image from the shared memory segment. Either
+        write the frame straight into shared_array(shape, offset=offset) and
+        pass its shape, or pass a uint8 array to have it copied in first.
+        """
+        if array is not None:
+            assert array.dtype == np.uint8, \
+                "args to load_shared must have dtype uint8"
+            shape = array.shape
+            self.shared_array(shape, offset=offset)[...] = array
+
+        self._send_instruction(Server.loadFromShared)
+        self.request(struct.pack('=iiq', shape[0], shape[1], offset))
+
+        response = self.read(4)
+        if response != Server.success:
+            print "(PYTHON): Error in load_shared"
+            print struct.unpack('i', response)[0]
+            print self.readline()
+
+    def image_shared(self, image=mainImage, offset=0):
+        """
+        Has the C++ end copy one of its images (Server.mainImage,
+        clusteredImage, backgroundImage or signalImage) into the shared memory
+        segment at offset, and returns a numpy view of it.
+        """
+        self._send_instruction(Server.imageToShared)
+        self.request(struct.pack('=iq', image, offset))
+
+        response = self.read(4)
+        if response != Server.success:
+            print "(PYTHON): Error in image_shared"
+            print struct.unpack('i', response)[0]
+            print self.readline()
+            return
+
+        rows, cols, element_size = struct.unpack('iii', self.read(12))
+        dtype = np.uint8 if element_size == 1 else np.float32
+        return self.shared_array((rows, cols), dtype, offset)
+
+    def set_results_shared(self, offset):
+        """
+        Clusters are written into the shared memory segment at offset from now
+        on, with only their length sent through the pipe. None goes back to
+        sending them through the pipe.
+        """
+        self._send_instruction(Server.setResultsShared)
+        self.request(struct.pack('q', -1 if offset is None else offset))
+
+        response = self.read(4)
+        if response != Server.success:
+            print "(PYTHON): Error in set_results_shared"
+            print struct.unpack('i', response)[0]
+            print self.readline()
+        else:
+            self._results_offset = offset
+
     def _send_instruction(self, instruction):
         """
         Sends a single integer instruction to the C++ backend.
@@ -132,4 +452,9 @@ class Server(object):
         if len(instruction) != 4:
             raise ValueError(
                 "Incorrect instruction length, do not call the _send_instruction method manually")
+        if self._framed:
+            # the arguments follow with request(), the frame goes out once
+            # the reply is read
+            self._pending = [instruction, []]
+            return
         self.request(instruction)
@@ -0,0 +1,62 @@
+#include "shm.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace rrec
+{
+
+SharedMemory::SharedMemory() : base{nullptr}, length{0} {}
+
+SharedMemory::~SharedMemory() { close(); }
+
+bool SharedMemory::open(const std::string &name, std::size_t bytes)
+{
+    close();
+    if (bytes == 0)
+        return false;
+
+    // only ever a new segment: opening one that already exists would let
+    // whoever made it (another session, say) resize it under our feet
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+        return false;
+
+    if (ftruncate(fd, static_cast<off_t>(bytes)) != 0)
+    {
+        ::close(fd);
+        shm_unlink(name.c_str());
+        return false;
+    }
+
+    void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    // the mapping keeps the segment alive, the descriptor isn't needed
+    ::close(fd);
+    if (p == MAP_FAILED)
+    {
+        shm_unlink(name.c_str());
+        return false;
+    }
+
+    segment_name = name;
+    base = static_cast<unsigned char *>(p);
+    length = bytes;
+    return true;
+}
+
+void SharedMemory::close()
+{
+    if (base)
+        munmap(base, length);
+    // python unlinks it as soon as it has it mapped too, but if it never got
+    // that far the name would outlive us. Gone already is fine
+    if (!segment_name.empty())
+        shm_unlink(segment_name.c_str());
+    base = nullptr;
+    length = 0;
+    segment_name.clear();
+}
+
+} // namespace rrec
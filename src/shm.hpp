@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+namespace rrec
+{
+// A POSIX shared memory segment (shm_open + mmap). The Server creates one
+// when python asks for it, and then images and results are passed through it
+// by offset and length instead of through the stdin/stdout pipes
+class SharedMemory
+{
+  private:
+    std::string segment_name;
+    unsigned char *base;
+    std::size_t length;
+
+  public:
+    SharedMemory();
+    ~SharedMemory();
+
+    SharedMemory(const SharedMemory &) = delete;
+    SharedMemory &operator=(const SharedMemory &) = delete;
+
+    // creates the segment called name (e.g. "/rrec.1234"), sizes it to bytes
+    // and maps it. Any segment already open is closed first. Returns false if
+    // any step fails, including a segment called name already existing
+    bool open(const std::string &name, std::size_t bytes);
+
+    // unmaps the segment and unlinks its name, if nobody has yet
+    void close();
+
+    bool is_open() const { return base != nullptr; }
+    const std::string &name() const { return segment_name; }
+    std::size_t size() const { return length; }
+
+    // true if [offset, offset + bytes) lies inside the segment
+    bool contains(std::size_t offset, std::size_t bytes) const
+    {
+        return is_open() && offset <= length && bytes <= length - offset;
+    }
+
+    unsigned char *data() { return base; }
+    unsigned char *at(std::size_t offset) { return base + offset; }
+};
+} // namespace rrec
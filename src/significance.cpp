@@ -0,0 +1,506 @@
+#include "significance.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// the SIMD kernels for the table lookup are built for their own instruction
+// sets whatever the build targets, and picked at run time (see pick_kernel)
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RREC_SIGNIFICANCE_DISPATCH
+#include <immintrin.h>
+#endif
+
+#include "gaussian.hpp"
+#include "parallel.hpp"
+
+namespace rrec
+{
+
+SignificanceTable::SignificanceTable(double sigma) : sigma{sigma}, exact{true}
+{
+    for (int b = 0; b < 256; ++b)
+    {
+        // for an integer signal s, s > t <=> s > floor(t)
+        double t = std::floor(significance_threshold(b, sigma));
+        if (t < 0)
+        {
+            exact = false;
+            limit[b] = 0;
+        }
+        else
+        {
+            limit[b] = t > 255 ? 255 : static_cast<unsigned char>(t);
+        }
+    }
+}
+
+namespace
+{
+#if defined(RREC_SIGNIFICANCE_DISPATCH)
+// a SIMD kernel does as many whole vectors of pixels as fit in n, and
+// returns how many pixels that was. limit is SignificanceTable::limit
+using RowKernel = int (*)(const unsigned char *signal,
+                          const unsigned char *background, unsigned char *out,
+                          int n, const unsigned char *limit);
+
+// the 256 entry table is looked up as 16 pshufb lookups of 16 entries, one
+// per high nibble, each masked by whether the background's high nibble
+// matches
+__attribute__((target("avx2"))) int
+significance_avx2(const unsigned char *signal, const unsigned char *background,
+                  unsigned char *out, int n, const unsigned char *table_limit)
+{
+    __m256i chunks[16];
+    for (int k = 0; k < 16; ++k)
+        chunks[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128(
+            reinterpret_cast<const __m128i *>(table_limit + 16 * k)));
+    const __m256i low_mask = _mm256_set1_epi8(0x0F);
+
+    int j = 0;
+    for (; j + 32 <= n; j += 32)
+    {
+        __m256i bg = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i *>(background + j));
+        __m256i sig = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i *>(signal + j));
+        __m256i lo = _mm256_and_si256(bg, low_mask);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(bg, 4), low_mask);
+
+        __m256i limit = _mm256_setzero_si256();
+        for (int k = 0; k < 16; ++k)
+        {
+            __m256i select = _mm256_cmpeq_epi8(hi, _mm256_set1_epi8(k));
+            limit = _mm256_or_si256(
+                limit,
+                _mm256_and_si256(select, _mm256_shuffle_epi8(chunks[k], lo)));
+        }
+
+        // unsigned sig > limit <=> min(sig, limit) != sig
+        __m256i not_above = _mm256_cmpeq_epi8(_mm256_min_epu8(sig, limit), sig);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + j),
+                            _mm256_xor_si256(not_above, _mm256_set1_epi8(-1)));
+    }
+    return j;
+}
+
+// same as above, 16 pixels at a time
+__attribute__((target("ssse3"))) int
+significance_ssse3(const unsigned char *signal, const unsigned char *background,
+                   unsigned char *out, int n, const unsigned char *table_limit)
+{
+    __m128i chunks[16];
+    for (int k = 0; k < 16; ++k)
+        chunks[k] = _mm_loadu_si128(
+            reinterpret_cast<const __m128i *>(table_limit + 16 * k));
+    const __m128i low_mask = _mm_set1_epi8(0x0F);
+
+    int j = 0;
+    for (; j + 16 <= n; j += 16)
+    {
+        __m128i bg = _mm_loadu_si128(
+            reinterpret_cast<const __m128i *>(background + j));
+        __m128i sig = _mm_loadu_si128(
+            reinterpret_cast<const __m128i *>(signal + j));
+        __m128i lo = _mm_and_si128(bg, low_mask);
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(bg, 4), low_mask);
+
+        __m128i limit = _mm_setzero_si128();
+        for (int k = 0; k < 16; ++k)
+        {
+            __m128i select = _mm_cmpeq_epi8(hi, _mm_set1_epi8(k));
+            limit = _mm_or_si128(
+                limit, _mm_and_si128(select, _mm_shuffle_epi8(chunks[k], lo)));
+        }
+
+        __m128i not_above = _mm_cmpeq_epi8(_mm_min_epu8(sig, limit), sig);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + j),
+                         _mm_xor_si128(not_above, _mm_set1_epi8(-1)));
+    }
+    return j;
+}
+
+// the widest kernel the CPU we're running on has, so a default (plain
+// x86-64) build still gets them. nullptr if it has neither
+RowKernel pick_kernel()
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return significance_avx2;
+    if (__builtin_cpu_supports("ssse3"))
+        return significance_ssse3;
+    return nullptr;
+}
+#endif
+} // namespace
+
+void significance_row(const unsigned char *signal,
+                      const unsigned char *background, unsigned char *out,
+                      int n, const SignificanceTable &table)
+{
+    int j = 0;
+
+    if (!table.exact)
+    {
+        for (; j < n; ++j)
+            out[j] = signal[j] > significance_threshold(background[j],
+                                                        table.sigma)
+                         ? 255
+                         : 0;
+        return;
+    }
+
+#if defined(RREC_SIGNIFICANCE_DISPATCH)
+    static const RowKernel kernel = pick_kernel();
+    if (kernel)
+        j = kernel(signal, background, out, n, table.limit);
+#endif
+
+    for (; j < n; ++j)
+        out[j] = signal[j] > table.limit[background[j]] ? 255 : 0;
+}
+
+void table_significance(const cv::Mat &signal, const cv::Mat &background,
+                        cv::Mat &mask, double sigma)
+{
+    int rows = signal.rows;
+    int cols = signal.cols;
+    mask.create(rows, cols, CV_8UC1);
+
+    SignificanceTable table(sigma);
+
+    // if all images are stored continuously in memory then treat them as one
+    // long row
+    if (signal.isContinuous() && background.isContinuous() &&
+        mask.isContinuous())
+    {
+        cols *= rows;
+        rows = 1;
+    }
+
+    for (int i = 0; i < rows; ++i)
+        significance_row(signal.ptr<unsigned char>(i),
+                         background.ptr<unsigned char>(i),
+                         mask.ptr<unsigned char>(i), cols, table);
+}
+
+void table_significance(const cv::Mat &signal, const cv::Mat &background,
+                        PackedMask &mask, double sigma)
+{
+    int rows = signal.rows;
+    int cols = signal.cols;
+    mask.create(rows, cols);
+
+    SignificanceTable table(sigma);
+
+    // one row of bytes at a time, packed as soon as it's written
+    std::vector<unsigned char> bytes(cols);
+    for (int i = 0; i < rows; ++i)
+    {
+        significance_row(signal.ptr<unsigned char>(i),
+                         background.ptr<unsigned char>(i), bytes.data(), cols,
+                         table);
+        PackedMask::pack_row(bytes.data(), mask.row(i), cols);
+    }
+}
+
+void reference_significance(const cv::Mat &signal, const cv::Mat &background,
+                            cv::Mat &mask, double sigma)
+{
+    int rows = signal.rows;
+    int cols = signal.cols;
+    mask.create(rows, cols, CV_8UC1);
+
+    // the mean of the uniform distribution the original picture was eq'd to
+    double mu = 127.5;
+
+    for (int i = 0; i < rows; ++i)
+    {
+        const unsigned char *imgPointer = signal.ptr<unsigned char>(i);
+        const unsigned char *brightnessPointer = background.ptr<unsigned char>(i);
+        unsigned char *thresholdPointer = mask.ptr<unsigned char>(i);
+
+        for (int j = 0; j < cols; ++j)
+        {
+            double difference;
+            double stdDev;
+            if (brightnessPointer[j] > mu)
+            {
+                difference = brightnessPointer[j] - mu;
+            }
+            else
+            {
+                difference = -brightnessPointer[j] + mu;
+            }
+
+            // linearly interpolated local stddev, see significance_threshold
+            stdDev = 73.9 * (1 - difference / 127.5) * sigma;
+
+            if (imgPointer[j] > brightnessPointer[j] + stdDev / 2)
+                thresholdPointer[j] = 255;
+            else
+                thresholdPointer[j] = 0;
+        }
+    }
+}
+
+namespace
+{
+// significance of one row given the window sums and 1 / (# pixels in window)
+void exact_row(const double *window_sum, const double *window_sq,
+               const double *inv_n, const unsigned char *sig,
+               const unsigned char *bg, unsigned char *out, int n, double sigma)
+{
+    if (sigma >= 0)
+    {
+        // sig > bg + k * stddev <=> sig > bg && (sig - bg)^2 > k^2 var for
+        // k >= 0, which avoids a sqrt per pixel and vectorises
+        double k2 = sigma * sigma / 4;
+        for (int j = 0; j < n; ++j)
+        {
+            double mean = window_sum[j] * inv_n[j];
+            double variance = window_sq[j] * inv_n[j] - mean * mean;
+            double difference = static_cast<double>(sig[j]) - bg[j];
+            out[j] = ((difference > 0) &
+                      (difference * difference > k2 * variance))
+                         ? 255
+                         : 0;
+        }
+    }
+    else
+    {
+        for (int j = 0; j < n; ++j)
+        {
+            double mean = window_sum[j] * inv_n[j];
+            double variance = std::max(window_sq[j] * inv_n[j] - mean * mean,
+                                       0.0);
+            double threshold = bg[j] + sigma * std::sqrt(variance) / 2;
+            out[j] = sig[j] > threshold ? 255 : 0;
+        }
+    }
+}
+} // namespace
+
+void exact_significance(const cv::Mat &image, const cv::Mat &signal,
+                        const cv::Mat &background, cv::Mat &mask, int window,
+                        double sigma, int num_threads)
+{
+    int rows = image.rows;
+    int cols = image.cols;
+    int half = std::max(window, 1) / 2;
+    mask.create(rows, cols, CV_8UC1);
+
+    parallel_for(rows, num_threads, [&](int begin, int end) {
+        // sums of the pixels (and their squares) in each column over the
+        // window's rows, and of the window itself for every pixel on the row
+        std::vector<long long> col_sum(cols, 0), col_sq(cols, 0);
+        std::vector<double> window_sum(cols), window_sq(cols), inv_n(cols);
+
+        // 1 / (# of columns in the window) for every column
+        std::vector<double> inv_cols(cols);
+        for (int j = 0; j < cols; ++j)
+            inv_cols[j] = 1.0 / (std::min(j + half, cols - 1) -
+                                 std::max(j - half, 0) + 1);
+
+        auto add_row = [&](int a, int sign) {
+            const unsigned char *p = image.ptr<unsigned char>(a);
+            for (int j = 0; j < cols; ++j)
+            {
+                col_sum[j] += sign * p[j];
+                col_sq[j] += sign * p[j] * p[j];
+            }
+        };
+
+        // prime the column sums with the rows above this band's first row
+        for (int a = std::max(begin - half, 0);
+             a <= std::min(begin + half - 1, rows - 1); ++a)
+            add_row(a, 1);
+
+        for (int i = begin; i < end; ++i)
+        {
+            // (the band's first row has nothing above the primed rows to drop)
+            if (i > begin && i - half - 1 >= 0)
+                add_row(i - half - 1, -1);
+            if (i + half < rows)
+                add_row(i + half, 1);
+
+            int window_rows = std::min(i + half, rows - 1) -
+                              std::max(i - half, 0) + 1;
+
+            // slide the window across the row. This part is inherently serial,
+            // so it only gathers the sums; the arithmetic happens below. The
+            // window first grows (left edge clipped), then slides, then
+            // shrinks (right edge clipped)
+            long long sum = 0, sq = 0;
+            int j = 0;
+            for (int b = 0; b < std::min(half, cols); ++b)
+            {
+                sum += col_sum[b];
+                sq += col_sq[b];
+            }
+            for (; j < cols && j - half - 1 < 0; ++j)
+            {
+                if (j + half < cols)
+                {
+                    sum += col_sum[j + half];
+                    sq += col_sq[j + half];
+                }
+                window_sum[j] = static_cast<double>(sum);
+                window_sq[j] = static_cast<double>(sq);
+            }
+            for (; j + half < cols; ++j)
+            {
+                sum += col_sum[j + half] - col_sum[j - half - 1];
+                sq += col_sq[j + half] - col_sq[j - half - 1];
+                window_sum[j] = static_cast<double>(sum);
+                window_sq[j] = static_cast<double>(sq);
+            }
+            for (; j < cols; ++j)
+            {
+                sum -= col_sum[j - half - 1];
+                sq -= col_sq[j - half - 1];
+                window_sum[j] = static_cast<double>(sum);
+                window_sq[j] = static_cast<double>(sq);
+            }
+
+            double inv_rows = 1.0 / window_rows;
+            for (int j = 0; j < cols; ++j)
+                inv_n[j] = inv_cols[j] * inv_rows;
+
+            const unsigned char *bg = background.ptr<unsigned char>(i);
+            const unsigned char *sig = signal.ptr<unsigned char>(i);
+            unsigned char *out = mask.ptr<unsigned char>(i);
+            exact_row(window_sum.data(), window_sq.data(), inv_n.data(), sig,
+                      bg, out, cols, sigma);
+        }
+    });
+}
+
+namespace
+{
+// horizontally blurred rows for one of the two kernels, indexed by (virtual,
+// i.e. unreflected) row number modulo the kernel size
+struct BlurRing
+{
+    std::vector<float> kernel;
+    int radius;
+    int next; // next virtual row which needs blurring
+    std::vector<float> rows;
+
+    BlurRing(int ksize, int cols, int first_row)
+        : kernel(gaussian_kernel(ksize)), radius(ksize / 2),
+          next(first_row - ksize / 2),
+          rows(static_cast<size_t>(ksize) * cols)
+    {
+    }
+
+    float *row(int a, int cols)
+    {
+        int k = static_cast<int>(kernel.size());
+        return &rows[static_cast<size_t>(((a % k) + k) % k) * cols];
+    }
+};
+
+// blurs the padded row horizontally into out
+void blur_row(const float *padded, int pad, int cols, const BlurRing &ring,
+              float *out)
+{
+    const float *w = ring.kernel.data();
+    int r = ring.radius;
+    const float *centre = padded + pad;
+
+    for (int j = 0; j < cols; ++j)
+        out[j] = w[r] * centre[j];
+
+    // the kernel is symmetric, so fold each pair of taps into one multiply
+    for (int a = 1; a <= r; ++a)
+    {
+        float weight = w[r + a];
+        const float *left = centre - a;
+        const float *right = centre + a;
+        for (int j = 0; j < cols; ++j)
+            out[j] += weight * (left[j] + right[j]);
+    }
+}
+
+// makes sure ring holds every horizontally blurred row it needs for output
+// row i, blurring any which are missing
+void advance(const cv::Mat &in, BlurRing &ring, int i, std::vector<float> &padded,
+             int pad)
+{
+    int rows = in.rows;
+    int cols = in.cols;
+    for (; ring.next <= i + ring.radius; ++ring.next)
+    {
+        const unsigned char *p =
+            in.ptr<unsigned char>(reflect101(ring.next, rows));
+        for (int j = -pad; j < cols + pad; ++j)
+            padded[j + pad] = p[reflect101(j, cols)];
+        blur_row(padded.data(), pad, cols, ring, ring.row(ring.next, cols));
+    }
+}
+
+// sums the vertical window of ring around row i, rounded to 8 bits like
+// cv::GaussianBlur's output
+void finish_row(BlurRing &ring, int i, int cols, std::vector<float> &acc,
+                unsigned char *out)
+{
+    int r = ring.radius;
+    std::fill(acc.begin(), acc.end(), 0.0f);
+    for (int a = -r; a <= r; ++a)
+    {
+        float weight = ring.kernel[r + a];
+        const float *src = ring.row(i + a, cols);
+        for (int j = 0; j < cols; ++j)
+            acc[j] += weight * src[j];
+    }
+    for (int j = 0; j < cols; ++j)
+    {
+        float v = acc[j] + 0.5f;
+        out[j] = v >= 255.0f ? 255 : static_cast<unsigned char>(v);
+    }
+}
+} // namespace
+
+void fused_significance(const cv::Mat &in, cv::Mat &mask, int L, int d,
+                        double sigma, cv::Mat *background, cv::Mat *signal,
+                        int num_threads)
+{
+    int rows = in.rows;
+    int cols = in.cols;
+    mask.create(rows, cols, CV_8UC1);
+    if (background)
+        background->create(rows, cols, CV_8UC1);
+    if (signal)
+        signal->create(rows, cols, CV_8UC1);
+
+    int pad = std::max(L, d) / 2;
+    SignificanceTable table(sigma);
+
+    // each band keeps its own rings, so a band re-blurs the few rows above it
+    // that the band before it already did
+    parallel_for(rows, num_threads, [&](int begin, int end) {
+        BlurRing ring_L(L, cols, begin);
+        BlurRing ring_d(d, cols, begin);
+        std::vector<float> padded(cols + 2 * pad);
+        std::vector<float> acc(cols);
+        std::vector<unsigned char> row_L(cols), row_d(cols);
+
+        for (int i = begin; i < end; ++i)
+        {
+            advance(in, ring_L, i, padded, pad);
+            advance(in, ring_d, i, padded, pad);
+
+            unsigned char *bg = background ? background->ptr<unsigned char>(i)
+                                           : row_L.data();
+            unsigned char *sig = signal ? signal->ptr<unsigned char>(i)
+                                        : row_d.data();
+            finish_row(ring_L, i, cols, acc, bg);
+            finish_row(ring_d, i, cols, acc, sig);
+
+            significance_row(sig, bg, mask.ptr<unsigned char>(i), cols, table);
+        }
+    });
+}
+
+} // namespace rrec
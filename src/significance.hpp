@@ -0,0 +1,78 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+#include "bitmask.hpp"
+
+namespace rrec
+{
+// the value a signal pixel has to exceed to be significant, given the local
+// background brightness. The standard deviation of the colours in the entire
+// (equalized) image is 73.9; if the background isn't 127.5 we're sampling from
+// a locally shifted distribution whose stddev drops to 0 at background 0 or
+// 255, and is linearly interpolated in between
+inline double significance_threshold(unsigned char background, double sigma)
+{
+    // the mean of the uniform distribution the original picture was eq'd to
+    const double mu = 127.5;
+    double difference = background > mu ? background - mu : mu - background;
+    double stdDev = 73.9 * (1 - difference / 127.5) * sigma;
+    return background + stdDev / 2;
+}
+
+// significance_threshold for every possible background value at one sigma.
+// Signal and background are both 8 bit, so the test collapses to
+// signal > limit[background]
+struct SignificanceTable
+{
+    double sigma;
+    unsigned char limit[256];
+
+    // false if some threshold was negative (only possible for sigma < 0) and
+    // doesn't fit in the table, in which case users fall back to doubles
+    bool exact;
+
+    explicit SignificanceTable(double sigma);
+};
+
+// writes the 0/255 significance of n pixels into out. Uses AVX2 (32 pixels at
+// a time) or SSSE3 (16 at a time) table lookups when compiled in
+void significance_row(const unsigned char *signal,
+                      const unsigned char *background, unsigned char *out,
+                      int n, const SignificanceTable &table);
+
+// significance mask of two CV_8UC1 images, via the table above
+void table_significance(const cv::Mat &signal, const cv::Mat &background,
+                        cv::Mat &mask, double sigma);
+
+// as above, but the mask comes out bit-packed, ready for clustering without
+// ever materialising a byte per pixel for the whole frame
+void table_significance(const cv::Mat &signal, const cv::Mat &background,
+                        PackedMask &mask, double sigma);
+
+// the original per-pixel floating point version, kept as a reference
+void reference_significance(const cv::Mat &signal, const cv::Mat &background,
+                            cv::Mat &mask, double sigma);
+
+// "exact statistics" significance: instead of interpolating the local stddev
+// from the background brightness, the true stddev of image over the
+// window*window box around each pixel (clipped at the edges) is used, and a
+// pixel is significant if signal > background + sigma * stddev / 2. The box
+// sums of image and image^2 are kept as running per-column sums and slid
+// across each row, so this is O(1) per pixel whatever the window. Rows are
+// split into num_threads bands (< 1 means one per core)
+void exact_significance(const cv::Mat &image, const cv::Mat &signal,
+                        const cv::Mat &background, cv::Mat &mask, int window,
+                        double sigma, int num_threads);
+
+// Difference of gaussians and significance test in one pass: the input is
+// streamed a row at a time through the separable L*L (background) and d*d
+// (signal) blurs, which keep only L and d horizontally blurred rows around in
+// ring buffers, and each finished row goes straight through the threshold into
+// mask (0/255, CV_8UC1). Blurs match cv::GaussianBlur(in, ., Size(k, k), 0) to
+// within rounding. background and signal are only written if non-null. The
+// rows are split into num_threads bands (< 1 means one per core)
+void fused_significance(const cv::Mat &in, cv::Mat &mask, int L, int d,
+                        double sigma, cv::Mat *background, cv::Mat *signal,
+                        int num_threads);
+} // namespace rrec
@@ -0,0 +1,396 @@
+#include "socket_server.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <iterator>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "parallel.hpp"
+
+namespace rrec
+{
+namespace
+{
+// most requests a session can have waiting before we stop reading from it
+constexpr std::size_t max_queued_requests = 256;
+
+// how much is read from a socket at a time
+constexpr std::size_t read_chunk = 1 << 16;
+
+// most reply bytes a session can have waiting to go before no more of its
+// requests are handled
+constexpr std::size_t max_pending_output = 1 << 26;
+
+// set by SIGINT/SIGTERM, so run() can return and the process exit normally
+volatile std::sig_atomic_t stop_requested = 0;
+
+void request_stop(int) { stop_requested = 1; }
+
+// sends what the socket takes without waiting: how much went, or -1 if the
+// client has gone
+ssize_t send_some(int fd, const unsigned char *data, std::size_t size)
+{
+    std::size_t sent = 0;
+    while (sent < size)
+    {
+        ssize_t n = send(fd, data + sent, size - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0)
+            return -1;
+        sent += n;
+    }
+    return sent;
+}
+} // namespace
+
+SocketServer::SocketServer(std::string path, int num_workers,
+                           std::size_t session_memory)
+    : path{path}, num_workers{resolve_threads(num_workers)},
+      session_memory{session_memory},
+      pipeline_budget{this->num_workers,
+                      std::max(1, resolve_threads(0) / this->num_workers)}
+{
+}
+
+SocketServer::~SocketServer()
+{
+    {
+        std::lock_guard<std::mutex> guard{lock};
+        stopping = true;
+    }
+    ready.notify_all();
+    for (auto &worker : workers)
+        worker.join();
+
+    for (auto &session : sessions)
+        ::close(session->fd);
+    if (listen_fd >= 0)
+    {
+        ::close(listen_fd);
+        unlink(path.c_str());
+    }
+    for (int fd : wake_fds)
+        if (fd >= 0)
+            ::close(fd);
+}
+
+bool SocketServer::run()
+{
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path))
+    {
+        std::cerr << "socket path too long: " << path << std::endl;
+        return false;
+    }
+    std::strcpy(address.sun_path, path.c_str());
+
+    // a socket left behind by a server that was killed would stop us binding
+    unlink(path.c_str());
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0 ||
+        bind(listen_fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+        listen(listen_fd, 64) != 0 || pipe2(wake_fds, O_CLOEXEC | O_NONBLOCK) != 0)
+    {
+        std::cerr << "couldn't listen on " << path << ": " << std::strerror(errno)
+                  << std::endl;
+        return false;
+    }
+
+    // SIGINT/SIGTERM stop the server. They're blocked everywhere but in
+    // ppoll below so they always land on this thread, and only while it's
+    // waiting (the workers inherit the blocked mask)
+    sigset_t stop_signals, waiting_mask;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &waiting_mask);
+    sigdelset(&waiting_mask, SIGINT);
+    sigdelset(&waiting_mask, SIGTERM);
+
+    struct sigaction action{};
+    action.sa_handler = request_stop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    for (int i = 0; i < num_workers; ++i)
+        workers.emplace_back(&SocketServer::work, this);
+
+    std::vector<pollfd> fds;
+    std::vector<std::shared_ptr<Session>> polled;
+    while (!stop_requested)
+    {
+        // sessions nobody's using any more, with all their replies sent.
+        // They're only destroyed once the lock has gone, as a session's
+        // pipeline finishes its frames first
+        std::vector<std::shared_ptr<Session>> finished;
+        {
+            std::lock_guard<std::mutex> guard{lock};
+
+            auto last = std::stable_partition(
+                sessions.begin(), sessions.end(), [](const std::shared_ptr<Session> &s) {
+                    return !(s->closed && !s->scheduled && s->output.empty());
+                });
+            finished.assign(std::make_move_iterator(last),
+                            std::make_move_iterator(sessions.end()));
+            sessions.erase(last, sessions.end());
+            for (auto &session : finished)
+                ::close(session->fd);
+        }
+        finished.clear();
+
+        fds.clear();
+        polled.clear();
+        fds.push_back({listen_fd, POLLIN, 0});
+        fds.push_back({wake_fds[0], POLLIN, 0});
+        {
+            std::lock_guard<std::mutex> guard{lock};
+            for (auto &session : sessions)
+            {
+                short events = (wants_input(*session) ? POLLIN : 0) |
+                               (session->output.empty() ? 0 : POLLOUT);
+                if (events != 0)
+                {
+                    fds.push_back({session->fd, events, 0});
+                    polled.push_back(session);
+                }
+            }
+        }
+
+        if (ppoll(fds.data(), fds.size(), nullptr, &waiting_mask) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "ppoll failed: " << std::strerror(errno) << std::endl;
+            return false;
+        }
+
+        if (fds[1].revents)
+        {
+            char drain[64];
+            while (read(wake_fds[0], drain, sizeof(drain)) > 0)
+                ;
+        }
+        if (fds[0].revents & POLLIN)
+            accept_session();
+
+        for (std::size_t i = 0; i < polled.size(); ++i)
+        {
+            const pollfd &polled_fd = fds[i + 2];
+            if (polled_fd.revents == 0)
+                continue;
+            if (polled_fd.events & POLLOUT)
+                flush_session(polled[i]);
+            if ((polled_fd.events & POLLIN) && !read_session(polled[i]))
+            {
+                std::lock_guard<std::mutex> guard{lock};
+                polled[i]->closed = true;
+            }
+        }
+    }
+    return true;
+}
+
+void SocketServer::accept_session()
+{
+    int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd < 0)
+        return;
+
+    auto session = std::make_shared<Session>(fd);
+    session->server.set_memory_cap(session_memory);
+    session->server.set_pipeline_budget(&pipeline_budget);
+
+    std::lock_guard<std::mutex> guard{lock};
+    sessions.push_back(session);
+}
+
+bool SocketServer::read_session(const std::shared_ptr<Session> &shared)
+{
+    Session &session = *shared;
+
+    std::size_t old_size = session.input.size();
+    session.input.resize(old_size + read_chunk);
+    ssize_t got = recv(session.fd, session.input.data() + old_size, read_chunk, 0);
+    if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        got = 0;
+    else if (got <= 0)
+        return false;
+    session.input.resize(old_size + got);
+
+    // cut off as many whole frames as there are
+    std::size_t pos = 0;
+    std::size_t limit = session_memory > 0
+                            ? std::min<std::size_t>(session_memory, max_frame_length)
+                            : max_frame_length;
+    std::vector<Session::Request> arrived;
+    bool ok = true;
+    while (session.input.size() - pos >= sizeof(FrameHeader))
+    {
+        Session::Request request;
+        std::memcpy(&request.header, &session.input[pos], sizeof(FrameHeader));
+        std::size_t length = request.header.length;
+        if (length < sizeof(FrameHeader) - 4 || length > limit)
+        {
+            // we can't tell where the next frame starts, so this is the
+            // last thing the session gets
+            request.error = "bad frame length.";
+            arrived.push_back(std::move(request));
+            ok = false;
+            break;
+        }
+        if (session.input.size() - pos < 4 + length)
+            break;
+
+        auto start = session.input.begin() + pos + sizeof(FrameHeader);
+        request.payload.assign(start, start + (length + 4 - sizeof(FrameHeader)));
+        arrived.push_back(std::move(request));
+        pos += 4 + length;
+    }
+    session.input.erase(session.input.begin(), session.input.begin() + pos);
+
+    if (!arrived.empty())
+    {
+        std::lock_guard<std::mutex> guard{lock};
+        for (auto &request : arrived)
+        {
+            session.queued_bytes += request.payload.size();
+            session.requests.push_back(std::move(request));
+        }
+        schedule(shared);
+    }
+    return ok;
+}
+
+void SocketServer::flush_session(const std::shared_ptr<Session> &session)
+{
+    std::lock_guard<std::mutex> guard{lock};
+    if (session->output.empty())
+        return;
+
+    ssize_t sent = send_some(session->fd, session->output.data(), session->output.size());
+    if (sent < 0)
+        drop_session(*session);
+    else
+        session->output.erase(session->output.begin(), session->output.begin() + sent);
+
+    // it may have been waiting for its output to go
+    schedule(session);
+}
+
+void SocketServer::drop_session(Session &session)
+{
+    // called with lock held
+    session.closed = true;
+    session.requests.clear();
+    session.queued_bytes = 0;
+    session.output.clear();
+}
+
+void SocketServer::schedule(const std::shared_ptr<Session> &session)
+{
+    // called with lock held
+    if (session->scheduled || session->requests.empty() ||
+        session->output.size() >= max_pending_output)
+        return;
+    session->scheduled = true;
+    run_queue.push_back(session);
+    ready.notify_one();
+}
+
+bool SocketServer::wants_input(const Session &session) const
+{
+    return !session.closed && session.requests.size() < max_queued_requests &&
+           (session_memory == 0 || session.queued_bytes < session_memory);
+}
+
+void SocketServer::work()
+{
+    std::unique_lock<std::mutex> guard{lock};
+    while (1 < 2)
+    {
+        ready.wait(guard, [this] { return stopping || !run_queue.empty(); });
+        if (stopping)
+            return;
+        std::shared_ptr<Session> session = run_queue.front();
+        run_queue.pop_front();
+
+        Session::Request request = std::move(session->requests.front());
+        session->requests.pop_front();
+        session->queued_bytes -= request.payload.size();
+        guard.unlock();
+
+        Server &server = session->server;
+        if (request.error.empty())
+        {
+            // whatever one client sends, it mustn't take the other sessions
+            // down with it. The detector may be half way through changing, so
+            // it's cleared rather than trusted
+            try
+            {
+                server.handle_frame(request.header.opcode, request.payload.data(),
+                                    request.payload.size());
+            }
+            catch (const std::exception &e)
+            {
+                server.clear_state();
+                server.reject(e.what());
+            }
+        }
+        else
+        {
+            server.reject(request.error);
+        }
+
+        std::vector<unsigned char> frame;
+        server.reply().append_frame(frame, request.header.opcode,
+                                    request.header.request_id);
+
+        // with nothing ahead of it the reply goes straight out, as far as
+        // the socket takes it. Only this worker adds to the session's
+        // output, and the reader only sends output that's there, so it's
+        // safe to send without the lock while the output is empty
+        guard.lock();
+        ssize_t sent = 0;
+        if (session->output.empty())
+        {
+            guard.unlock();
+            sent = send_some(session->fd, frame.data(), frame.size());
+            guard.lock();
+        }
+        if (sent < 0)
+            drop_session(*session); // nobody wants the rest
+        else
+            session->output.insert(session->output.end(), frame.begin() + sent,
+                                   frame.end());
+
+        // back of the queue, so one busy session can't starve the others
+        session->scheduled = false;
+        schedule(session);
+
+        // the reader may be waiting on this session to drain or finish, or
+        // have output to send
+        wake_reader();
+    }
+}
+
+void SocketServer::wake_reader()
+{
+    char poke = 0;
+    ssize_t ignored = write(wake_fds[1], &poke, 1);
+    (void)ignored;
+}
+} // namespace rrec
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "protocol.hpp"
+#include "server.hpp"
+
+namespace rrec
+{
+// One client of a SocketServer: its own Server (and so its own Detector),
+// plus the requests which have arrived but haven't been handled yet and the
+// replies the socket hasn't taken yet
+struct Session
+{
+    struct Request
+    {
+        FrameHeader header;
+        std::vector<unsigned char> payload;
+        std::string error; // if set, reply with this instead of handling it
+    };
+
+    explicit Session(int fd) : fd{fd} {}
+
+    int fd;
+    Server server;
+
+    std::vector<unsigned char> input; // bytes read that aren't a frame yet
+    std::deque<Request> requests;
+    std::size_t queued_bytes = 0; // payload bytes in requests
+    std::vector<unsigned char> output; // replies not sent yet
+
+    bool scheduled = false; // on the run queue or with a worker
+    bool closed = false;    // nothing more will be read from it
+};
+
+// The online server: listens on a Unix domain socket and speaks protocol
+// version 2 (see protocol.hpp) to any number of clients at once, each with
+// its own detector state.
+//
+// One thread does all the reading, cutting each session's input into
+// frames. A session with requests waiting goes on the run queue, and
+// num_workers threads take sessions off it and handle one request at a
+// time, so a session's requests are always handled in order but different
+// sessions run side by side.
+//
+// Sockets are non-blocking, so a client that doesn't read its replies can't
+// hold up a worker. The worker sends what the socket takes and leaves the
+// rest of the reply in the session's output, which the reading thread sends
+// as the client makes room; a session with a lot of output waiting isn't
+// run again until it's gone.
+//
+// Each session's detector is limited to session_memory bytes (0 for no
+// limit), as are the requests it has waiting. Once a session has that much
+// waiting the server stops reading from it until the workers catch up.
+//
+// A pipeline (see pipelineStart) brings three threads of its own, so at most
+// num_workers sessions may have one at a time, and their kernels get at most
+// an even share of the cores each.
+class SocketServer
+{
+  private:
+    std::string path;
+    int num_workers;
+    std::size_t session_memory;
+
+    // declared before sessions, whose servers give their slots back to it
+    PipelineBudget pipeline_budget;
+
+    int listen_fd = -1;
+    int wake_fds[2] = {-1, -1}; // pipe the workers poke to wake the reader
+
+    // everything below (and the sessions' queues and flags) is guarded by lock
+    std::mutex lock;
+    std::condition_variable ready;
+    std::deque<std::shared_ptr<Session>> run_queue;
+    std::vector<std::shared_ptr<Session>> sessions;
+    bool stopping = false;
+
+    std::vector<std::thread> workers;
+
+    void accept_session();
+    // reads what's there and queues any complete frames, false once the
+    // client has gone or sent something that isn't a frame
+    bool read_session(const std::shared_ptr<Session> &session);
+    // sends as much of the session's output as the socket takes
+    void flush_session(const std::shared_ptr<Session> &session);
+    // the client's gone: forgets its requests and replies
+    void drop_session(Session &session);
+    void schedule(const std::shared_ptr<Session> &session);
+    bool wants_input(const Session &session) const;
+    void work();
+    void wake_reader();
+
+  public:
+    // num_workers < 1 means one per core
+    SocketServer(std::string path, int num_workers, std::size_t session_memory);
+    ~SocketServer();
+
+    SocketServer(const SocketServer &) = delete;
+    SocketServer &operator=(const SocketServer &) = delete;
+
+    // serves clients until SIGINT or SIGTERM, false if the socket couldn't be
+    // set up
+    bool run();
+};
+} // namespace rrec
@@ -0,0 +1,162 @@
+#include "stats.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+
+namespace rrec
+{
+const char *stage_name(stage s)
+{
+    switch (s)
+    {
+    case stage::load:
+        return "load";
+    case stage::equalize:
+        return "equalize";
+    case stage::background:
+        return "background";
+    case stage::signal:
+        return "signal";
+    case stage::significance:
+        return "significance";
+    case stage::cluster:
+        return "cluster";
+    case stage::serialize:
+        return "serialize";
+    case stage::request:
+        return "request";
+    default:
+        return "unknown";
+    }
+}
+
+int Histogram::bucket_of(uint64_t ns)
+{
+    // 0..7 get a bucket each, after that each power of two is split into 8
+    if (ns < 8)
+        return static_cast<int>(ns);
+    int power = 63 - __builtin_clzll(ns);
+    int bucket = (power - 2) * 8 + static_cast<int>((ns >> (power - 3)) & 7);
+    return bucket < num_buckets ? bucket : num_buckets - 1;
+}
+
+uint64_t Histogram::bucket_floor(int bucket)
+{
+    if (bucket < 8)
+        return bucket;
+    int power = bucket / 8 + 2;
+    return static_cast<uint64_t>(8 + bucket % 8) << (power - 3);
+}
+
+void Histogram::record(uint64_t ns)
+{
+    buckets[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void Histogram::reset()
+{
+    for (auto &bucket : buckets)
+        bucket.store(0, std::memory_order_relaxed);
+}
+
+uint64_t Histogram::count() const
+{
+    uint64_t total = 0;
+    for (const auto &bucket : buckets)
+        total += bucket.load(std::memory_order_relaxed);
+    return total;
+}
+
+uint64_t Histogram::percentile(double fraction) const
+{
+    uint64_t total = count();
+    if (total == 0)
+        return 0;
+
+    // the rank we're after, counting from 1
+    uint64_t rank = static_cast<uint64_t>(fraction * total);
+    if (rank < 1)
+        rank = 1;
+
+    uint64_t seen = 0;
+    for (int b = 0; b < num_buckets; ++b)
+    {
+        seen += buckets[b].load(std::memory_order_relaxed);
+        if (seen >= rank)
+            return bucket_floor(b + 1) - 1; // the top of the bucket
+    }
+    return bucket_floor(num_buckets) - 1;
+}
+
+void Stats::record(stage s, uint64_t ns, uint64_t bytes)
+{
+    Counters &c = stages[static_cast<int>(s)];
+    c.calls.fetch_add(1, std::memory_order_relaxed);
+    c.total_ns.fetch_add(ns, std::memory_order_relaxed);
+    c.bytes.fetch_add(bytes, std::memory_order_relaxed);
+    c.latency.record(ns);
+}
+
+void Stats::reset()
+{
+    for (auto &c : stages)
+    {
+        c.calls.store(0, std::memory_order_relaxed);
+        c.total_ns.store(0, std::memory_order_relaxed);
+        c.bytes.store(0, std::memory_order_relaxed);
+        c.latency.reset();
+    }
+}
+
+std::string Stats::json() const
+{
+    std::ostringstream out;
+    out << "{";
+    for (int s = 0; s < static_cast<int>(stage::count); ++s)
+    {
+        const Counters &c = stages[s];
+        out << (s ? ", " : "") << "\"" << stage_name(static_cast<stage>(s))
+            << "\": {\"calls\": " << c.calls.load(std::memory_order_relaxed)
+            << ", \"total_ns\": " << c.total_ns.load(std::memory_order_relaxed)
+            << ", \"bytes\": " << c.bytes.load(std::memory_order_relaxed)
+            << ", \"p50_ns\": " << c.latency.percentile(0.5)
+            << ", \"p99_ns\": " << c.latency.percentile(0.99)
+            << ", \"max_ns\": " << c.latency.percentile(1.0) << "}";
+    }
+    out << "}";
+    return out.str();
+}
+
+void Stats::from_environment()
+{
+    const char *setting = std::getenv("RREC_STATS");
+    if (!setting || !*setting || std::string(setting) == "0")
+        return;
+
+    enable(true);
+    if (std::string(setting) != "1")
+    {
+        dump_path = setting;
+        std::atexit([] { global_stats().dump(); });
+    }
+}
+
+void Stats::dump() const
+{
+    if (dump_path.empty())
+        return;
+    FILE *file = std::fopen(dump_path.c_str(), "w");
+    if (!file)
+        return;
+    std::string text = json();
+    std::fprintf(file, "%s\n", text.c_str());
+    std::fclose(file);
+}
+
+Stats &global_stats()
+{
+    static Stats stats;
+    return stats;
+}
+} // namespace rrec
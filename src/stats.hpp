@@ -0,0 +1,123 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace rrec
+{
+// the parts of the pipeline that are timed
+enum class stage
+{
+    load,         // getting an image into image_main
+    equalize,     // adaptive histogram equalization
+    background,   // calculate_background
+    signal,       // calculate_signal
+    significance, // calculate_significance*, or all three in detect_significance
+    cluster,      // DBSCAN, whichever engine
+    serialize,    // turning clusters into the bytes sent to python
+    request,      // a whole server instruction, reading it to replying
+    count         // not a stage, the number of them
+};
+
+const char *stage_name(stage s);
+
+// Latency histogram with 8 buckets per power of two (so any percentile is
+// within ~6% of the truth) up to 2^42 ns, ~73 minutes. Safe to record into
+// from any number of threads at once
+class Histogram
+{
+  public:
+    static constexpr int num_buckets = 8 * 40;
+
+    void record(uint64_t ns);
+    void reset();
+
+    uint64_t count() const;
+    // the smallest latency at least fraction (0..1) of the recorded ones
+    // are no bigger than, to the histogram's resolution
+    uint64_t percentile(double fraction) const;
+
+  private:
+    std::array<std::atomic<uint64_t>, num_buckets> buckets{};
+
+    static int bucket_of(uint64_t ns);
+    static uint64_t bucket_floor(int bucket);
+};
+
+// Calls, time, bytes processed and a latency histogram for every stage.
+// Recording is off until enable() (or RREC_STATS, see from_environment), and
+// when it's off a StageTimer costs one relaxed load of a flag
+class Stats
+{
+  private:
+    struct Counters
+    {
+        std::atomic<uint64_t> calls{0};
+        std::atomic<uint64_t> total_ns{0};
+        std::atomic<uint64_t> bytes{0};
+        Histogram latency;
+    };
+
+    std::atomic<bool> on{false};
+    std::array<Counters, static_cast<int>(stage::count)> stages;
+    std::string dump_path; // where the JSON goes at exit, empty for nowhere
+
+  public:
+    bool enabled() const { return on.load(std::memory_order_relaxed); }
+    void enable(bool value) { on.store(value, std::memory_order_relaxed); }
+
+    void record(stage s, uint64_t ns, uint64_t bytes);
+    void reset();
+
+    // {"stage": {"calls": .., "total_ns": .., "bytes": .., "p50_ns": ..,
+    // "p99_ns": .., "max_ns": ..}, ...} on one line
+    std::string json() const;
+
+    // RREC_STATS=1 turns recording on. Anything else that isn't 0 is taken as
+    // a path, and the stats are also written there as JSON when we exit
+    void from_environment();
+    void dump() const;
+};
+
+// the one set of stats for the whole process, shared by every session
+Stats &global_stats();
+
+// Times its own lifetime into the global stats as one call of a stage.
+// bytes is how much data the stage went through, and can be added to later
+// (e.g. once the output size is known)
+class StageTimer
+{
+  private:
+    using clock = std::chrono::steady_clock;
+
+    stage which;
+    bool active;
+    clock::time_point start;
+
+  public:
+    uint64_t bytes;
+
+    explicit StageTimer(stage which, uint64_t bytes = 0)
+        : which{which}, active{global_stats().enabled()}, bytes{bytes}
+    {
+        if (active)
+            start = clock::now();
+    }
+    ~StageTimer()
+    {
+        if (active)
+        {
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                clock::now() - start);
+            global_stats().record(which, ns.count(), bytes);
+        }
+    }
+
+    StageTimer(const StageTimer &) = delete;
+    StageTimer &operator=(const StageTimer &) = delete;
+};
+} // namespace rrec
@@ -0,0 +1,89 @@
+#include "summed_area.hpp"
+
+#include <algorithm>
+#include <cstdint>
+
+#include "parallel.hpp"
+
+namespace rrec
+{
+
+SummedArea::SummedArea() : num_rows{0}, num_cols{0} {}
+
+SummedArea::SummedArea(const PackedMask &mask) { build(mask); }
+
+void SummedArea::build(const PackedMask &mask, int num_threads)
+{
+    num_rows = mask.rows();
+    num_cols = mask.cols();
+    int stride = num_cols + 1;
+    sums.assign(static_cast<size_t>(num_rows + 1) * stride, 0);
+
+    int num_bands = std::min(resolve_threads(num_threads), std::max(num_rows, 1));
+    std::vector<int> band_first_row(num_bands + 1);
+    for (int b = 0; b <= num_bands; ++b)
+        band_first_row[b] = static_cast<int>(static_cast<long long>(num_rows) *
+                                             b / num_bands);
+
+    // sum each band as if it were the top of the image
+    parallel_for(num_bands, num_bands, [&](int begin, int end) {
+        for (int b = begin; b < end; ++b)
+        {
+            for (int i = band_first_row[b]; i < band_first_row[b + 1]; ++i)
+            {
+                const uint64_t *r = mask.row(i);
+                int *out = &sums[static_cast<size_t>(i + 1) * stride];
+                const int *above = i > band_first_row[b] ? out - stride : nullptr;
+
+                int running = 0;
+                for (int j = 0; j < num_cols; ++j)
+                {
+                    running += (r[j >> 6] >> (j & 63)) & 1;
+                    out[j + 1] = running + (above ? above[j + 1] : 0);
+                }
+            }
+        }
+    });
+
+    if (num_bands <= 1)
+        return;
+
+    // the last row of every band above a band is what it's missing. Work out
+    // those offsets in order (one row per band), then add them in parallel
+    std::vector<std::vector<int>> offsets(num_bands, std::vector<int>(stride, 0));
+    for (int b = 1; b < num_bands; ++b)
+    {
+        const int *last = &sums[static_cast<size_t>(band_first_row[b]) * stride];
+        for (int j = 0; j < stride; ++j)
+            offsets[b][j] = offsets[b - 1][j] + last[j];
+    }
+
+    parallel_for(num_bands, num_bands, [&](int begin, int end) {
+        for (int b = std::max(begin, 1); b < end; ++b)
+        {
+            for (int i = band_first_row[b]; i < band_first_row[b + 1]; ++i)
+            {
+                int *out = &sums[static_cast<size_t>(i + 1) * stride];
+                for (int j = 0; j < stride; ++j)
+                    out[j] += offsets[b][j];
+            }
+        }
+    });
+}
+
+int SummedArea::count(int top, int left, int bottom, int right) const
+{
+    top = std::max(top, 0);
+    left = std::max(left, 0);
+    bottom = std::min(bottom, num_rows - 1);
+    right = std::min(right, num_cols - 1);
+    if (top > bottom || left > right)
+        return 0;
+
+    int stride = num_cols + 1;
+    const int *upper = &sums[static_cast<size_t>(top) * stride];
+    const int *lower = &sums[static_cast<size_t>(bottom + 1) * stride];
+    return lower[right + 1] - lower[left] - upper[right + 1] + upper[left];
+}
+
+} // namespace rrec
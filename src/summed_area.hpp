@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "bitmask.hpp"
+
+namespace rrec
+{
+// Summed area table of a PackedMask: the number of set pixels in any
+// rectangle in O(1), however big the rectangle is
+class SummedArea
+{
+  private:
+    int num_rows;
+    int num_cols;
+
+    // (rows + 1) x (cols + 1), sums[(i + 1) * (cols + 1) + j + 1] is the
+    // number of set pixels in rows 0..i, cols 0..j (the first row and column
+    // are 0 so lookups don't need any special cases)
+    std::vector<int> sums;
+
+  public:
+    SummedArea();
+    explicit SummedArea(const PackedMask &mask);
+
+    // rows are summed in bands on num_threads threads (< 1 means one per
+    // core), then the bands are offset by the totals of the bands above them
+    void build(const PackedMask &mask, int num_threads = 1);
+
+    int rows() const { return num_rows; }
+    int cols() const { return num_cols; }
+
+    // number of set pixels in rows top..bottom, cols left..right (inclusive),
+    // clipped to the image. Empty rectangles count 0
+    int count(int top, int left, int bottom, int right) const;
+
+    // number of set pixels within radius r of (i, j) along both axes, i.e.
+    // in the (2r + 1) x (2r + 1) square centred on it
+    int count_around(int i, int j, int r) const
+    {
+        return count(i - r, j - r, i + r, j + r);
+    }
+
+    std::size_t bytes() const { return sums.capacity() * sizeof(int); }
+};
+} // namespace rrec
@@ -0,0 +1,142 @@
+#include "synthetic.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+
+#include "pic.hpp"
+
+namespace rrec
+{
+std::vector<TruthPoint> synthetic_pic(const SyntheticParams &params,
+                                      std::vector<float> &pixels)
+{
+    const int rows = params.rows;
+    const int cols = params.cols;
+    const double pi = 3.14159265358979323846;
+    std::mt19937 rng(params.seed);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    std::normal_distribution<double> gaussian(0.0, 1.0);
+
+    // each lattice site has sqrt(3) / 2 * spacing^2 of the frame to itself,
+    // of which fill * pi * radius^2 is skyrmion on average
+    double spacing = params.spacing;
+    if (params.density > 0)
+        spacing = std::sqrt(params.fill * pi * params.radius * params.radius /
+                            (params.density * std::sqrt(3.0) / 2));
+
+    // lattice vectors 60 degrees apart, and a random offset of the whole
+    // lattice so a skyrmion doesn't always sit on the centre pixel
+    const double a = params.angle * pi / 180;
+    const double v1_row = std::sin(a) * spacing;
+    const double v1_col = std::cos(a) * spacing;
+    const double v2_row = std::sin(a + pi / 3) * spacing;
+    const double v2_col = std::cos(a + pi / 3) * spacing;
+    const double u = uniform(rng);
+    const double v = uniform(rng);
+    const double origin_row = rows / 2.0 + u * v1_row + v * v2_row;
+    const double origin_col = cols / 2.0 + u * v1_col + v * v2_col;
+
+    // every site that could land in the frame. The random numbers are drawn
+    // for every site whether it's used or not, so changing fill doesn't move
+    // the skyrmions that are left
+    std::vector<TruthPoint> truth;
+    const int n = static_cast<int>(std::hypot(rows, cols) / spacing) + 2;
+    for (int p = -n; p <= n; ++p)
+    {
+        for (int q = -n; q <= n; ++q)
+        {
+            bool present = uniform(rng) < params.fill;
+            double row = origin_row + p * v1_row + q * v2_row +
+                         gaussian(rng) * params.jitter * spacing;
+            double col = origin_col + p * v1_col + q * v2_col +
+                         gaussian(rng) * params.jitter * spacing;
+
+            if (present && row >= -0.5 && row < rows - 0.5 && col >= -0.5 &&
+                col < cols - 0.5)
+                truth.push_back({row, col});
+        }
+    }
+
+    // background: a plane through level at the centre
+    pixels.assign(static_cast<std::size_t>(rows) * cols, 0.0f);
+    for (int i = 0; i < rows; ++i)
+    {
+        float *row = &pixels[static_cast<std::size_t>(i) * cols];
+        double y = rows > 1 ? double(i) / (rows - 1) - 0.5 : 0;
+        for (int j = 0; j < cols; ++j)
+        {
+            double x = cols > 1 ? double(j) / (cols - 1) - 0.5 : 0;
+            row[j] = static_cast<float>(params.level + params.gradient_row * y +
+                                        params.gradient_col * x);
+        }
+    }
+
+    // each skyrmion is a disk with a soft (tanh) wall, drawn out to where the
+    // wall has all but died away
+    const double reach = params.radius + 4 * params.wall;
+    for (const TruthPoint &s : truth)
+    {
+        int top = std::max(0, static_cast<int>(std::floor(s.row - reach)));
+        int bottom = std::min(rows - 1, static_cast<int>(std::ceil(s.row + reach)));
+        int left = std::max(0, static_cast<int>(std::floor(s.col - reach)));
+        int right = std::min(cols - 1, static_cast<int>(std::ceil(s.col + reach)));
+        for (int i = top; i <= bottom; ++i)
+        {
+            float *row = &pixels[static_cast<std::size_t>(i) * cols];
+            for (int j = left; j <= right; ++j)
+            {
+                double r = std::hypot(i - s.row, j - s.col);
+                if (r > reach)
+                    continue;
+                row[j] += static_cast<float>(
+                    params.contrast * 0.5 *
+                    (1 - std::tanh((r - params.radius) / params.wall)));
+            }
+        }
+    }
+
+    // uneven illumination darkens everything towards the corners, then the
+    // camera adds its noise. Intensities can't go below 0
+    for (int i = 0; i < rows; ++i)
+    {
+        float *row = &pixels[static_cast<std::size_t>(i) * cols];
+        double y = rows > 1 ? 2.0 * i / (rows - 1) - 1 : 0;
+        for (int j = 0; j < cols; ++j)
+        {
+            double x = cols > 1 ? 2.0 * j / (cols - 1) - 1 : 0;
+            double light = 1 - params.vignette * (x * x + y * y) / 2;
+            double value = row[j] * light + gaussian(rng) * params.noise;
+            row[j] = static_cast<float>(std::max(0.0, value));
+        }
+    }
+
+    return truth;
+}
+
+std::vector<TruthPoint> synthetic_frame(const SyntheticParams &params,
+                                        cv::Mat &out, float cutoff)
+{
+    std::vector<float> pixels;
+    std::vector<TruthPoint> truth = synthetic_pic(params, pixels);
+
+    out.create(params.rows, params.cols, CV_8UC1);
+    for (int i = 0; i < params.rows; ++i)
+        pic_to_gray(&pixels[static_cast<std::size_t>(i) * params.cols],
+                    out.ptr<unsigned char>(i), params.cols, cutoff);
+    return truth;
+}
+
+bool write_truth(const std::string &path, const std::vector<TruthPoint> &truth)
+{
+    FILE *file = std::fopen(path.c_str(), "w");
+    if (!file)
+        return false;
+
+    bool ok = std::fprintf(file, "row,col\n") > 0;
+    for (const TruthPoint &s : truth)
+        ok = ok && std::fprintf(file, "%.3f,%.3f\n", s.row, s.col) > 0;
+    return std::fclose(file) == 0 && ok;
+}
+} // namespace rrec
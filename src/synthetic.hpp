@@ -0,0 +1,60 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+
+namespace rrec
+{
+// Everything that goes into a synthetic frame. Intensities are in .pic units
+// (the camera's raw floats, which read_pic maps to 0..255 with a cutoff of 900
+// by default). The skyrmions sit on a triangular lattice, like they do in the
+// real films
+struct SyntheticParams
+{
+    int rows = 1296;
+    int cols = 1728;
+
+    double spacing = 32;  // lattice constant, pixels
+    double density = 0;   // if > 0, the fraction of the frame the skyrmions
+                          // cover, with spacing worked out to match
+    double angle = 0;     // lattice rotation, degrees
+    double jitter = 0.08; // stddev of each skyrmion's displacement, in spacings
+    double fill = 1.0;    // fraction of lattice sites with a skyrmion on them
+
+    double radius = 6; // pixels from the centre to the middle of the wall
+    double wall = 1.5; // wall width, pixels (the profile is a tanh step)
+
+    double level = 350;    // background at the centre of the frame
+    double contrast = 250; // skyrmion centre minus background (< 0 for dark)
+    double gradient_row = 120; // background change from top to bottom
+    double gradient_col = 80;  // and from left to right
+    double vignette = 0.2;     // fraction of the background lost at the corners
+    double noise = 40;         // stddev of the gaussian noise on every pixel
+
+    unsigned seed = 1;
+};
+
+// where a skyrmion really is, in the same {row, col} pixel coordinates as a
+// cluster's centroid
+struct TruthPoint
+{
+    double row;
+    double col;
+};
+
+// renders a frame of rows*cols .pic floats (row by row) into pixels, and
+// returns the centres of every skyrmion whose centre is inside the frame.
+// The same params (seed included) always give the same frame
+std::vector<TruthPoint> synthetic_pic(const SyntheticParams &params,
+                                      std::vector<float> &pixels);
+
+// as above, but the frame comes out as the CV_8UC1 image read_pic would have
+// made of it with this cutoff
+std::vector<TruthPoint> synthetic_frame(const SyntheticParams &params,
+                                        cv::Mat &out, float cutoff = 900);
+
+// writes the truth as "row,col" lines under a header line. Returns false if
+// the file can't be written
+bool write_truth(const std::string &path, const std::vector<TruthPoint> &truth);
+} // namespace rrec
@@ -0,0 +1,41 @@
+#include "workspace.hpp"
+
+#include <algorithm>
+
+namespace rrec
+{
+
+void FlagImage::assign(int rows, int cols, int value)
+{
+    num_cols = cols;
+    flags.assign(static_cast<size_t>(rows) * cols, value);
+}
+
+std::size_t ClusterWorkspace::bytes() const
+{
+    std::size_t total = 0;
+    total += clusterPoints.capacity() * sizeof(clusterPoints[0]);
+    total += perimPoints.capacity() * sizeof(perimPoints[0]);
+    total += corePoints.capacity() * sizeof(corePoints[0]);
+    total += pointFlags.bytes();
+    total += thresh.bytes() + coreMask.bytes();
+
+    total += labelling.runs.capacity() * sizeof(Run);
+    total += labelling.row_start.capacity() * sizeof(int);
+    total += labelling.first_run.capacity() * sizeof(int);
+    total += labelling.parent.capacity() * sizeof(int);
+    total += seeds.capacity() * sizeof(long long);
+
+    total += density.bytes() + coreDensity.bytes();
+    total += (parent.capacity() + rootLabel.capacity() + cellLabel.capacity()) *
+             sizeof(int);
+
+    total += found.capacity() * sizeof(found[0]);
+    for (const auto &band : found)
+        total += band.capacity() * sizeof(band[0]);
+    return total;
+}
+
+void ClusterWorkspace::update_peak() { peak = std::max(peak, bytes()); }
+
+} // namespace rrec
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <vector>
+
+#include "bitmask.hpp"
+#include "labelling.hpp"
+#include "summed_area.hpp"
+
+namespace rrec
+{
+// per pixel labels for DBSCAN, one contiguous block indexed [i][j]
+class FlagImage
+{
+  private:
+    std::vector<int> flags;
+    int num_cols = 0;
+
+  public:
+    // resizes to rows x cols and sets every pixel to value. Only reallocates
+    // if the image is bigger than anything seen before
+    void assign(int rows, int cols, int value);
+
+    int *operator[](int i) { return &flags[static_cast<size_t>(i) * num_cols]; }
+    const int *operator[](int i) const
+    {
+        return &flags[static_cast<size_t>(i) * num_cols];
+    }
+
+    std::size_t bytes() const { return flags.capacity() * sizeof(int); }
+};
+
+// Everything DBSCAN needs besides the clusters it returns. The Detector owns
+// one and hands it to each DBSCAN, so the buffers are allocated once (at the
+// size of the biggest frame seen) and then reused frame after frame
+struct ClusterWorkspace
+{
+    // the dbscan engine's stacks of points for the cluster being grown
+    std::vector<std::array<int, 2>> clusterPoints;
+    std::vector<std::array<int, 2>> perimPoints;
+    std::vector<std::array<int, 2>> corePoints;
+
+    FlagImage pointFlags;
+
+    PackedMask thresh;   // the input, when it has to be packed first
+    PackedMask coreMask; // core points
+
+    // union_find engine
+    Labelling labelling;
+    std::vector<long long> seeds;
+
+    // grid engine
+    SummedArea density;
+    SummedArea coreDensity;
+    std::vector<int> parent;
+    std::vector<int> rootLabel;
+    std::vector<int> cellLabel;
+
+    // perimeter points found by each band of rows: (cluster, i, j)
+    std::vector<std::vector<std::array<int, 3>>> found;
+
+    // bytes currently held by the buffers above, and the most they've held
+    std::size_t bytes() const;
+    std::size_t peak_bytes() const { return peak; }
+
+    // records the current size if it's the biggest yet, DBSCAN calls this
+    // once it's finished with the workspace
+    void update_peak();
+
+  private:
+    std::size_t peak = 0;
+};
+} // namespace rrec